@@ -0,0 +1,340 @@
+/*
+ * Copyright (c) 2024 Nils Zweiling
+ *
+ * This file is part of fusecache which is released under the MIT license.
+ * See file LICENSE or go to https://github.com/zwodev/fusecache/tree/master/LICENSE
+ * for full license details.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string.h>
+#include <algorithm>
+#include <filesystem>
+#include <tuple>
+#include <vector>
+
+#include "Helper.h"
+#include "SparseFile.h"
+#include "ContentStore.h"
+#include "CacheEvictor.h"
+
+CacheEvictor::CacheEvictor(Log* log)
+{
+	m_log = log;
+}
+
+CacheEvictor::~CacheEvictor()
+{
+	stop();
+}
+
+void CacheEvictor::start()
+{
+	if (!isEnabled() || m_isRunning) {
+		return;
+	}
+
+	m_isRunning = true;
+	m_thread = std::thread(&CacheEvictor::run, this);
+}
+
+void CacheEvictor::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_isRunning = false;
+	}
+	m_wakeUp.notify_all();
+
+	if (m_thread.joinable()) {
+		m_thread.join();
+	}
+}
+
+void CacheEvictor::add(const std::string& path, uint64_t size)
+{
+	if (!isEnabled()) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto it = m_entries.find(path);
+	if (it == m_entries.end()) {
+		m_lists[T1].push_front(path);
+		m_entries[path] = Entry { T1, size, m_lists[T1].begin(), time(0) };
+		m_listBytes[T1] += size;
+	}
+	else {
+		Entry& entry = it->second;
+		time_t now = time(0);
+		bool isRepeated = entry.referencedAt != now;
+		entry.referencedAt = now;
+
+		// a ghost hit shifts the target size towards the list that lost it
+		if (entry.list == B1) {
+			double ratio = std::max(1.0, (double)m_listBytes[B2] / std::max((uint64_t)1, m_listBytes[B1]));
+			uint64_t limit = m_maxBytes > 0 ? m_maxBytes : UINT64_MAX;
+			m_targetT1Bytes = std::min(limit, m_targetT1Bytes + (uint64_t)(ratio * size));
+		}
+		else if (entry.list == B2) {
+			double ratio = std::max(1.0, (double)m_listBytes[B1] / std::max((uint64_t)1, m_listBytes[B2]));
+			uint64_t delta = (uint64_t)(ratio * size);
+			m_targetT1Bytes = m_targetT1Bytes > delta ? m_targetT1Bytes - delta : 0;
+		}
+
+		m_listBytes[entry.list] -= entry.size;
+		entry.size = size;
+		m_listBytes[entry.list] += entry.size;
+		if (isRepeated || entry.list == B1 || entry.list == B2) {
+			moveTo(path, entry, T2);
+		}
+	}
+
+	trimGhosts();
+	if (needsEviction(0.9)) {
+		m_wakeUp.notify_all();
+	}
+}
+
+void CacheEvictor::touch(const std::string& path)
+{
+	if (!isEnabled()) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto it = m_entries.find(path);
+	if (it != m_entries.end() && (it->second.list == T1 || it->second.list == T2)) {
+		time_t now = time(0);
+		if (it->second.referencedAt != now) {
+			it->second.referencedAt = now;
+			moveTo(path, it->second, T2);
+		}
+	}
+}
+
+void CacheEvictor::remove(const std::string& path)
+{
+	if (!isEnabled()) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto it = m_entries.find(path);
+	if (it != m_entries.end()) {
+		Entry& entry = it->second;
+		m_lists[entry.list].erase(entry.position);
+		m_listBytes[entry.list] -= entry.size;
+		m_entries.erase(it);
+	}
+}
+
+void CacheEvictor::moveTo(const std::string& path, Entry& entry, ListType list)
+{
+	m_lists[entry.list].erase(entry.position);
+	m_listBytes[entry.list] -= entry.size;
+
+	m_lists[list].push_front(path);
+	entry.list = list;
+	entry.position = m_lists[list].begin();
+	m_listBytes[list] += entry.size;
+}
+
+void CacheEvictor::trimGhosts()
+{
+	size_t maxGhosts = std::max((size_t)1024, m_lists[T1].size() + m_lists[T2].size());
+	while (m_lists[B1].size() + m_lists[B2].size() > maxGhosts) {
+		ListType list = m_lists[B1].size() > m_lists[B2].size() ? B1 : B2;
+		std::string path = m_lists[list].back();
+		m_listBytes[list] -= m_entries[path].size;
+		m_lists[list].pop_back();
+		m_entries.erase(path);
+	}
+}
+
+bool CacheEvictor::needsEviction(double fraction)
+{
+	uint64_t bytes = m_listBytes[T1] + m_listBytes[T2];
+	uint64_t files = m_lists[T1].size() + m_lists[T2].size();
+	return (m_maxBytes > 0 && bytes > m_maxBytes * fraction)
+		|| (m_maxFiles > 0 && files > m_maxFiles * fraction);
+}
+
+std::string CacheEvictor::evictOne()
+{
+	ListType first = T2;
+	if (m_listBytes[T1] > 0 && (m_listBytes[T1] > m_targetT1Bytes || m_lists[T2].empty())) {
+		first = T1;
+	}
+	ListType second = first == T1 ? T2 : T1;
+
+	for (ListType list : { first, second }) {
+		for (auto it = m_lists[list].rbegin(); it != m_lists[list].rend(); ++it) {
+			std::string path = *it;
+			if (m_isPinned && m_isPinned(path)) {
+				continue;
+			}
+
+			moveTo(path, m_entries[path], list == T1 ? B1 : B2);
+			trimGhosts();
+			return path;
+		}
+	}
+
+	return std::string();
+}
+
+void CacheEvictor::deleteFiles(const std::string& path)
+{
+	std::string cachePath = m_cacheDir + path;
+	m_log->debug("EVICT: %s", cachePath.c_str());
+
+	if (m_index) {
+		m_index->erase(path);
+	}
+	unlink(cachePath.c_str());
+	unlink(SparseFile::dataFilePath(cachePath).c_str());
+	unlink(SparseFile::blockMapPath(cachePath).c_str());
+}
+
+void CacheEvictor::run()
+{
+	scan();
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (m_isRunning) {
+		m_wakeUp.wait_for(lock, std::chrono::seconds(1));
+
+		// start early so that the limit itself is never reached
+		if (!needsEviction(0.9)) {
+			continue;
+		}
+
+		int count = 0;
+		while (m_isRunning && needsEviction(0.8)) {
+			std::string path = evictOne();
+			if (path.empty()) {
+				break;
+			}
+
+			lock.unlock();
+			deleteFiles(path);
+			lock.lock();
+			count++;
+		}
+		m_log->info("EVICTED %i files - cache size: %llu bytes", count,
+			(unsigned long long)(m_listBytes[T1] + m_listBytes[T2]));
+
+		if (count > 0 && m_onEvicted) {
+			lock.unlock();
+			m_onEvicted();
+			lock.lock();
+		}
+	}
+}
+
+void CacheEvictor::scan()
+{
+	// only indexed files and files that are identical to their origin are clean read cache files
+	std::vector<std::tuple<time_t, std::string, uint64_t>> files;
+	std::error_code ec;
+	auto options = std::filesystem::directory_options::skip_permission_denied;
+	for (auto it = std::filesystem::recursive_directory_iterator(m_cacheDir, options, ec);
+		it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+		if (ec) {
+			continue;
+		}
+
+		std::string cachePath = it->path().u8string();
+		std::string path = cachePath.substr(m_cacheDir.size());
+		if (ContentStore::isStorePath(path)) {
+			it.disable_recursion_pending();
+			continue;
+		}
+		if (!it->is_regular_file(ec)) {
+			continue;
+		}
+		struct stat sb;
+		if (lstat(cachePath.c_str(), &sb) == -1) {
+			continue;
+		}
+
+		if (hasSuffix(path, SPARSE_SUFFIX)) {
+			path = path.substr(0, path.size() - strlen(SPARSE_SUFFIX));
+			files.emplace_back(sb.st_atim.tv_sec, path, (uint64_t)sb.st_blocks * 512);
+		}
+		else if (!isInternalFile(path)) {
+			IndexEntry entry;
+			if (m_index && m_index->lookup(path, entry)) {
+				// files linked to the content store keep the modification time of the stored object
+				if ((entry.originMtime == sb.st_mtim.tv_sec || sb.st_nlink > 1) && entry.originSize == (uint64_t)sb.st_size) {
+					files.emplace_back(sb.st_atim.tv_sec, path, (uint64_t)sb.st_size);
+				}
+				continue;
+			}
+
+			struct stat sb_orig;
+			if (m_origin && m_origin->stat(path.c_str(), &sb_orig) == 0 && sb_orig.st_size == sb.st_size
+				&& sb_orig.st_mtim.tv_sec == sb.st_mtim.tv_sec) {
+				files.emplace_back(sb.st_atim.tv_sec, path, (uint64_t)sb.st_size);
+			}
+		}
+	}
+
+	std::sort(files.begin(), files.end());
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (auto& file : files) {
+		const std::string& path = std::get<1>(file);
+		if (m_entries.count(path) == 0) {
+			m_lists[T1].push_front(path);
+			m_entries[path] = Entry { T1, std::get<2>(file), m_lists[T1].begin(), 0 };
+			m_listBytes[T1] += std::get<2>(file);
+		}
+	}
+
+	m_log->info("CACHE SCAN - %zu files, %llu bytes", m_lists[T1].size() + m_lists[T2].size(),
+		(unsigned long long)(m_listBytes[T1] + m_listBytes[T2]));
+}
+
+void CacheEvictor::setCacheDir(const std::string& cacheDir)
+{
+	m_cacheDir = cacheDir;
+}
+
+void CacheEvictor::setOrigin(Origin* origin)
+{
+	m_origin = origin;
+}
+
+void CacheEvictor::setMaxBytes(uint64_t maxBytes)
+{
+	m_maxBytes = maxBytes;
+}
+
+void CacheEvictor::setMaxFiles(uint64_t maxFiles)
+{
+	m_maxFiles = maxFiles;
+}
+
+void CacheEvictor::setIndex(CacheIndex* index)
+{
+	m_index = index;
+}
+
+void CacheEvictor::setOnEvicted(std::function<void()> onEvicted)
+{
+	m_onEvicted = onEvicted;
+}
+
+void CacheEvictor::setIsPinned(std::function<bool(const std::string&)> isPinned)
+{
+	m_isPinned = isPinned;
+}
+
+bool CacheEvictor::isEnabled() const
+{
+	return m_maxBytes > 0 || m_maxFiles > 0;
+}
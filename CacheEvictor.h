@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2024 Nils Zweiling
+ *
+ * This file is part of fusecache which is released under the MIT license.
+ * See file LICENSE or go to https://github.com/zwodev/fusecache/tree/master/LICENSE
+ * for full license details.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <list>
+
+#include "Log.h"
+#include "CacheIndex.h"
+#include "Origin.h"
+
+// Keeps the read cache below a size and file count limit. Files are ranked
+// with ARC (adaptive replacement cache): files seen once and files seen
+// repeatedly live in separate LRU lists, and ghost lists of recently evicted
+// files steer how much room each side gets, so one-off scans cannot flush
+// the working set. Only references in a later second than the previous one
+// count as repeated, so the reads right after an open do not promote a file.
+// Eviction runs on a background thread.
+class CacheEvictor
+{
+
+public:
+    CacheEvictor(Log* log);
+    ~CacheEvictor();
+
+    void start();
+    void stop();
+
+    void add(const std::string& path, uint64_t size);
+    void touch(const std::string& path);
+    void remove(const std::string& path);
+
+    void setCacheDir(const std::string& cacheDir);
+    void setOrigin(Origin* origin);
+    void setMaxBytes(uint64_t maxBytes);
+    void setMaxFiles(uint64_t maxFiles);
+    void setIndex(CacheIndex* index);
+    void setIsPinned(std::function<bool(const std::string&)> isPinned);
+    void setOnEvicted(std::function<void()> onEvicted);
+    bool isEnabled() const;
+
+private:
+    enum ListType { T1, T2, B1, B2 };
+
+    struct Entry
+    {
+        ListType list;
+        uint64_t size;
+        std::list<std::string>::iterator position;
+        time_t referencedAt;
+    };
+
+    void run();
+    void scan();
+    bool needsEviction(double fraction);
+    std::string evictOne();
+    void moveTo(const std::string& path, Entry& entry, ListType list);
+    void trimGhosts();
+    void deleteFiles(const std::string& path);
+
+private:
+    Log* m_log = nullptr;
+    CacheIndex* m_index = nullptr;
+    std::mutex m_mutex;
+    std::condition_variable m_wakeUp;
+    std::thread m_thread;
+    bool m_isRunning = false;
+    std::function<bool(const std::string&)> m_isPinned;
+    std::function<void()> m_onEvicted;
+    std::string m_cacheDir;
+    Origin* m_origin = nullptr;
+    uint64_t m_maxBytes = 0;
+    uint64_t m_maxFiles = 0;
+
+    std::unordered_map<std::string, Entry> m_entries;
+    std::list<std::string> m_lists[4];
+    uint64_t m_listBytes[4] = { 0, 0, 0, 0 };
+    uint64_t m_targetT1Bytes = 0;
+};
@@ -0,0 +1,285 @@
+/*
+ * Copyright (c) 2024 Nils Zweiling
+ *
+ * This file is part of fusecache which is released under the MIT license.
+ * See file LICENSE or go to https://github.com/zwodev/fusecache/tree/master/LICENSE
+ * for full license details.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <mutex>
+#include <vector>
+
+#include "Helper.h"
+#include "CacheIndex.h"
+
+static const char INDEX_MAGIC[8] = { 'F', 'C', 'I', 'N', 'D', 'E', 'X', '1' };
+
+enum RecordType : uint8_t { RECORD_PUT = 1, RECORD_ERASE = 2, RECORD_PUT_HASHED = 3 };
+
+static void appendBytes(std::vector<char>& buf, const void* data, size_t size)
+{
+	const char* bytes = (const char*)data;
+	buf.insert(buf.end(), bytes, bytes + size);
+}
+
+static void encodeRecord(std::vector<char>& buf, uint8_t op, const std::string& path, const IndexEntry* entry)
+{
+	if (op == RECORD_PUT && entry->hasContentHash) {
+		op = RECORD_PUT_HASHED;
+	}
+
+	uint16_t pathLen = (uint16_t)path.size();
+	appendBytes(buf, &op, sizeof(op));
+	appendBytes(buf, &pathLen, sizeof(pathLen));
+	appendBytes(buf, path.data(), pathLen);
+	if (op != RECORD_ERASE) {
+		appendBytes(buf, &entry->originMtime, sizeof(entry->originMtime));
+		appendBytes(buf, &entry->originSize, sizeof(entry->originSize));
+		appendBytes(buf, &entry->validatedAt, sizeof(entry->validatedAt));
+	}
+	if (op == RECORD_PUT_HASHED) {
+		appendBytes(buf, entry->contentHash, sizeof(entry->contentHash));
+	}
+}
+
+CacheIndex::CacheIndex(Log* log)
+{
+	m_log = log;
+}
+
+CacheIndex::~CacheIndex()
+{
+	close();
+}
+
+int CacheIndex::open(const std::string& indexPath)
+{
+	std::unique_lock<std::shared_mutex> lock(m_mutex);
+	m_indexPath = indexPath;
+	m_fd = ::open(indexPath.c_str(), O_RDWR | O_CREAT, 0644);
+	if (m_fd < 0) {
+		m_log->error("INDEX ERROR - cannot open: %s", indexPath.c_str());
+		return -1;
+	}
+	if (load() == -1) {
+		return -1;
+	}
+
+	std::lock_guard<std::mutex> threadLock(m_threadMutex);
+	if (!m_isRunning) {
+		m_isRunning = true;
+		m_thread = std::thread(&CacheIndex::run, this);
+	}
+	return 0;
+}
+
+void CacheIndex::close()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_threadMutex);
+		m_isRunning = false;
+	}
+	m_wakeUp.notify_all();
+	if (m_thread.joinable()) {
+		m_thread.join();
+	}
+
+	std::unique_lock<std::shared_mutex> lock(m_mutex);
+	if (m_fd >= 0) {
+		::close(m_fd);
+		m_fd = -1;
+	}
+}
+
+// Checks once per second whether the log needs to be compacted, so that
+// rewriting it never happens on the paths of the file operations.
+void CacheIndex::run()
+{
+	std::unique_lock<std::mutex> lock(m_threadMutex);
+	while (m_isRunning) {
+		m_wakeUp.wait_for(lock, std::chrono::seconds(1));
+		if (!m_isRunning) {
+			break;
+		}
+
+		lock.unlock();
+		compact();
+		lock.lock();
+	}
+}
+
+int CacheIndex::load()
+{
+	struct stat sb;
+	if (fstat(m_fd, &sb) == -1) {
+		return -1;
+	}
+
+	std::vector<char> data(sb.st_size);
+	if (sb.st_size > 0 && pread(m_fd, data.data(), data.size(), 0) != (ssize_t)data.size()) {
+		return -1;
+	}
+
+	// start a new log if there is none or it is not ours
+	if (data.size() < sizeof(INDEX_MAGIC) || memcmp(data.data(), INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0) {
+		if (ftruncate(m_fd, 0) == -1 || pwrite(m_fd, INDEX_MAGIC, sizeof(INDEX_MAGIC), 0) != sizeof(INDEX_MAGIC)) {
+			return -1;
+		}
+		lseek(m_fd, sizeof(INDEX_MAGIC), SEEK_SET);
+		return 0;
+	}
+
+	size_t pos = sizeof(INDEX_MAGIC);
+	size_t entrySize = sizeof(int64_t) + sizeof(uint64_t) + sizeof(int64_t);
+	while (pos + sizeof(uint8_t) + sizeof(uint16_t) <= data.size()) {
+		uint8_t op;
+		uint16_t pathLen;
+		memcpy(&op, &data[pos], sizeof(op));
+		memcpy(&pathLen, &data[pos + sizeof(op)], sizeof(pathLen));
+		size_t recordSize = sizeof(op) + sizeof(pathLen) + pathLen;
+		if (op == RECORD_PUT) {
+			recordSize += entrySize;
+		}
+		else if (op == RECORD_PUT_HASHED) {
+			recordSize += entrySize + sizeof(IndexEntry::contentHash);
+		}
+		if ((op != RECORD_PUT && op != RECORD_ERASE && op != RECORD_PUT_HASHED) || pos + recordSize > data.size()) {
+			break;
+		}
+
+		std::string path(&data[pos + sizeof(op) + sizeof(pathLen)], pathLen);
+		if (op != RECORD_ERASE) {
+			IndexEntry entry;
+			const char* values = &data[pos + sizeof(op) + sizeof(pathLen) + pathLen];
+			memcpy(&entry.originMtime, values, sizeof(entry.originMtime));
+			memcpy(&entry.originSize, values + sizeof(int64_t), sizeof(entry.originSize));
+			memcpy(&entry.validatedAt, values + sizeof(int64_t) + sizeof(uint64_t), sizeof(entry.validatedAt));
+			if (op == RECORD_PUT_HASHED) {
+				entry.hasContentHash = true;
+				memcpy(entry.contentHash, values + entrySize, sizeof(entry.contentHash));
+			}
+			m_entries[path] = entry;
+		}
+		else {
+			m_entries.erase(path);
+		}
+		m_recordCount++;
+		pos += recordSize;
+	}
+
+	// drop a record that was cut off by a crash
+	if (pos < data.size() && ftruncate(m_fd, pos) == -1) {
+		return -1;
+	}
+	lseek(m_fd, pos, SEEK_SET);
+
+	m_log->info("INDEX LOADED - %zu entries from %zu records", m_entries.size(), m_recordCount);
+	return 0;
+}
+
+bool CacheIndex::lookup(const std::string& path, IndexEntry& entry)
+{
+	std::shared_lock<std::shared_mutex> lock(m_mutex);
+	auto it = m_entries.find(path);
+	if (it == m_entries.end()) {
+		return false;
+	}
+
+	entry = it->second;
+	return true;
+}
+
+void CacheIndex::put(const std::string& path, const IndexEntry& entry)
+{
+	std::unique_lock<std::shared_mutex> lock(m_mutex);
+	m_entries[path] = entry;
+	append(RECORD_PUT, path, &entry);
+}
+
+void CacheIndex::erase(const std::string& path)
+{
+	std::unique_lock<std::shared_mutex> lock(m_mutex);
+	if (m_entries.erase(path) > 0) {
+		append(RECORD_ERASE, path, nullptr);
+	}
+}
+
+size_t CacheIndex::size()
+{
+	std::shared_lock<std::shared_mutex> lock(m_mutex);
+	return m_entries.size();
+}
+
+void CacheIndex::append(uint8_t op, const std::string& path, const IndexEntry* entry)
+{
+	if (m_fd < 0 || path.size() > UINT16_MAX) {
+		return;
+	}
+
+	std::vector<char> buf;
+	encodeRecord(buf, op, path, entry);
+	if (write(m_fd, buf.data(), buf.size()) != (ssize_t)buf.size()) {
+		m_log->error("INDEX ERROR - cannot append to: %s", m_indexPath.c_str());
+		return;
+	}
+
+	m_recordCount++;
+	if (m_isCompacting) {
+		m_pendingRecords.insert(m_pendingRecords.end(), buf.begin(), buf.end());
+		m_pendingCount++;
+	}
+}
+
+void CacheIndex::compact()
+{
+	// the snapshot is taken while no one can change the entries
+	std::vector<char> buf;
+	size_t snapshotCount = 0;
+	{
+		std::shared_lock<std::shared_mutex> lock(m_mutex);
+		if (m_fd < 0 || m_isCompacting || m_recordCount <= 2 * m_entries.size() + 1024) {
+			return;
+		}
+
+		appendBytes(buf, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+		for (auto& it : m_entries) {
+			encodeRecord(buf, RECORD_PUT, it.first, &it.second);
+		}
+		snapshotCount = m_entries.size();
+		m_isCompacting = true;
+	}
+
+	// the new log has to be on disk before it replaces the old one
+	std::string tmpPath = m_indexPath + ".tmp";
+	int fd = ::open(tmpPath.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	bool isWritten = fd >= 0 && write(fd, buf.data(), buf.size()) == (ssize_t)buf.size() && fsync(fd) == 0;
+
+	std::unique_lock<std::shared_mutex> lock(m_mutex);
+	m_isCompacting = false;
+	std::vector<char> pending;
+	pending.swap(m_pendingRecords);
+	size_t pendingCount = m_pendingCount;
+	m_pendingCount = 0;
+
+	// records appended in the meantime are replayed on top of the snapshot
+	if (isWritten && m_fd >= 0) {
+		isWritten = pending.empty() || write(fd, pending.data(), pending.size()) == (ssize_t)pending.size();
+	}
+	if (!isWritten || m_fd < 0 || rename(tmpPath.c_str(), m_indexPath.c_str()) == -1) {
+		if (fd >= 0) {
+			::close(fd);
+		}
+		unlink(tmpPath.c_str());
+		m_log->error("INDEX ERROR - cannot compact: %s", m_indexPath.c_str());
+		return;
+	}
+
+	::close(m_fd);
+	m_fd = fd;
+	m_recordCount = snapshotCount + pendingCount;
+}
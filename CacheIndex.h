@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2024 Nils Zweiling
+ *
+ * This file is part of fusecache which is released under the MIT license.
+ * See file LICENSE or go to https://github.com/zwodev/fusecache/tree/master/LICENSE
+ * for full license details.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <condition_variable>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Log.h"
+
+struct IndexEntry
+{
+    int64_t originMtime = 0;
+    uint64_t originSize = 0;
+    int64_t validatedAt = 0;
+    bool hasContentHash = false;
+    uint8_t contentHash[32] = {};
+};
+
+// Remembers which origin version every complete read cache file belongs to,
+// and with the content store enabled the hash of its content.
+// Entries are kept in memory and persisted as an append-only log that is
+// replayed on startup. Once the log is mostly stale records, a background
+// thread rewrites it from a snapshot. Records appended while the snapshot
+// is written are carried over.
+class CacheIndex
+{
+
+public:
+    CacheIndex(Log* log);
+    ~CacheIndex();
+
+    int open(const std::string& indexPath);
+    void close();
+
+    bool lookup(const std::string& path, IndexEntry& entry);
+    void put(const std::string& path, const IndexEntry& entry);
+    void erase(const std::string& path);
+    size_t size();
+
+private:
+    void run();
+    int load();
+    void append(uint8_t op, const std::string& path, const IndexEntry* entry);
+    void compact();
+
+private:
+    Log* m_log = nullptr;
+    std::shared_mutex m_mutex;
+    std::thread m_thread;
+    std::mutex m_threadMutex;
+    std::condition_variable m_wakeUp;
+    bool m_isRunning = false;
+    std::unordered_map<std::string, IndexEntry> m_entries;
+    std::string m_indexPath;
+    int m_fd = -1;
+    size_t m_recordCount = 0;
+    bool m_isCompacting = false;
+    std::vector<char> m_pendingRecords;
+    size_t m_pendingCount = 0;
+};
@@ -9,120 +9,165 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <poll.h>
 #include <utime.h>
 #include <time.h>
 #include <sys/types.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <string.h>
 #include <algorithm>
 #include <filesystem>
-#include <array>
+#include <sstream>
 
 #include "Helper.h"
+#include "FileCopy.h"
+#include "IoUring.h"
+#include "DeltaCopy.h"
+#include "Signature.h"
 #include "CacheManager.h"
 
-bool exec(std::string cmd, std::string& result) {
-    std::array<char, 128> buffer;
-    std::unique_ptr<FILE, decltype(&pclose)> pipe(popen(cmd.c_str(), "r"), pclose);
-    if (!pipe) {
-        return false;
-    }
-    while (fgets(buffer.data(), static_cast<int>(buffer.size()), pipe.get()) != nullptr) {
-        result += buffer.data();
-    }
-    return true;
-}
-
 CacheManager::CacheManager(Log* log)
+	: m_evictor(log)
+	, m_index(log)
+	, m_syncEngine(log)
+	, m_prefetcher(log)
+	, m_controlServer(log)
+	, m_contentStore(log)
+	, m_metrics(log)
 {
 	m_log = log;
+	m_origin.reset(new Origin(log));
+	setMaxUpBandwidth(1.0f);
+	setMaxDownBandwidth(1.0f);
+	setCompressSkip("7z,aac,avif,bz2,flac,gif,gz,heic,jpeg,jpg,jxl,lz4,m4a,mkv,mov,mp3,mp4,ogg,png,rar,tgz,usdz,webm,webp,xz,zip,zst");
+
+	// background fills pause between chunks while more urgent fills need the link
+	m_downLimiter.setOnAcquire([this] { m_fillScheduler.yield(); });
 }
 
 CacheManager::~CacheManager()
 {
     stop();
+	if (m_writeCacheDirFd >= 0 && m_writeCacheDirFd != m_origin->dirFd()) {
+		close(m_writeCacheDirFd);
+	}
 }
 
-bool CacheManager::canPartFileBeDeleted(const std::string& path) 
+// The fill that owns a part file holds an exclusive lock on it until the
+// file is renamed into place. A part file that can be locked was left
+// behind by a fill that died.
+bool CacheManager::removeStalePartFile(const std::string& partPath)
 {
-	// file is not cached yet
-	if (access(path.c_str(), F_OK) >= 0) {
-		struct stat sb;
-		int res = lstat(path.c_str(), &sb);
-		if (res == -1) {
-			return true;
-		}
+	int fd = open(partPath.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return errno == ENOENT;
+	}
 
-		time_t now = time(0);
-		double diff = difftime(now, sb.st_mtim.tv_sec);
-		
-		// part file has not been updated since > 2 min
-		if (diff > 120.0) {
-			return true;
-		} 
+	bool isStale = false;
+	if (flock(fd, LOCK_EX | LOCK_NB) == 0) {
+		// make sure the name was not reused by a new fill in the meantime
+		struct stat sb_fd;
+		struct stat sb_path;
+		isStale = fstat(fd, &sb_fd) == 0 && lstat(partPath.c_str(), &sb_path) == 0
+			&& sb_fd.st_ino == sb_path.st_ino && sb_fd.st_dev == sb_path.st_dev;
+		if (isStale) {
+			m_log->info("STALE part file removed: %s", partPath.c_str());
+			unlink(partPath.c_str());
+		}
 	}
+	close(fd);
 
-	return false;
+	return isStale;
 }
 
-int CacheManager::waitForFile(const char *path) 
+int CacheManager::createPartFile(const std::string& partPath)
 {
-	
-    std::string partPath = partFilePath(path);
-	if (access(partPath.c_str(), F_OK) >= 0) {
-		float timeout_in_secs = 15.0f * 60.0f;
-		int wait_in_secs = 30;
-		int count = (int)(timeout_in_secs / (float)wait_in_secs);
-		while (count > 0) {
-			if (access(partPath.c_str(), F_OK) == -1) {
-				return 0;
-			}
-			else if (canPartFileBeDeleted(partPath)) {
-				remove(partPath.c_str());
-				return 0;
-			}
-			count -= 1;
-			sleep(wait_in_secs);
+	// create the file unnamed and lock it before it becomes visible to other instances
+	std::string dir = std::filesystem::path(partPath).parent_path().u8string();
+	int fd = open(dir.c_str(), O_TMPFILE | O_RDWR, 0666);
+	if (fd >= 0) {
+		flock(fd, LOCK_EX);
+		std::string fdPath = "/proc/self/fd/" + std::to_string(fd);
+		if (linkat(AT_FDCWD, fdPath.c_str(), AT_FDCWD, partPath.c_str(), AT_SYMLINK_FOLLOW) == 0) {
+			return fd;
+		}
+
+		int saved_errno = errno;
+		close(fd);
+		if (saved_errno == EEXIST) {
+			errno = saved_errno;
+			return -1;
 		}
-		return -1;
 	}
 
-	return 0;
+	// filesystems without O_TMPFILE leave a short window before the lock is taken
+	fd = open(partPath.c_str(), O_RDWR | O_CREAT | O_EXCL, 0666);
+	if (fd >= 0) {
+		flock(fd, LOCK_EX);
+	}
+	return fd;
 }
 
-int msleep(long msec)
+int CacheManager::waitForFile(const char *path) 
 {
-    struct timespec ts;
-    int res;
+	// fills of this process are joined in copyFileOnDemand
+	{
+		std::lock_guard<std::mutex> guard(m_copyJobsMutex);
+		if (m_copyJobs.count(path) > 0) {
+			return 0;
+		}
+	}
 
-    if (msec < 0)
-    {
-        errno = EINVAL;
-        return -1;
-    }
+    std::string partPath = partFilePath(path);
+	if (access(partPath.c_str(), F_OK) == -1) {
+		return 0;
+	}
+
+	// another instance is filling this file, wake up when its part file goes away or is closed
+	std::filesystem::path part(partPath);
+	int notifyFd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+	if (notifyFd >= 0 && inotify_add_watch(notifyFd, part.parent_path().c_str(), IN_MOVED_FROM | IN_DELETE | IN_CLOSE_WRITE) == -1) {
+		close(notifyFd);
+		notifyFd = -1;
+	}
 
-    ts.tv_sec = msec / 1000;
-    ts.tv_nsec = (msec % 1000) * 1000000;
+	m_log->debug("WAITING for part file: %s", partPath.c_str());
+	int res = -1;
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::minutes(15);
+	while (std::chrono::steady_clock::now() < deadline) {
+		if (access(partPath.c_str(), F_OK) == -1 || removeStalePartFile(partPath)) {
+			res = 0;
+			break;
+		}
 
-    do {
-        res = nanosleep(&ts, &ts);
-    } while (res && errno == EINTR);
+		// the owner's lock is checked again every second in case an event is missed
+		struct pollfd pfd = { notifyFd, POLLIN, 0 };
+		if (notifyFd < 0) {
+			std::this_thread::sleep_for(std::chrono::seconds(1));
+		}
+		else if (poll(&pfd, 1, 1000) > 0) {
+			char buf[4096];
+			while (read(notifyFd, buf, sizeof(buf)) > 0) {
+			}
+		}
+	}
 
-    return res;
+	if (notifyFd >= 0) {
+		close(notifyFd);
+	}
+	return res;
 }
 
-int CacheManager::copyFile(const char *from, const char *to)
+int CacheManager::copyFile(const char *filePath, const char *to)
 {
-	const int BUF_SIZE = 20480;
-	const double goalTime = ((double)BUF_SIZE) / (1024.0f * 1024.0f * m_maxUpBandwidth);
-	
-	clock_t start, end;	
     int fd_to, fd_from;
-    char buf[BUF_SIZE];
-    ssize_t nread;
     int saved_errno;
+    int res;
 
-    fd_from = open(from, O_RDONLY);
+    fd_from = m_origin->openFile(filePath, O_RDONLY);
     if (fd_from < 0) {
         return -1;
 	}
@@ -134,185 +179,358 @@ int CacheManager::copyFile(const char *from, const char *to)
 	}
     catch (const std::filesystem::filesystem_error& err)
     {
-		m_log->error(formatStr("Error creating dirs: %s\nException: %s", dir, err.what()));
+		m_log->error("Error creating dirs: %s\nException: %s", dir.c_str(), err.what());
     }
     catch (const std::exception& ex)
     {
-		m_log->error(formatStr("Error creating dirs: %s\nException: Unknown", dir));
+		m_log->error("Error creating dirs: %s\nException: Unknown", dir.c_str());
     }
 
-    fd_to = open(toPart.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0666);
+    fd_to = createPartFile(toPart);
     if (fd_to < 0)
         goto out_error;
 
-    while (true)
+    // the lock on the part file is held until it is renamed into place
+    res = copyDelta(filePath, to, fd_from, fd_to);
+    if (res == 1)
+        res = copyFileData(fd_from, fd_to, &m_downLimiter);
+    if (res == 0)
     {
-		start = clock();
-		nread = read(fd_from, buf, sizeof buf);
-		if (nread <= 0)
-			break;
-
-		end = clock();
-		double time = ((double)(end - start)) / (double) CLOCKS_PER_SEC;
-		double diff = goalTime - time;
-
-        char *out_ptr = buf;
-        ssize_t nwritten;
-
-        do {
-            nwritten = write(fd_to, out_ptr, nread);
-
-            if (nwritten >= 0)
-            {
-                nread -= nwritten;
-                out_ptr += nwritten;
-            }
-            else if (errno != EINTR)
-            {
-                goto out_error;
-            }
-        } while (nread > 0);
-
-		if (diff > 0) {
-			long msecs = (long)(diff * 1000.0);
-			msleep(msecs);
+		m_log->debug("COPY SUCCESS - rename part file: %s", toPart.c_str());
+		if (rename(toPart.c_str(), to) == 0)
+		{
+			close(fd_to);
+			close(fd_from);
+			return 0;
 		}
     }
 
-    if (nread == 0)
-    {
-        if (close(fd_to) < 0)
-        {
-            fd_to = -1;
-            goto out_error;
-        }
-        close(fd_from);
-
-		m_log->debug(formatStr("COPY SUCCESS - rename part file: %s", toPart.c_str()));
-		rename(toPart.c_str(), to);
-        return 0;
-    }
-
   out_error:
     saved_errno = errno;
 
     close(fd_from);
     if (fd_to >= 0) {
+        unlink(toPart.c_str());
         close(fd_to);
 	}
 
-	m_log->error(formatStr("COPY ERROR - delete part file: %s", toPart.c_str()));
+	m_log->error("COPY ERROR - delete part file: %s", toPart.c_str());
     errno = saved_errno;
     return -1;
 }
 
-bool CacheManager::needsCopy(const std::string& path) 
+// Refills a stale cache file from its old version when the origin has an
+// up to date signature. Returns 1 with the part file left empty when the
+// whole file has to be copied instead.
+int CacheManager::copyDelta(const char *filePath, const char *to, int fdFrom, int fdTo)
 {
-	bool needs_copy = false;
+	if (!m_delta || access(to, F_OK) == -1) {
+		return 1;
+	}
 
-    const char* from = origFilePath(path).c_str();
-    const char* to = readCacheFilePath(path).c_str();
-	
+	struct stat sb_from;
+	Signature sig;
+	if (fstat(fdFrom, &sb_from) == -1 || loadSignature(filePath, sig) == -1 || !sig.matches(sb_from)) {
+		return 1;
+	}
 
-	// file is not cached yet
-	if (access(to, F_OK) == -1) {
-		needs_copy = true;
+	int fdOld = open(to, O_RDONLY);
+	if (fdOld < 0) {
+		return 1;
 	}
-	// file is cached but maybe there is a newer version
-	else {
+
+	DeltaStats stats;
+	int res = copyFileDelta(fdFrom, fdOld, fdTo, sig, &m_downLimiter, stats);
+	close(fdOld);
+	if (res == -1) {
+		m_log->warning("DELTA ERROR - copying the whole file: %s", filePath);
+		return ftruncate(fdTo, 0) == 0 ? 1 : -1;
+	}
+
+	m_log->info("DELTA %s - reused: %llu bytes fetched: %llu bytes", filePath,
+		(unsigned long long)stats.reusedBytes, (unsigned long long)stats.fetchedBytes);
+	return 0;
+}
+
+int CacheManager::needsCopy(const char *filePath) 
+{
+	std::string to = readCacheFilePath(filePath);
+	time_t now = time(0);
+
+	// known cache files are validated from the index with at most one origin stat
+	IndexEntry entry;
+	if (m_index.lookup(filePath, entry)) {
+		if (now - entry.validatedAt < m_revalidateInterval) {
+			return 0;
+		}
+
+		Metrics::count(METRIC_REVALIDATIONS);
 		struct stat sb_from;
-		struct stat sb_to;
-		int res_from = lstat(from, &sb_from);
-		int res_to = lstat(to, &sb_to);
-		if (res_from == -1 || res_to == -1) {
+		if (m_origin->stat(filePath, &sb_from) == -1) {
+			m_log->debug("Result Stat - From: %i", -1);
 			return -1;
 		}
+		if (sb_from.st_mtim.tv_sec != entry.originMtime || (uint64_t)sb_from.st_size != entry.originSize) {
+			return 1;
+		}
 
-		float diff = difftime(sb_to.st_mtim.tv_sec, sb_from.st_mtim.tv_sec);
-		
-		// is origin file newer or has different file size
-		if (diff != 0 || (sb_from.st_size != sb_to.st_size)) {
-			needs_copy = true;
-		} 
+		entry.validatedAt = now;
+		m_index.put(filePath, entry);
+		return 0;
+	}
+
+	// file is not cached yet
+	if (access(to.c_str(), F_OK) == -1) {
+		return 1;
+	}
 
+	// file is cached but maybe there is a newer version
+	Metrics::count(METRIC_REVALIDATIONS);
+	struct stat sb_from;
+	struct stat sb_to;
+	int res_from = m_origin->stat(filePath, &sb_from);
+	int res_to = lstat(to.c_str(), &sb_to);
+	if (res_from == -1 || res_to == -1) {
+		m_log->debug("Result Stat - From: %i To: %i", res_from, res_to);
+		return -1;
 	}
 
-	return needs_copy;
+	float diff = difftime(sb_to.st_mtim.tv_sec, sb_from.st_mtim.tv_sec);
+	m_log->debug("Time Diff: %g \n", diff);
+	
+	// is origin file newer or has different file size
+	if (diff < 0 || (sb_from.st_size != sb_to.st_size)) {
+		return 1;
+	}
+
+	// linked files share their modification time and are only trusted through the index
+	if (sb_to.st_nlink > 1 && diff != 0) {
+		return 1;
+	}
+
+	// files that were modified locally are not indexed
+	if (diff == 0) {
+		m_index.put(filePath, IndexEntry { sb_from.st_mtim.tv_sec, (uint64_t)sb_from.st_size, now });
+	}
+
+	return 0;
 }
 
-int CacheManager::copyFileOnDemand(const char *from, const char *to) 
+// Reads the signature the origin publishes for a file. It is transferred
+// like file data, so it passes the download limit.
+int CacheManager::loadSignature(const char *filePath, Signature& sig)
 {
-	std::lock_guard<std::mutex> guard(m_copyMutex);
-	int res = 0;
-	bool needs_copy = false;
-	m_isCopying = true;
+	int fd = m_origin->openFile(Signature::sigPath("", filePath).c_str(), O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
 
-	// file is not cached yet
-	if (access(to, F_OK) == -1) {
-		needs_copy = true;
+	struct stat sb;
+	if (fstat(fd, &sb) == 0) {
+		m_downLimiter.acquire(sb.st_size);
+	}
+	int res = sig.load(fd);
+	close(fd);
+	return res;
+}
+
+// Links the cache file to stored content when the signature on the origin
+// names content that is cached already, so nothing has to be transferred.
+int CacheManager::linkContent(const char *filePath)
+{
+	struct stat sb_from;
+	Signature sig;
+	if (m_origin->stat(filePath, &sb_from) == -1 || loadSignature(filePath, sig) == -1 || !sig.matches(sb_from)) {
+		return -1;
+	}
+	if (m_contentStore.linkTo(sig.fileHash(), readCacheFilePath(filePath)) == -1) {
+		return -1;
+	}
+
+	IndexEntry entry { sb_from.st_mtim.tv_sec, (uint64_t)sb_from.st_size, time(0) };
+	entry.hasContentHash = true;
+	memcpy(entry.contentHash, sig.fileHash(), sizeof(entry.contentHash));
+	m_index.put(filePath, entry);
+
+	m_log->debug("DEDUP hit: %s", filePath);
+	return 0;
+}
+
+// Adds a copied file to the content store, which replaces it with a link
+// when the same content is stored already. The hash is taken from the
+// signature on the origin if there is one.
+void CacheManager::storeContent(const char *filePath, const struct stat& sb_from, IndexEntry& entry)
+{
+	std::string to = readCacheFilePath(filePath);
+	uint8_t hash[Sha256::DIGEST_SIZE];
+	Signature sig;
+	if (loadSignature(filePath, sig) == 0 && sig.matches(sb_from)) {
+		memcpy(hash, sig.fileHash(), sizeof(hash));
 	}
-	// file is cached but maybe there is a newer version
 	else {
-		struct stat sb_from;
-		struct stat sb_to;
-		int res_from = lstat(from, &sb_from);
-		int res_to = lstat(to, &sb_to);
-		if (res_from == -1 || res_to == -1) {
-			m_log->debug(formatStr("Result Stat - From: %i To: %i", res_from, res_to));
-			m_isCopying = false;
-			return -1;
+		int fd = open(to.c_str(), O_RDONLY);
+		if (fd < 0) {
+			return;
 		}
+		int res = ContentStore::hashFile(fd, hash);
+		close(fd);
+		if (res == -1) {
+			return;
+		}
+	}
+
+	if (m_contentStore.add(hash, to) == 0) {
+		entry.hasContentHash = true;
+		memcpy(entry.contentHash, hash, sizeof(entry.contentHash));
+	}
+}
+
+// Cache files that share their content through the content store are
+// copied before they are modified in place.
+int CacheManager::unshareFile(const std::string& filePath)
+{
+	std::string cachePath = readCacheFilePath(filePath);
+	struct stat sb;
+	if (!m_dedup || lstat(cachePath.c_str(), &sb) == -1 || !S_ISREG(sb.st_mode) || sb.st_nlink < 2) {
+		return 0;
+	}
 
-		float diff = difftime(sb_to.st_mtim.tv_sec, sb_from.st_mtim.tv_sec);
-		m_log->debug(formatStr("Time Diff: %g \n", diff));
-		// is origin file newer or has different file size
-		if (diff < 0 || (sb_from.st_size != sb_to.st_size)) {
-			needs_copy = true;
-		} 
+	std::string tmp = cachePath + ".unshare" + PART_SUFFIX;
+	int fd_from = open(cachePath.c_str(), O_RDONLY);
+	if (fd_from < 0) {
+		return -1;
+	}
+	int fd_to = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, sb.st_mode & 07777);
+	if (fd_to < 0) {
+		close(fd_from);
+		return -1;
+	}
 
+	struct timespec times[2] = { sb.st_atim, sb.st_mtim };
+	int res = copyFileData(fd_from, fd_to, nullptr);
+	if (res == 0) {
+		res = futimens(fd_to, times);
 	}
+	close(fd_from);
+	if (close(fd_to) == -1) {
+		res = -1;
+	}
+	if (res == 0) {
+		res = rename(tmp.c_str(), cachePath.c_str());
+	}
+	if (res == -1) {
+		m_log->error("DEDUP ERROR - cannot unshare: %s", cachePath.c_str());
+		unlink(tmp.c_str());
+		return -1;
+	}
+
+	m_log->debug("DEDUP unshared: %s", cachePath.c_str());
+	return 0;
+}
+
+int CacheManager::fillFile(const char *filePath, CopyJob& job)
+{
+	std::string from = origFilePath(filePath);
+	std::string to = readCacheFilePath(filePath);
 
-	if (needs_copy) {
-		m_log->debug(formatStr("COPYING file from: %s to: %s", from, to));
-		res = copyFile(from, to);
-		if (access(to, F_OK) >= 0) {
+	m_fillScheduler.acquire(job.ticket);
+
+	// another fill may have finished while we were waiting for a slot
+	int res = needsCopy(filePath);
+	if (res == 1 && m_dedup && linkContent(filePath) == 0) {
+		res = 0;
+	}
+	else if (res == 1) {
+		m_index.erase(filePath);
+		m_log->debug("COPYING file from: %s to: %s", from.c_str(), to.c_str());
+		res = copyFile(filePath, to.c_str());
+		Metrics::count(res == 0 ? METRIC_FILLS : METRIC_FILL_ERRORS);
+
+		// a failed refresh leaves the old copy unindexed, so it is checked again
+		if (res == 0 && access(to.c_str(), F_OK) >= 0) {
 			struct stat sb_from;
-			struct stat sb_to;
-			int res_from = lstat(from, &sb_from);
-			int res_to = lstat(to, &sb_to);
-			if (res_from == -1 || res_to == -1) {
-				m_isCopying = false;
-				return -1;
+			int res_from = m_origin->stat(filePath, &sb_from);
+			if (res_from == -1) {
+				res = -1;
 			}
-			struct utimbuf tb;
-			tb.actime = sb_from.st_atim.tv_sec;
-			tb.modtime = sb_from.st_mtim.tv_sec;
-			res = utime(to, &tb);
-			if (res == -1) {
-				m_isCopying = false;
-				return -1;
+			else {
+				struct utimbuf tb;
+				tb.actime = sb_from.st_atim.tv_sec;
+				tb.modtime = sb_from.st_mtim.tv_sec;
+				res = utime(to.c_str(), &tb);
+				if (res == 0) {
+					IndexEntry entry { sb_from.st_mtim.tv_sec, (uint64_t)sb_from.st_size, time(0) };
+					if (m_dedup) {
+						storeContent(filePath, sb_from, entry);
+					}
+					m_index.put(filePath, entry);
+				}
 			}
 		}
 		else {
-			m_isCopying = false;
-			return -1;
+			res = -1;
 		}
 	}
 
-	m_isCopying = false;
-	return res;
+	m_fillScheduler.release(job.ticket);
+
+	return res == -1 ? -1 : 0;
 }
 
-bool CacheManager::checkDependencies()
+int CacheManager::copyFileOnDemand(const char *filePath, FillClass fillClass) 
 {
-	std::string rsyncCommand = "rsync -V";
-	std::string result;
-	if (!exec(rsyncCommand, result)) {
-		m_log->debug("ERROR - RSYNC not installed.");
-		return false;
+	// cache hits are decided without taking any shared lock
+	int res = needsCopy(filePath);
+	if (fillClass == FILL_OPEN && res >= 0) {
+		Metrics::count(res == 0 ? METRIC_CACHE_HITS : METRIC_CACHE_MISSES);
+	}
+	if (res != 1) {
+		return res;
 	}
 
-	return true;
+	std::string to = readCacheFilePath(filePath);
+	std::shared_ptr<CopyJob> job;
+	bool isOwner = false;
+	{
+		std::lock_guard<std::mutex> guard(m_copyJobsMutex);
+		auto it = m_copyJobs.find(to);
+		if (it != m_copyJobs.end()) {
+			job = it->second;
+		}
+		else {
+			job = std::make_shared<CopyJob>();
+			job->ticket.fillClass = fillClass;
+			m_copyJobs[to] = job;
+			isOwner = true;
+		}
+	}
+
+	// join the copy of this file that is already running
+	if (!isOwner) {
+		m_log->debug("JOINING running copy: %s", to.c_str());
+
+		// a more urgent fill that joins a background fill must not wait behind it
+		m_fillScheduler.promote(job->ticket, fillClass);
+
+		std::unique_lock<std::mutex> lock(job->mutex);
+		job->finished.wait(lock, [&job] { return job->isDone; });
+		return job->result;
+	}
+
+	res = fillFile(filePath, *job);
+
+	{
+		std::lock_guard<std::mutex> guard(m_copyJobsMutex);
+		m_copyJobs.erase(to);
+	}
+	{
+		std::lock_guard<std::mutex> lock(job->mutex);
+		job->result = res;
+		job->isDone = true;
+	}
+	job->finished.notify_all();
+
+	return res;
 }
 
 void CacheManager::createDirectories()
@@ -330,53 +548,97 @@ void CacheManager::createDirectories()
 	std::filesystem::create_directories(dir);
 }
 
-void CacheManager::run()
+void CacheManager::start()
 {
-    std::string rsyncCommand = "rsync -auv ";
-	if (m_maxDownBandwidth > 0) {
-		int maxDown = (int)(m_maxDownBandwidth * 1024.0f);
-		rsyncCommand += "--bwlimit=" + std::to_string(maxDown);
+	// the handlers resolve paths relative to these, so the kernel does not walk the root prefix every time
+	if (m_origin->open(rootPath()) == -1) {
+		m_log->error("Cannot open origin directory: %s", rootPath().c_str());
 	}
-	
-	rsyncCommand += " ";
-	rsyncCommand += "--exclude='*.part'";
-	rsyncCommand += " ";
-	rsyncCommand += writeCacheDir() + "/";
-	rsyncCommand += " ";
-	rsyncCommand += rootPath();
-
-	while(m_isRunning) {
-		std::string result;
-		m_log->info(formatStr("RSYNC CMD: %s", rsyncCommand.c_str()));
-		
-		if (exec(rsyncCommand, result)) {
-			m_log->info("RSYNC SUCCESS");
-		}
-		else {
-			m_log->error(formatStr("RSYNC ERROR: %s", result.c_str()));
+	m_log->info("ORIGIN %s", m_origin->description().c_str());
+	m_downLimiter.setNext(m_origin->downLink());
+	m_upLimiter.setNext(m_origin->upLink());
+	if (m_readCacheOnly) {
+		m_writeCacheDirFd = m_origin->dirFd();
+	}
+	else {
+		m_writeCacheDirFd = open(writeCacheDir().c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+		if (m_writeCacheDirFd < 0) {
+			m_log->error("Cannot open write cache directory: %s", writeCacheDir().c_str());
 		}
-        sleep(30);
-    }
-}
+	}
 
-void CacheManager::start()
-{
-    m_isRunning = true;
+	IoUring* ring = IoUring::forThread();
+	if (ring) {
+		m_log->info("IO_URING enabled, queue depth: %u", ring->depth());
+	}
+
+	if (m_chunked && m_maxReadAhead > 0) {
+		m_readAheadPool.start(m_readAheadThreads);
+	}
+
+	m_index.open(readCacheDir() + "/.fusecache.index");
+
+	m_evictor.setCacheDir(readCacheDir());
+	m_evictor.setIndex(&m_index);
+	m_evictor.setOrigin(m_origin.get());
+	m_evictor.setIsPinned([this](const std::string& filePath) {
+		return isFileOpen(filePath) || m_syncEngine.isPending(filePath);
+	});
+	if (m_dedup) {
+		m_contentStore.setDir(readCacheDir() + "/.cas");
+		m_contentStore.collect();
+		m_evictor.setOnEvicted([this] { m_contentStore.collect(); });
+	}
+	m_evictor.start();
 
 	if (!m_readCacheOnly) {
-    	m_syncThread = std::thread(&CacheManager::run, this);
+		m_syncEngine.setWriteCacheDir(writeCacheDir());
+		m_syncEngine.setOrigin(m_origin.get());
+		m_syncEngine.setRateLimiter(&m_upLimiter);
+		m_syncEngine.setIsBusy([this](const std::string& filePath) { return isFileOpenForWriting(filePath); });
+		m_syncEngine.setOnUploaded([this](const std::string& filePath) {
+			m_writeOverlay.remove(filePath, false);
+			m_statCache.invalidate(filePath);
+			m_dirCache.invalidate(std::filesystem::path(filePath).parent_path().u8string());
+		});
+		m_syncEngine.setOnMissing([this](const std::string& filePath) { m_writeOverlay.add(filePath); });
+		m_syncEngine.start();
+
+		// only entries that are not on the origin yet have to be added to listings
+		for (const std::string& filePath : m_syncEngine.pendingPaths()) {
+			struct stat sb;
+			if (m_origin->stat(filePath.c_str(), &sb) == -1 && errno == ENOENT) {
+				m_writeOverlay.add(filePath);
+			}
+		}
 	}
+
+	m_prefetcher.setOrigin(m_origin.get());
+	m_prefetcher.setMountPoint(mountPoint());
+	m_prefetcher.setFetch([this](const std::string& filePath) { return prefetchFile(filePath); });
+	m_prefetcher.start(m_prefetchThreads);
+
+	m_controlServer.setHandler([this](const std::string& request) { return handleControl(request); });
+	m_controlServer.start(controlSocketPath());
+
+	addMetrics();
+	m_metrics.setPath(readCacheDir() + "/.fusecache.metrics");
+	m_metrics.start();
 }
 
 void CacheManager::stop()
 {
-    m_isRunning = false;
-    m_syncThread.join();
+	m_metrics.stop();
+	m_controlServer.stop();
+	m_prefetcher.stop();
+	m_readAheadPool.stop();
+	m_evictor.stop();
+	m_index.close();
+	m_syncEngine.stop();
 }
 
 int CacheManager::openFile(const char* filePath, int flags)
 {   
-    std::string origPath = origFilePath(filePath);
     std::string cachePath = readCacheFilePath(filePath);
     
 	int ret;
@@ -386,18 +648,55 @@ int CacheManager::openFile(const char* filePath, int flags)
 			return -EACCES;
 		}
 
-		ret = copyFileOnDemand(origPath.c_str(), cachePath.c_str());
+		// read-only opens of uncached files return at once and fetch blocks on read
+		if (m_chunked && (flags & O_ACCMODE) == O_RDONLY) {
+			ret = needsCopy(filePath);
+			if (ret == -1) {
+				return -EACCES;
+			}
+			if (ret == 1) {
+				return openSparseFile(filePath, flags);
+			}
+		}
+
+		ret = copyFileOnDemand(filePath);
 		if (ret == -1) {
 			return -EACCES;
 		}
 
+		if ((flags & O_ACCMODE) != O_RDONLY || (flags & O_TRUNC)) {
+			if (unshareFile(filePath) == -1) {
+				return -EIO;
+			}
+		}
 		ret = open(cachePath.c_str(), flags);
+
+		// the file may have been evicted right after the cache check
+		if (ret == -1 && errno == ENOENT) {
+			m_index.erase(filePath);
+			if (copyFileOnDemand(filePath) == -1) {
+				return -EACCES;
+			}
+			ret = open(cachePath.c_str(), flags);
+		}
 		if (ret == -1) {
 			return -errno;
 		}
+		struct stat sb;
+		off_t size = fstat(ret, &sb) == 0 ? sb.st_size : -1;
+		addHandle(ret, filePath, nullptr, (flags & O_ACCMODE) != O_RDONLY, size);
+
+		// modified files must stay until they are synced back
+		if ((flags & O_ACCMODE) != O_RDONLY) {
+			m_evictor.remove(filePath);
+			m_index.erase(filePath);
+		}
+		else if (!m_syncEngine.isPending(filePath) && size >= 0) {
+			m_evictor.add(filePath, size);
+		}
 	}
 	else {
-		ret = open(origPath.c_str(), flags);
+		ret = m_origin->openFile(filePath, flags);
 		if (ret == -1)
 			return -errno;
 	}
@@ -405,15 +704,370 @@ int CacheManager::openFile(const char* filePath, int flags)
     return ret;
 }
 
+// Returns 1 if the file was fetched, 0 if it was already cached and -1 on error.
+int CacheManager::prefetchFile(const std::string& filePath)
+{
+	std::string cachePath = readCacheFilePath(filePath);
+	if (waitForFile(cachePath.c_str()) == -1) {
+		return -1;
+	}
+
+	int res = needsCopy(filePath.c_str());
+	if (res != 1) {
+		return res;
+	}
+
+	// refreshing a stale copy is less urgent than fetching a missing file
+	FillClass fillClass = access(cachePath.c_str(), F_OK) == 0 ? FILL_REVALIDATE : FILL_PREFETCH;
+	if (copyFileOnDemand(filePath.c_str(), fillClass) == -1) {
+		return -1;
+	}
+
+	struct stat sb;
+	if (!m_syncEngine.isPending(filePath) && lstat(cachePath.c_str(), &sb) == 0) {
+		m_evictor.add(filePath, sb.st_size);
+	}
+	return 1;
+}
+
+// Commands of the control socket:
+//   prefetch [priority]   followed by one path, directory or glob per line
+//   status [id]
+//   cancel <id>
+//   fills
+//   metrics
+//   limit up|down|burst <MB/s or MB>
+std::string CacheManager::handleControl(const std::string& request)
+{
+	std::istringstream lines(request);
+	std::string line;
+	std::getline(lines, line);
+
+	std::istringstream words(line);
+	std::string command;
+	words >> command;
+
+	if (command == "prefetch") {
+		int priority = 0;
+		words >> priority;
+
+		std::vector<std::string> entries;
+		while (std::getline(lines, line)) {
+			if (!line.empty() && line.back() == '\r') {
+				line.pop_back();
+			}
+			if (!line.empty() && line[0] != '#') {
+				entries.push_back(line);
+			}
+		}
+
+		int id = m_prefetcher.submit(entries, priority);
+		if (id == -1) {
+			return "error prefetcher not running\n";
+		}
+		return formatStr("ok %d\n", id);
+	}
+	else if (command == "status") {
+		int id = 0;
+		words >> id;
+		return m_prefetcher.status(id);
+	}
+	else if (command == "cancel") {
+		int id = 0;
+		words >> id;
+		return m_prefetcher.cancel(id) ? "ok\n" : "error unknown job\n";
+	}
+	else if (command == "fills") {
+		return m_fillScheduler.status();
+	}
+	else if (command == "metrics") {
+		return m_metrics.exportText();
+	}
+	else if (command == "limit") {
+		std::string direction;
+		float value = -1.0f;
+		words >> direction >> value;
+		if (value < 0) {
+			return "error invalid limit\n";
+		}
+
+		if (direction == "up") {
+			setMaxUpBandwidth(value);
+		}
+		else if (direction == "down") {
+			setMaxDownBandwidth(value);
+		}
+		else if (direction == "burst") {
+			setBurst(value);
+		}
+		else {
+			return "error invalid limit\n";
+		}
+		m_log->info("LIMIT - %s set to %g", direction.c_str(), value);
+		return "ok\n";
+	}
+
+	return "error unknown command\n";
+}
+
+// Values of the other components that are read when the metrics are exported.
+void CacheManager::addMetrics()
+{
+	m_metrics.addCounter("fusecache_fetched_bytes_total", "Bytes read from the origin.",
+		[this] { return (double)m_downLimiter.totalBytes(); });
+	m_metrics.addCounter("fusecache_uploaded_bytes_total", "Bytes written back to the origin.",
+		[this] { return (double)m_upLimiter.totalBytes(); });
+	m_metrics.addGauge("fusecache_fills_running", "Downloads from the origin in progress.",
+		[this] { return (double)m_fillScheduler.runningCount(); });
+	m_metrics.addGauge("fusecache_fills_queued", "Downloads waiting for a slot.",
+		[this] { return (double)m_fillScheduler.queuedCount(); });
+	m_metrics.addGauge("fusecache_writeback_queue", "Modified files waiting to be uploaded.",
+		[this] { return (double)m_syncEngine.dirtyCount(); });
+	m_metrics.addHistogram("fusecache_upload_visible_seconds", "Time from closing a modified file until it is visible on the origin.",
+		m_syncEngine.uploadLatency());
+	m_metrics.addGauge("fusecache_open_files", "Open file handles.",
+		[this] {
+			std::shared_lock<std::shared_mutex> lock(m_handlesMutex);
+			return (double)m_handles.size();
+		});
+}
+
+int CacheManager::openSparseFile(const char* filePath, int flags)
+{
+    std::string cachePath = readCacheFilePath(filePath);
+
+	std::shared_ptr<SparseFile> sparseFile;
+	{
+		std::lock_guard<std::mutex> guard(m_sparseFilesMutex);
+		SparseFileRef& ref = m_sparseFiles[cachePath];
+		if (!ref.file) {
+			ref.file = std::make_shared<SparseFile>(m_log, m_blockSize, &m_downLimiter, codecFor(filePath), m_compressLevel);
+		}
+		ref.openCount++;
+		sparseFile = ref.file;
+	}
+
+	int ret = -EACCES;
+	if (sparseFile->open(m_origin.get(), filePath, cachePath) == 0) {
+		ret = open(sparseFile->dataPath().c_str(), flags);
+		if (ret == -1) {
+			ret = -errno;
+		}
+	}
+
+	if (ret < 0) {
+		std::lock_guard<std::mutex> guard(m_sparseFilesMutex);
+		if (--m_sparseFiles[cachePath].openCount == 0) {
+			m_sparseFiles.erase(cachePath);
+		}
+		return ret;
+	}
+
+	// compressed files are never moved into place, so a complete one is a hit
+	Metrics::count(sparseFile->isComplete() ? METRIC_CACHE_HITS : METRIC_CACHE_MISSES);
+	addHandle(ret, filePath, sparseFile, false, sparseFile->size());
+	m_evictor.add(filePath, sparseFile->storedSize());
+
+	return ret;
+}
+
+// Already compressed formats are not worth the CPU time.
+Codec CacheManager::codecFor(const std::string& filePath)
+{
+	std::string extension = std::filesystem::path(filePath).extension().u8string();
+	if (m_codec == CODEC_NONE || extension.empty()) {
+		return m_codec;
+	}
+
+	std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+	return m_compressSkip.count(extension.substr(1)) > 0 ? CODEC_NONE : m_codec;
+}
+
+// The size is kept up to date by the writes through the handle, so that
+// reads can tell how much they return without asking the file system.
+void CacheManager::addHandle(int vfh, const char* filePath, std::shared_ptr<SparseFile> sparseFile, bool isWritable, off_t size)
+{
+	std::shared_ptr<FileHandle> handle = std::make_shared<FileHandle>();
+	handle->path = filePath;
+	handle->sparseFile = sparseFile;
+	handle->isWritable = isWritable;
+	handle->lastTouch = time(0);
+	handle->size = size;
+
+	std::unique_lock<std::shared_mutex> lock(m_handlesMutex);
+	m_handles[vfh] = handle;
+	m_openPaths[handle->path]++;
+	if (isWritable) {
+		m_writablePaths[handle->path]++;
+	}
+}
+
+std::shared_ptr<FileHandle> CacheManager::handleFor(int vfh)
+{
+	std::shared_lock<std::shared_mutex> lock(m_handlesMutex);
+	auto it = m_handles.find(vfh);
+	if (it == m_handles.end()) {
+		return nullptr;
+	}
+	return it->second;
+}
+
+bool CacheManager::isFileOpen(const std::string& filePath)
+{
+	std::shared_lock<std::shared_mutex> lock(m_handlesMutex);
+	return m_openPaths.count(filePath) > 0;
+}
+
+bool CacheManager::isFileOpenForWriting(const std::string& filePath)
+{
+	std::shared_lock<std::shared_mutex> lock(m_handlesMutex);
+	return m_writablePaths.count(filePath) > 0;
+}
+
 int CacheManager::closeFile(int vfh)
 {
+	std::shared_ptr<FileHandle> handle;
+	bool isLastWriter = false;
+	{
+		std::unique_lock<std::shared_mutex> lock(m_handlesMutex);
+		auto it = m_handles.find(vfh);
+		if (it != m_handles.end()) {
+			handle = it->second;
+			m_handles.erase(it);
+			if (--m_openPaths[handle->path] <= 0) {
+				m_openPaths.erase(handle->path);
+			}
+			if (handle->isWritable && --m_writablePaths[handle->path] <= 0) {
+				m_writablePaths.erase(handle->path);
+				isLastWriter = true;
+			}
+		}
+	}
     close(vfh);
+
+	// the last write may have happened after an upload of this file started
+	if (handle && handle->isDirty) {
+		markDirty(handle->path);
+	}
+	else if (isLastWriter && !m_readCacheOnly) {
+		m_syncEngine.requestUpload(handle->path);
+	}
+
+	// move a completely fetched sparse file into place after its last handle,
+	// compressed files stay where they are
+	if (handle && handle->sparseFile) {
+		std::string cachePath = readCacheFilePath(handle->path);
+		std::lock_guard<std::mutex> guard(m_sparseFilesMutex);
+		SparseFileRef& ref = m_sparseFiles[cachePath];
+		if (--ref.openCount <= 0) {
+			if (ref.file && !ref.file->isCompressed() && ref.file->isComplete() && ref.file->finalize() == 0) {
+				m_index.put(handle->path, IndexEntry { ref.file->mtime(), (uint64_t)ref.file->size(), time(0) });
+			}
+			m_sparseFiles.erase(cachePath);
+		}
+	}
+
     return 0;
 }
 
+void CacheManager::readAhead(FileHandle& handle, off_t offset, size_t size)
+{
+	std::shared_ptr<SparseFile> sparseFile = handle.sparseFile;
+	size_t blockCount = sparseFile->blockCount();
+	if (m_maxReadAhead == 0 || size == 0 || blockCount == 0) {
+		return;
+	}
+
+	size_t first = 0;
+	size_t last = 0;
+	{
+		std::lock_guard<std::mutex> lock(handle.mutex);
+		bool isSequential = (offset == handle.nextOffset);
+		handle.nextOffset = offset + size;
+		if (!isSequential) {
+			handle.readAheadWindow = 0;
+			handle.readAheadEnd = 0;
+			return;
+		}
+
+		// grow the window like the kernel does each time the reader enters a new block
+		size_t lastBlock = (offset + size - 1) / sparseFile->blockSize();
+		if (handle.readAheadWindow == 0) {
+			handle.readAheadWindow = std::min((size_t)2, m_maxReadAhead);
+		}
+		else if (lastBlock != handle.currentBlock) {
+			handle.readAheadWindow = std::min(handle.readAheadWindow * 2, m_maxReadAhead);
+		}
+		handle.currentBlock = lastBlock;
+
+		first = std::max(lastBlock + 1, handle.readAheadEnd);
+		last = std::min(lastBlock + handle.readAheadWindow, blockCount - 1);
+		if (first > last) {
+			return;
+		}
+		handle.readAheadEnd = last + 1;
+	}
+
+	std::weak_ptr<SparseFile> weakFile = sparseFile;
+	for (size_t block = first; block <= last; ++block) {
+		m_readAheadPool.enqueue([this, weakFile, block] {
+			std::shared_ptr<SparseFile> file = weakFile.lock();
+			if (file) {
+				FillTicket ticket;
+				ticket.fillClass = FILL_READAHEAD;
+				m_fillScheduler.acquire(ticket);
+				file->fetchBlock(block);
+				m_fillScheduler.release(ticket);
+			}
+		});
+	}
+}
+
+// Returns the number of bytes the read returns, or the requested size if
+// the size of the file is not known.
+int CacheManager::prepareRead(int vfh, size_t size, off_t offset)
+{
+	std::shared_ptr<FileHandle> handle = handleFor(vfh);
+	if (handle) {
+		time_t now = time(0);
+		if (handle->lastTouch.exchange(now) != now) {
+			m_evictor.touch(handle->path);
+		}
+	}
+
+	if (handle && handle->sparseFile) {
+		// a read that waits for missing blocks is as urgent as an open
+		if (!handle->sparseFile->isCached(offset, size)) {
+			FillTicket ticket;
+			ticket.fillClass = FILL_OPEN;
+			m_fillScheduler.acquire(ticket);
+			int res = handle->sparseFile->fetchRange(offset, size);
+			m_fillScheduler.release(ticket);
+			if (res == -1) {
+				return -EIO;
+			}
+		}
+		readAhead(*handle, offset, size);
+	}
+
+	off_t fileSize = handle ? handle->size.load(std::memory_order_relaxed) : -1;
+	if (fileSize >= 0) {
+		return offset < fileSize ? (int)std::min((off_t)size, fileSize - offset) : 0;
+	}
+	return size;
+}
+
 int CacheManager::readFile(int vfh, char* buf, size_t size, off_t offset)
 {
-	int res = pread(vfh, buf, size, offset);
+	int res = prepareRead(vfh, size, offset);
+	if (res < 0)
+		return res;
+
+	std::shared_ptr<FileHandle> handle = handleFor(vfh);
+	if (handle && handle->sparseFile && handle->sparseFile->isCompressed())
+		res = handle->sparseFile->read(buf, size, offset);
+	else
+		res = pread(vfh, buf, size, offset);
 	if (res == -1)
 		res = -errno;
 
@@ -421,6 +1075,13 @@ int CacheManager::readFile(int vfh, char* buf, size_t size, off_t offset)
 	return res;
 }
 
+// Compressed files cannot be spliced and are read through readFile().
+bool CacheManager::isCompressed(int vfh)
+{
+	std::shared_ptr<FileHandle> handle = handleFor(vfh);
+	return handle && handle->sparseFile && handle->sparseFile->isCompressed();
+}
+
 int CacheManager::createFile(const char* filePath, mode_t mode, int flags)
 {   
     std::string cachePath = writeCacheFilePath(filePath);
@@ -431,16 +1092,20 @@ int CacheManager::createFile(const char* filePath, mode_t mode, int flags)
 	}
     catch (const std::filesystem::filesystem_error& err)
     {
-		m_log->error(formatStr("Error creating dirs: %s\nException: %s", dir, err.what()));
+		m_log->error("Error creating dirs: %s\nException: %s", dir.c_str(), err.what());
     }
     catch (const std::exception& ex)
     {
-        m_log->error(formatStr("Error creating dirs: %s\nException: Unknown", dir));
+        m_log->error("Error creating dirs: %s\nException: Unknown", dir.c_str());
     }
 
 	int res = open(cachePath.c_str(), flags, mode);
 	if (res == -1)
-		res = -errno;
+		return -errno;
+
+	struct stat sb;
+	addHandle(res, filePath, nullptr, true, fstat(res, &sb) == 0 ? sb.st_size : -1);
+	markDirty(filePath);
 
 	return res;
 }
@@ -449,11 +1114,70 @@ int CacheManager::writeFile(int vfh, const char* buf, size_t size, off_t offset)
 {
 	int res = pwrite(vfh, buf, size, offset);
 	if (res == -1)
-		res = -errno;
+		return -errno;
 
+	markWritten(vfh, offset + res);
 	return res;
 }
 
+void CacheManager::markWritten(int vfh, off_t end)
+{
+	std::shared_ptr<FileHandle> handle = handleFor(vfh);
+	if (!handle) {
+		return;
+	}
+
+	off_t size = handle->size.load(std::memory_order_relaxed);
+	while (size >= 0 && size < end && !handle->size.compare_exchange_weak(size, end)) {
+	}
+
+	// only the first write of a handle touches the journal
+	if (!handle->isDirty.exchange(true)) {
+		markDirty(handle->path);
+	}
+}
+
+void CacheManager::markTruncated(int vfh, off_t size)
+{
+	std::shared_ptr<FileHandle> handle = handleFor(vfh);
+	if (handle) {
+		handle->size = size;
+	}
+}
+
+void CacheManager::markDirty(const std::string& filePath)
+{
+	if (m_readCacheOnly) {
+		return;
+	}
+
+	// changes to files that are not open for writing can be uploaded right away
+	m_syncEngine.markDirty(filePath);
+	if (!isFileOpenForWriting(filePath)) {
+		m_syncEngine.requestUpload(filePath);
+	}
+}
+
+StatCache& CacheManager::statCache()
+{
+	return m_statCache;
+}
+
+DirCache& CacheManager::dirCache()
+{
+	return m_dirCache;
+}
+
+WriteOverlay& CacheManager::writeOverlay()
+{
+	return m_writeOverlay;
+}
+
+bool CacheManager::isReadCacheOnly()
+{
+	return m_readCacheOnly;
+}
+
 std::string CacheManager::origFilePath(const std::string& filePath)
 {
     std::string newFilePath = m_rootPath + filePath;
@@ -480,10 +1204,25 @@ std::string CacheManager::writeCacheFilePath(const std::string& filePath)
 
 std::string CacheManager::partFilePath(const std::string& filePath)
 {
-    std::string newFilePath = filePath + ".part";
+    std::string newFilePath = filePath + PART_SUFFIX;
     return newFilePath;
 }
 
+Origin& CacheManager::origin()
+{
+	return *m_origin;
+}
+
+int CacheManager::writeCacheDirFd()
+{
+	return m_writeCacheDirFd;
+}
+
+std::string CacheManager::controlSocketPath()
+{
+    return m_readCacheDir + "/.fusecache.sock";
+}
+
 const std::string& CacheManager::rootPath()
 {
     return m_rootPath;
@@ -536,10 +1275,130 @@ void CacheManager::setReadCacheOnly(bool enabled)
 
 void CacheManager::setMaxUpBandwidth(float mbPerSecond)
 {
-    m_maxUpBandwidth = mbPerSecond;
+	m_upLimiter.setRate(mbPerSecond * 1024.0 * 1024.0);
 }
 
 void CacheManager::setMaxDownBandwidth(float mbPerSecond)
 {
-    m_maxDownBandwidth = mbPerSecond;
+	m_downLimiter.setRate(mbPerSecond * 1024.0 * 1024.0);
+}
+
+void CacheManager::setBurst(float mb)
+{
+	m_upLimiter.setBurst(mb * 1024.0 * 1024.0);
+	m_downLimiter.setBurst(mb * 1024.0 * 1024.0);
+}
+
+void CacheManager::setIoUringDepth(unsigned depth)
+{
+	IoUring::setDepth(depth);
+}
+
+void CacheManager::setDedup(bool enabled)
+{
+	m_dedup = enabled;
+}
+
+void CacheManager::setDelta(bool enabled)
+{
+	m_delta = enabled;
+	m_syncEngine.setPublishSignatures(enabled);
+}
+
+void CacheManager::setMaxDownloads(int maxDownloads)
+{
+	m_fillScheduler.setMaxSlots(maxDownloads);
+}
+
+void CacheManager::setChunked(bool enabled)
+{
+	m_chunked = enabled;
+}
+
+void CacheManager::setBlockSize(size_t blockSize)
+{
+	m_blockSize = std::max((size_t)4096, blockSize);
+}
+
+bool CacheManager::setCompression(const std::string& spec)
+{
+	return Compressor::parse(spec, m_codec, m_compressLevel);
+}
+
+// Takes "local" or a simulated origin like "sim:latency=20,bandwidth=10".
+bool CacheManager::setOrigin(const std::string& spec)
+{
+	Origin* origin = Origin::create(spec, m_log);
+	if (!origin) {
+		return false;
+	}
+	m_origin.reset(origin);
+	return true;
+}
+
+// Takes a comma separated list of file extensions that are never compressed.
+void CacheManager::setCompressSkip(const std::string& extensions)
+{
+	m_compressSkip.clear();
+	std::stringstream stream(extensions);
+	std::string extension;
+	while (std::getline(stream, extension, ',')) {
+		if (!extension.empty() && extension[0] == '.') {
+			extension = extension.substr(1);
+		}
+		if (!extension.empty()) {
+			std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+			m_compressSkip.insert(extension);
+		}
+	}
+}
+
+void CacheManager::setMaxReadAhead(size_t blocks)
+{
+	m_maxReadAhead = blocks;
+}
+
+void CacheManager::setReadAheadThreads(int numThreads)
+{
+	m_readAheadThreads = std::max(1, numThreads);
+}
+
+void CacheManager::setMaxCacheSize(uint64_t bytes)
+{
+	m_evictor.setMaxBytes(bytes);
+}
+
+void CacheManager::setMaxCacheFiles(uint64_t files)
+{
+	m_evictor.setMaxFiles(files);
+}
+
+void CacheManager::setRevalidateInterval(int seconds)
+{
+	m_revalidateInterval = std::max(0, seconds);
+}
+
+void CacheManager::setSyncWorkers(int numWorkers)
+{
+	m_syncEngine.setWorkers(numWorkers);
+}
+
+void CacheManager::setSyncInterval(int seconds)
+{
+	m_syncEngine.setInterval(seconds);
+}
+
+void CacheManager::setSyncDelay(int milliseconds)
+{
+	m_syncEngine.setDelay(milliseconds);
+}
+
+void CacheManager::setMetricsInterval(int seconds)
+{
+	m_metrics.setInterval(seconds);
+}
+
+void CacheManager::setPrefetchThreads(int numThreads)
+{
+	m_prefetchThreads = std::max(1, numThreads);
 }
@@ -8,14 +8,66 @@
 
 #pragma once
 
+#include <atomic>
 #include <mutex>
+#include <shared_mutex>
 #include <thread>
+#include <condition_variable>
+#include <memory>
 #include <string>
 #include <map>
 #include <vector>
 #include <list>
+#include <set>
 
 #include "Log.h"
+#include "Origin.h"
+#include "SparseFile.h"
+#include "WorkerPool.h"
+#include "CacheEvictor.h"
+#include "CacheIndex.h"
+#include "StatCache.h"
+#include "DirCache.h"
+#include "WriteOverlay.h"
+#include "SyncEngine.h"
+#include "RateLimiter.h"
+#include "FillScheduler.h"
+#include "ContentStore.h"
+#include "Compressor.h"
+#include "Metrics.h"
+#include "Prefetcher.h"
+#include "Signature.h"
+#include "ControlServer.h"
+
+struct CopyJob
+{
+    std::mutex mutex;
+    std::condition_variable finished;
+    bool isDone = false;
+    int result = 0;
+    FillTicket ticket;
+};
+
+struct FileHandle
+{
+    std::string path;
+    std::shared_ptr<SparseFile> sparseFile;
+    std::mutex mutex;
+    off_t nextOffset = 0;
+    size_t currentBlock = 0;
+    size_t readAheadWindow = 0;
+    size_t readAheadEnd = 0;
+    std::atomic<time_t> lastTouch { 0 };
+    std::atomic<off_t> size { -1 };
+    bool isWritable = false;
+    std::atomic<bool> isDirty { false };
+};
+
+struct SparseFileRef
+{
+    std::shared_ptr<SparseFile> file;
+    int openCount = 0;
+};
 
 class CacheManager
 {
@@ -25,30 +77,58 @@ public:
     ~CacheManager();
 
 private:
-    bool canPartFileBeDeleted(const std::string& path);
+    bool removeStalePartFile(const std::string& partPath);
+    int createPartFile(const std::string& partPath);
     int waitForFile(const char *path);
-    bool needsCopy(const std::string& path);
-    int copyFile(const char *from, const char *to);
-    int copyFileOnDemand(const char *from, const char *to);
+    int needsCopy(const char *filePath);
+    int copyFile(const char *filePath, const char *to);
+    int copyDelta(const char *filePath, const char *to, int fdFrom, int fdTo);
+    int loadSignature(const char *filePath, Signature& sig);
+    int linkContent(const char *filePath);
+    void storeContent(const char *filePath, const struct stat& sb_from, IndexEntry& entry);
+    int fillFile(const char *filePath, CopyJob& job);
+    int copyFileOnDemand(const char *filePath, FillClass fillClass = FILL_OPEN);
+    std::string handleControl(const std::string& request);
+    void addMetrics();
+    int openSparseFile(const char* filePath, int flags);
+    Codec codecFor(const std::string& filePath);
+    void addHandle(int vfh, const char* filePath, std::shared_ptr<SparseFile> sparseFile, bool isWritable, off_t size);
+    std::shared_ptr<FileHandle> handleFor(int vfh);
+    bool isFileOpen(const std::string& filePath);
+    bool isFileOpenForWriting(const std::string& filePath);
+    void readAhead(FileHandle& handle, off_t offset, size_t size);
 
 public:
-    bool checkDependencies();
     void createDirectories();
     
-    void run();
     void start();
     void stop();
 
     int openFile(const char* filePath, int flags);
     int closeFile(int id);
+    int prepareRead(int id, size_t size, off_t offset);
     int readFile(int id, char* buf, size_t size, off_t offset);
+    bool isCompressed(int id);
     int createFile(const char* filePath, mode_t mode, int flags);
     int writeFile(int id, const char* buf, size_t size, off_t offset);
+    int prefetchFile(const std::string& filePath);
+    void markWritten(int id, off_t end);
+    void markTruncated(int id, off_t size);
+    void markDirty(const std::string& filePath);
+    int unshareFile(const std::string& filePath);
+
+    StatCache& statCache();
+    DirCache& dirCache();
+    WriteOverlay& writeOverlay();
+    bool isReadCacheOnly();
 
     std::string origFilePath(const std::string& filePath);
     std::string readCacheFilePath(const std::string& filePath);
     std::string writeCacheFilePath(const std::string& filePath);
     std::string partFilePath(const std::string& filePath);
+    std::string controlSocketPath();
+    Origin& origin();
+    int writeCacheDirFd();
 
     const std::string& rootPath();
     const std::string& readCacheDir();
@@ -63,19 +143,68 @@ public:
     void setReadCacheOnly(bool enabled);
     void setMaxUpBandwidth(float mbPerSecond);
     void setMaxDownBandwidth(float mbPerSecond);
+    void setBurst(float mb);
+    void setIoUringDepth(unsigned depth);
+    void setDelta(bool enabled);
+    void setDedup(bool enabled);
+    void setMaxDownloads(int maxDownloads);
+    void setChunked(bool enabled);
+    void setBlockSize(size_t blockSize);
+    bool setCompression(const std::string& spec);
+    void setCompressSkip(const std::string& extensions);
+    bool setOrigin(const std::string& spec);
+    void setMaxReadAhead(size_t blocks);
+    void setReadAheadThreads(int numThreads);
+    void setMaxCacheSize(uint64_t bytes);
+    void setMaxCacheFiles(uint64_t files);
+    void setRevalidateInterval(int seconds);
+    void setSyncWorkers(int numWorkers);
+    void setSyncInterval(int seconds);
+    void setSyncDelay(int milliseconds);
+    void setPrefetchThreads(int numThreads);
+    void setMetricsInterval(int seconds);
 
 private:
     Log* m_log = nullptr;
-    std::mutex m_copyMutex;
-    std::thread m_syncThread;
+    std::mutex m_copyJobsMutex;
+    std::map<std::string, std::shared_ptr<CopyJob>> m_copyJobs;
+    FillScheduler m_fillScheduler;
+    std::shared_mutex m_handlesMutex;
+    std::map<int, std::shared_ptr<FileHandle>> m_handles;
+    std::map<std::string, int> m_openPaths;
+    std::map<std::string, int> m_writablePaths;
+    std::mutex m_sparseFilesMutex;
+    std::map<std::string, SparseFileRef> m_sparseFiles;
+    bool m_chunked = false;
+    Codec m_codec = CODEC_NONE;
+    int m_compressLevel = 0;
+    std::set<std::string> m_compressSkip;
+    bool m_delta = false;
+    bool m_dedup = false;
+    size_t m_blockSize = 1024 * 1024;
+    WorkerPool m_readAheadPool;
+    size_t m_maxReadAhead = 8;
+    int m_readAheadThreads = 4;
+    CacheEvictor m_evictor;
+    CacheIndex m_index;
+    int m_revalidateInterval = 30;
+    StatCache m_statCache;
+    DirCache m_dirCache;
+    WriteOverlay m_writeOverlay;
+    SyncEngine m_syncEngine;
+    Prefetcher m_prefetcher;
+    int m_prefetchThreads = 4;
+    ControlServer m_controlServer;
+    ContentStore m_contentStore;
+    Metrics m_metrics;
     std::string m_name;
     bool m_readCacheOnly = false;
-    bool m_isRunning = false;
-    bool m_isCopying= false;
-    float m_maxUpBandwidth = 1.0f;
-    float m_maxDownBandwidth = 1.0f;
+    RateLimiter m_upLimiter;
+    RateLimiter m_downLimiter;
+    std::unique_ptr<Origin> m_origin;
     std::string m_rootPath;
     std::string m_readCacheDir;
     std::string m_writeCacheDir;
     std::string m_mountPoint;
+    int m_writeCacheDirFd = -1;
 };
\ No newline at end of file
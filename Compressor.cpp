@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2024 Nils Zweiling
+ *
+ * This file is part of fusecache which is released under the MIT license.
+ * See file LICENSE or go to https://github.com/zwodev/fusecache/tree/master/LICENSE
+ * for full license details.
+ */
+
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#include "Compressor.h"
+
+// Accepts "zlib", "zstd" or "lz4" with an optional level, e.g. "zstd:3".
+bool Compressor::parse(const std::string& spec, Codec& codec, int& level)
+{
+	size_t pos = spec.find(':');
+	std::string name = spec.substr(0, pos);
+	if (name == "zlib") {
+		codec = CODEC_ZLIB;
+		level = 1;
+	}
+	else if (name == "zstd") {
+		codec = CODEC_ZSTD;
+		level = 3;
+	}
+	else if (name == "lz4") {
+		codec = CODEC_LZ4;
+		level = 1;
+	}
+	else {
+		return false;
+	}
+
+	if (pos != std::string::npos) {
+		try {
+			level = std::stoi(spec.substr(pos + 1));
+		}
+		catch (...) {
+			return false;
+		}
+	}
+	return isAvailable(codec);
+}
+
+bool Compressor::isAvailable(Codec codec)
+{
+	switch (codec) {
+	case CODEC_ZLIB:
+		return true;
+#ifdef HAVE_ZSTD
+	case CODEC_ZSTD:
+		return true;
+#endif
+#ifdef HAVE_LZ4
+	case CODEC_LZ4:
+		return true;
+#endif
+	default:
+		return false;
+	}
+}
+
+const char* Compressor::codecName(Codec codec)
+{
+	switch (codec) {
+	case CODEC_ZLIB:
+		return "zlib";
+	case CODEC_ZSTD:
+		return "zstd";
+	case CODEC_LZ4:
+		return "lz4";
+	default:
+		return "none";
+	}
+}
+
+// Returns the compressed length, or 0 if the data did not get smaller.
+size_t Compressor::compress(Codec codec, int level, const uint8_t* src, size_t length, std::vector<uint8_t>& dst)
+{
+	size_t res = 0;
+	switch (codec) {
+	case CODEC_ZLIB: {
+		uLongf dstLength = compressBound(length);
+		dst.resize(dstLength);
+		if (compress2(dst.data(), &dstLength, src, length, level) == Z_OK) {
+			res = dstLength;
+		}
+		break;
+	}
+#ifdef HAVE_ZSTD
+	case CODEC_ZSTD: {
+		dst.resize(ZSTD_compressBound(length));
+		size_t dstLength = ZSTD_compress(dst.data(), dst.size(), src, length, level);
+		if (!ZSTD_isError(dstLength)) {
+			res = dstLength;
+		}
+		break;
+	}
+#endif
+#ifdef HAVE_LZ4
+	case CODEC_LZ4: {
+		dst.resize(LZ4_compressBound(length));
+		int dstLength = LZ4_compress_fast((const char*)src, (char*)dst.data(), length, dst.size(), level);
+		if (dstLength > 0) {
+			res = dstLength;
+		}
+		break;
+	}
+#endif
+	default:
+		break;
+	}
+
+	return res < length ? res : 0;
+}
+
+// Decompresses exactly dstLength bytes. Returns 0 on success and -1 if the
+// data is corrupt.
+int Compressor::decompress(Codec codec, const uint8_t* src, size_t length, uint8_t* dst, size_t dstLength)
+{
+	switch (codec) {
+	case CODEC_ZLIB: {
+		uLongf n = dstLength;
+		return uncompress(dst, &n, src, length) == Z_OK && n == dstLength ? 0 : -1;
+	}
+#ifdef HAVE_ZSTD
+	case CODEC_ZSTD: {
+		size_t n = ZSTD_decompress(dst, dstLength, src, length);
+		return !ZSTD_isError(n) && n == dstLength ? 0 : -1;
+	}
+#endif
+#ifdef HAVE_LZ4
+	case CODEC_LZ4: {
+		int n = LZ4_decompress_safe((const char*)src, (char*)dst, length, dstLength);
+		return n == (int)dstLength ? 0 : -1;
+	}
+#endif
+	default:
+		return -1;
+	}
+}
@@ -0,0 +1,29 @@
+/*
+ * Copyright (c) 2024 Nils Zweiling
+ *
+ * This file is part of fusecache which is released under the MIT license.
+ * See file LICENSE or go to https://github.com/zwodev/fusecache/tree/master/LICENSE
+ * for full license details.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+enum Codec { CODEC_NONE = 0, CODEC_ZLIB = 1, CODEC_ZSTD = 2, CODEC_LZ4 = 3 };
+
+// Block compression for the sparse files of chunked mode. zlib is always
+// built in, zstd and lz4 only when compiled with HAVE_ZSTD or HAVE_LZ4.
+class Compressor
+{
+
+public:
+    static bool parse(const std::string& spec, Codec& codec, int& level);
+    static bool isAvailable(Codec codec);
+    static const char* codecName(Codec codec);
+
+    static size_t compress(Codec codec, int level, const uint8_t* src, size_t length, std::vector<uint8_t>& dst);
+    static int decompress(Codec codec, const uint8_t* src, size_t length, uint8_t* dst, size_t dstLength);
+};
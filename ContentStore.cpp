@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) 2024 Nils Zweiling
+ *
+ * This file is part of fusecache which is released under the MIT license.
+ * See file LICENSE or go to https://github.com/zwodev/fusecache/tree/master/LICENSE
+ * for full license details.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#include <filesystem>
+#include <vector>
+
+#include "Helper.h"
+#include "ContentStore.h"
+
+ContentStore::ContentStore(Log* log)
+{
+	m_log = log;
+}
+
+ContentStore::~ContentStore()
+{
+}
+
+std::string ContentStore::objectPath(const uint8_t* hash)
+{
+	std::string hex = Sha256::toHex(hash, Sha256::DIGEST_SIZE);
+	return m_dir + "/" + hex.substr(0, 2) + "/" + hex;
+}
+
+int ContentStore::replaceWithLink(const std::string& objectPath, const std::string& path)
+{
+	// the part suffix keeps the temporary link out of listings and scans
+	std::string tmp = path + ".fclink" + PART_SUFFIX;
+	unlink(tmp.c_str());
+	if (link(objectPath.c_str(), tmp.c_str()) == -1) {
+		return -1;
+	}
+	if (rename(tmp.c_str(), path.c_str()) == -1) {
+		int saved_errno = errno;
+		unlink(tmp.c_str());
+		errno = saved_errno;
+		return -1;
+	}
+	return 0;
+}
+
+// Replaces path with a link to the object with the given hash.
+int ContentStore::linkTo(const uint8_t* hash, const std::string& path)
+{
+	std::error_code ec;
+	std::filesystem::create_directories(std::filesystem::path(path).parent_path(), ec);
+	return replaceWithLink(objectPath(hash), path);
+}
+
+// Makes the file at path the object for its content, or replaces it with
+// a link to the object that already exists.
+int ContentStore::add(const uint8_t* hash, const std::string& path)
+{
+	std::string object = objectPath(hash);
+	std::error_code ec;
+	std::filesystem::create_directories(std::filesystem::path(object).parent_path(), ec);
+
+	if (link(path.c_str(), object.c_str()) == 0) {
+		return 0;
+	}
+	if (errno != EEXIST) {
+		return -1;
+	}
+
+	struct stat sb_object;
+	struct stat sb_path;
+	if (lstat(object.c_str(), &sb_object) == -1 || lstat(path.c_str(), &sb_path) == -1) {
+		return -1;
+	}
+	if (sb_object.st_ino == sb_path.st_ino) {
+		return 0;
+	}
+
+	m_log->debug("DEDUP linked: %s", path.c_str());
+	return replaceWithLink(object, path);
+}
+
+uint64_t ContentStore::collect()
+{
+	uint64_t freed = 0;
+	size_t count = 0;
+	std::error_code ec;
+	auto options = std::filesystem::directory_options::skip_permission_denied;
+	for (auto it = std::filesystem::recursive_directory_iterator(m_dir, options, ec);
+		it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+		if (ec) {
+			break;
+		}
+
+		struct stat sb;
+		if (lstat(it->path().c_str(), &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_nlink == 1
+			&& unlink(it->path().c_str()) == 0) {
+			freed += sb.st_size;
+			count++;
+		}
+	}
+
+	if (count > 0) {
+		m_log->info("DEDUP removed %zu unused objects, %llu bytes", count, (unsigned long long)freed);
+	}
+	return freed;
+}
+
+void ContentStore::setDir(const std::string& dir)
+{
+	m_dir = dir;
+}
+
+int ContentStore::hashFile(int fd, uint8_t hash[Sha256::DIGEST_SIZE])
+{
+	std::vector<uint8_t> buf(1024 * 1024);
+	Sha256 sha;
+	off_t offset = 0;
+	while (true) {
+		ssize_t nread = pread(fd, buf.data(), buf.size(), offset);
+		if (nread < 0 && errno == EINTR) {
+			continue;
+		}
+		if (nread < 0) {
+			return -1;
+		}
+		if (nread == 0) {
+			break;
+		}
+		sha.update(buf.data(), nread);
+		offset += nread;
+	}
+
+	sha.finish(hash);
+	return 0;
+}
+
+bool ContentStore::isStorePath(const std::string& filePath)
+{
+	return filePath.compare(0, 5, "/.cas") == 0 && (filePath.size() == 5 || filePath[5] == '/');
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2024 Nils Zweiling
+ *
+ * This file is part of fusecache which is released under the MIT license.
+ * See file LICENSE or go to https://github.com/zwodev/fusecache/tree/master/LICENSE
+ * for full license details.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+#include "Log.h"
+#include "Sha256.h"
+
+// Content addressed store for read cache files. Every distinct content is
+// kept once as "<cacheDir>/.cas/<hh>/<sha256>" and hard linked to all cache
+// paths with that content. Objects are never modified: a linked cache file
+// has to be unshared before it is written to. An object that is only
+// linked from the store itself is garbage and removed by collect().
+class ContentStore
+{
+
+public:
+    ContentStore(Log* log);
+    ~ContentStore();
+
+    int linkTo(const uint8_t* hash, const std::string& path);
+    int add(const uint8_t* hash, const std::string& path);
+    uint64_t collect();
+
+    void setDir(const std::string& dir);
+
+    static int hashFile(int fd, uint8_t hash[Sha256::DIGEST_SIZE]);
+    static bool isStorePath(const std::string& filePath);
+
+private:
+    std::string objectPath(const uint8_t* hash);
+    int replaceWithLink(const std::string& objectPath, const std::string& path);
+
+private:
+    Log* m_log = nullptr;
+    std::string m_dir;
+};
@@ -0,0 +1,201 @@
+/*
+ * Copyright (c) 2024 Nils Zweiling
+ *
+ * This file is part of fusecache which is released under the MIT license.
+ * See file LICENSE or go to https://github.com/zwodev/fusecache/tree/master/LICENSE
+ * for full license details.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "Helper.h"
+#include "ControlServer.h"
+
+static int fillAddress(const std::string& socketPath, struct sockaddr_un& addr)
+{
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (socketPath.size() >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strncpy(addr.sun_path, socketPath.c_str(), sizeof(addr.sun_path) - 1);
+	return 0;
+}
+
+static bool readAll(int fd, std::string& data)
+{
+	char buf[4096];
+	while (true) {
+		ssize_t nread = read(fd, buf, sizeof(buf));
+		if (nread < 0 && errno == EINTR) {
+			continue;
+		}
+		if (nread < 0) {
+			return false;
+		}
+		if (nread == 0) {
+			return true;
+		}
+		data.append(buf, nread);
+	}
+}
+
+static bool writeAll(int fd, const std::string& data)
+{
+	size_t done = 0;
+	while (done < data.size()) {
+		// a client that is gone must not take the process down with SIGPIPE
+		ssize_t nwritten = send(fd, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+		if (nwritten < 0 && errno == EINTR) {
+			continue;
+		}
+		if (nwritten < 0) {
+			return false;
+		}
+		done += nwritten;
+	}
+	return true;
+}
+
+ControlServer::ControlServer(Log* log)
+{
+	m_log = log;
+}
+
+ControlServer::~ControlServer()
+{
+	stop();
+}
+
+int ControlServer::start(const std::string& socketPath)
+{
+	struct sockaddr_un addr;
+	if (fillAddress(socketPath, addr) == -1) {
+		m_log->error("CONTROL ERROR - socket path too long: %s", socketPath.c_str());
+		return -1;
+	}
+
+	m_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (m_fd < 0) {
+		return -1;
+	}
+
+	// a socket left behind by an instance that is gone is replaced, one that
+	// still accepts connections belongs to a running instance
+	int probeFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (probeFd >= 0) {
+		bool isInUse = connect(probeFd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+		int saved_errno = errno;
+		close(probeFd);
+		if (isInUse) {
+			m_log->error("CONTROL ERROR - socket in use by another instance: %s", socketPath.c_str());
+			close(m_fd);
+			m_fd = -1;
+			errno = EADDRINUSE;
+			return -1;
+		}
+		if (saved_errno == ECONNREFUSED) {
+			unlink(socketPath.c_str());
+		}
+	}
+
+	// the mount runs with umask 0, so the socket is made owner-only before it
+	// accepts connections rather than left for any local user to send commands to
+	if (bind(m_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || chmod(socketPath.c_str(), 0600) == -1
+		|| listen(m_fd, 16) == -1) {
+		m_log->error("CONTROL ERROR - cannot listen on: %s", socketPath.c_str());
+		close(m_fd);
+		m_fd = -1;
+		return -1;
+	}
+
+	m_socketPath = socketPath;
+	m_isRunning = true;
+	m_thread = std::thread(&ControlServer::run, this);
+	return 0;
+}
+
+void ControlServer::stop()
+{
+	m_isRunning = false;
+	if (m_thread.joinable()) {
+		m_thread.join();
+	}
+	if (m_fd >= 0) {
+		close(m_fd);
+		m_fd = -1;
+		unlink(m_socketPath.c_str());
+	}
+}
+
+void ControlServer::setHandler(std::function<std::string(const std::string& request)> handler)
+{
+	m_handler = handler;
+}
+
+void ControlServer::run()
+{
+	while (m_isRunning) {
+		struct pollfd pfd = { m_fd, POLLIN, 0 };
+		if (poll(&pfd, 1, 500) <= 0) {
+			continue;
+		}
+
+		int fd = accept4(m_fd, nullptr, nullptr, SOCK_CLOEXEC);
+		if (fd < 0) {
+			continue;
+		}
+		handle(fd);
+		close(fd);
+	}
+}
+
+void ControlServer::handle(int fd)
+{
+	// a client that does not finish its request in time is dropped
+	struct timeval timeout = { 5, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	// an empty request is another instance checking whether the socket is in use
+	std::string request;
+	if (!readAll(fd, request) || request.empty()) {
+		return;
+	}
+
+	std::string response = m_handler ? m_handler(request) : "error no handler\n";
+	writeAll(fd, response);
+}
+
+int ControlServer::request(const std::string& socketPath, const std::string& request, std::string& response)
+{
+	struct sockaddr_un addr;
+	if (fillAddress(socketPath, addr) == -1) {
+		return -1;
+	}
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return -1;
+	}
+
+	int res = -1;
+	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0
+		&& writeAll(fd, request)
+		&& shutdown(fd, SHUT_WR) == 0
+		&& readAll(fd, response)) {
+		res = 0;
+	}
+
+	int saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+	return res;
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2024 Nils Zweiling
+ *
+ * This file is part of fusecache which is released under the MIT license.
+ * See file LICENSE or go to https://github.com/zwodev/fusecache/tree/master/LICENSE
+ * for full license details.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <string>
+
+#include "Log.h"
+
+// Unix socket for commands to a running instance. A client connects, writes
+// one request and shuts down its write side. The first line of a request is
+// the command, the following lines are its arguments. The handler's answer
+// is written back and the connection is closed.
+class ControlServer
+{
+
+public:
+    ControlServer(Log* log);
+    ~ControlServer();
+
+    int start(const std::string& socketPath);
+    void stop();
+
+    void setHandler(std::function<std::string(const std::string& request)> handler);
+
+    static int request(const std::string& socketPath, const std::string& request, std::string& response);
+
+private:
+    void run();
+    void handle(int fd);
+
+private:
+    Log* m_log = nullptr;
+    std::thread m_thread;
+    int m_fd = -1;
+    std::atomic<bool> m_isRunning { false };
+    std::string m_socketPath;
+    std::function<std::string(const std::string& request)> m_handler;
+};
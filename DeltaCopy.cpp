@@ -0,0 +1,208 @@
+/*
+ * Copyright (c) 2024 Nils Zweiling
+ *
+ * This file is part of fusecache which is released under the MIT license.
+ * See file LICENSE or go to https://github.com/zwodev/fusecache/tree/master/LICENSE
+ * for full license details.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "FileCopy.h"
+#include "DeltaCopy.h"
+
+static const int FILTER_BITS = 20;
+
+static inline uint32_t filterIndex(uint32_t weak)
+{
+	return (weak * 2654435761u) >> (32 - FILTER_BITS);
+}
+
+static bool writeFull(int fd, const uint8_t* buf, size_t length, off_t offset)
+{
+	size_t done = 0;
+	while (done < length) {
+		ssize_t nwritten = pwrite(fd, buf + done, length - done, offset + done);
+		if (nwritten < 0 && errno == EINTR) {
+			continue;
+		}
+		if (nwritten < 0) {
+			return false;
+		}
+		done += nwritten;
+	}
+	return true;
+}
+
+// Rolls a window of one block over the old file. Windows whose weak
+// checksum is in the signature are confirmed with the strong checksum and
+// copied to every block of the new file that has the same content.
+static int reuseBlocks(int fdOld, int fdTo, const Signature& sig, std::vector<bool>& present, DeltaStats& stats)
+{
+	size_t blockSize = sig.blockSize();
+	const std::vector<Signature::Block>& blocks = sig.blocks();
+	size_t fullBlocks = sig.size() / blockSize;
+
+	struct stat sb;
+	if (fstat(fdOld, &sb) == -1) {
+		return -1;
+	}
+	if ((uint64_t)sb.st_size < blockSize || fullBlocks == 0) {
+		return 0;
+	}
+
+	std::vector<std::pair<uint32_t, size_t>> table;
+	std::vector<uint8_t> filter((1 << FILTER_BITS) / 8, 0);
+	table.reserve(fullBlocks);
+	for (size_t i = 0; i < fullBlocks; ++i) {
+		table.emplace_back(blocks[i].weak, i);
+		uint32_t bit = filterIndex(blocks[i].weak);
+		filter[bit / 8] |= (1 << (bit % 8));
+	}
+	std::sort(table.begin(), table.end());
+
+	size_t oldSize = sb.st_size;
+	void* map = mmap(nullptr, oldSize, PROT_READ, MAP_PRIVATE, fdOld, 0);
+	if (map == MAP_FAILED) {
+		return -1;
+	}
+	madvise(map, oldSize, MADV_SEQUENTIAL);
+	const uint8_t* data = (const uint8_t*)map;
+
+	int res = 0;
+	size_t offset = 0;
+	uint32_t a = 0;
+	uint32_t b = 0;
+	bool isFresh = false;
+	while (offset + blockSize <= oldSize) {
+		if (!isFresh) {
+			uint32_t weak = Signature::weakSum(data + offset, blockSize);
+			a = weak & 0xffff;
+			b = weak >> 16;
+			isFresh = true;
+		}
+
+		uint32_t weak = (a & 0xffff) | ((b & 0xffff) << 16);
+		uint32_t bit = filterIndex(weak);
+		bool isMatch = false;
+		if (filter[bit / 8] & (1 << (bit % 8))) {
+			auto it = std::lower_bound(table.begin(), table.end(), std::make_pair(weak, (size_t)0));
+			uint8_t strong[Signature::STRONG_SIZE];
+			bool hasStrong = false;
+			for (; it != table.end() && it->first == weak; ++it) {
+				if (!hasStrong) {
+					Signature::strongSum(data + offset, blockSize, strong);
+					hasStrong = true;
+				}
+				if (memcmp(strong, blocks[it->second].strong, Signature::STRONG_SIZE) != 0) {
+					continue;
+				}
+				isMatch = true;
+				if (!present[it->second]) {
+					if (!writeFull(fdTo, data + offset, blockSize, (off_t)it->second * blockSize)) {
+						res = -1;
+						break;
+					}
+					present[it->second] = true;
+					stats.reusedBytes += blockSize;
+				}
+			}
+		}
+		if (res == -1) {
+			break;
+		}
+
+		if (isMatch) {
+			offset += blockSize;
+			isFresh = false;
+			continue;
+		}
+
+		if (offset + blockSize >= oldSize) {
+			break;
+		}
+		uint8_t out = data[offset];
+		uint8_t in = data[offset + blockSize];
+		a = a - out + in;
+		b = b - (uint32_t)blockSize * out + a;
+		offset++;
+	}
+
+	int saved_errno = errno;
+	munmap(map, oldSize);
+	errno = saved_errno;
+	return res;
+}
+
+static int verify(int fd, const Signature& sig)
+{
+	std::vector<uint8_t> buf(1024 * 1024);
+	Sha256 sha;
+	off_t offset = 0;
+	while (true) {
+		ssize_t nread = pread(fd, buf.data(), buf.size(), offset);
+		if (nread < 0 && errno == EINTR) {
+			continue;
+		}
+		if (nread < 0) {
+			return -1;
+		}
+		if (nread == 0) {
+			break;
+		}
+		sha.update(buf.data(), nread);
+		offset += nread;
+	}
+
+	uint8_t digest[Sha256::DIGEST_SIZE];
+	sha.finish(digest);
+	if ((uint64_t)offset != sig.size() || memcmp(digest, sig.fileHash(), sizeof(digest)) != 0) {
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
+int copyFileDelta(int fdFrom, int fdOld, int fdTo, const Signature& sig, RateLimiter* limiter, DeltaStats& stats)
+{
+	if (ftruncate(fdTo, sig.size()) == -1) {
+		return -1;
+	}
+
+	size_t blockSize = sig.blockSize();
+	size_t blockCount = sig.blocks().size();
+	std::vector<bool> present(blockCount, false);
+	if (reuseBlocks(fdOld, fdTo, sig, present, stats) == -1) {
+		return -1;
+	}
+
+	// the missing blocks are fetched in runs
+	size_t block = 0;
+	while (block < blockCount) {
+		if (present[block]) {
+			block++;
+			continue;
+		}
+		size_t first = block;
+		while (block < blockCount && !present[block]) {
+			block++;
+		}
+
+		off_t offset = (off_t)first * blockSize;
+		size_t length = std::min((uint64_t)(block - first) * blockSize, sig.size() - offset);
+		if (copyFileRange(fdFrom, fdTo, offset, length, limiter) == -1) {
+			return -1;
+		}
+		stats.fetchedBytes += length;
+	}
+
+	return verify(fdTo, sig);
+}
@@ -0,0 +1,26 @@
+/*
+ * Copyright (c) 2024 Nils Zweiling
+ *
+ * This file is part of fusecache which is released under the MIT license.
+ * See file LICENSE or go to https://github.com/zwodev/fusecache/tree/master/LICENSE
+ * for full license details.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "RateLimiter.h"
+#include "Signature.h"
+
+struct DeltaStats
+{
+    uint64_t reusedBytes = 0;
+    uint64_t fetchedBytes = 0;
+};
+
+// Rebuilds the file described by sig in fdTo like zsync does: blocks that
+// are found anywhere in the old local copy are taken from there, only the
+// remaining ranges are read from fdFrom. The result is checked against the
+// file hash of the signature.
+int copyFileDelta(int fdFrom, int fdOld, int fdTo, const Signature& sig, RateLimiter* limiter, DeltaStats& stats);
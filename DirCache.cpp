@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2024 Nils Zweiling
+ *
+ * This file is part of fusecache which is released under the MIT license.
+ * See file LICENSE or go to https://github.com/zwodev/fusecache/tree/master/LICENSE
+ * for full license details.
+ */
+
+#include "DirCache.h"
+
+DirCache::DirCache()
+{
+}
+
+DirListing DirCache::lookup(const std::string& path, const struct stat& dirStat)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto it = m_listings.find(path);
+	if (it == m_listings.end()) {
+		return nullptr;
+	}
+
+	const struct timespec& mtime = it->second.mtime;
+	if (mtime.tv_sec != dirStat.st_mtim.tv_sec || mtime.tv_nsec != dirStat.st_mtim.tv_nsec) {
+		m_listings.erase(it);
+		return nullptr;
+	}
+
+	return it->second.entries;
+}
+
+void DirCache::put(const std::string& path, const struct stat& dirStat, DirListing listing)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_listings.size() >= MAX_LISTINGS && m_listings.count(path) == 0) {
+		m_listings.erase(m_listings.begin());
+	}
+
+	Listing& entry = m_listings[path];
+	entry.mtime = dirStat.st_mtim;
+	entry.entries = listing;
+}
+
+void DirCache::invalidate(const std::string& path)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_listings.erase(path);
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2024 Nils Zweiling
+ *
+ * This file is part of fusecache which is released under the MIT license.
+ * See file LICENSE or go to https://github.com/zwodev/fusecache/tree/master/LICENSE
+ * for full license details.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct DirEntry
+{
+    std::string name;
+    struct stat st;
+    bool hasStat;
+};
+
+typedef std::shared_ptr<const std::vector<DirEntry>> DirListing;
+
+// Origin directory listings together with the attributes of every entry.
+// A listing stays valid for as long as the modification time of its
+// directory does not change.
+class DirCache
+{
+
+public:
+    DirCache();
+
+    DirListing lookup(const std::string& path, const struct stat& dirStat);
+    void put(const std::string& path, const struct stat& dirStat, DirListing listing);
+    void invalidate(const std::string& path);
+
+private:
+    struct Listing
+    {
+        struct timespec mtime;
+        DirListing entries;
+    };
+
+private:
+    static const size_t MAX_LISTINGS = 4096;
+
+    std::mutex m_mutex;
+    std::unordered_map<std::string, Listing> m_listings;
+};
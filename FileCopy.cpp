@@ -0,0 +1,217 @@
+/*
+ * Copyright (c) 2024 Nils Zweiling
+ *
+ * This file is part of fusecache which is released under the MIT license.
+ * See file LICENSE or go to https://github.com/zwodev/fusecache/tree/master/LICENSE
+ * for full license details.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <memory>
+
+#include "IoUring.h"
+#include "FileCopy.h"
+
+// 1 MB chunks keep the syscall count low and the rate limiter responsive
+static const size_t CHUNK_SIZE = 1024 * 1024;
+static const size_t BUF_ALIGNMENT = 4096;
+
+enum CopyMethod { COPY_FILE_RANGE, SEND_FILE, READ_WRITE };
+
+// errors that mean the method is not available for this pair of files
+static bool isUnsupported(int err)
+{
+	return err == ENOSYS || err == EXDEV || err == EINVAL || err == EOPNOTSUPP || err == EBADF;
+}
+
+typedef std::unique_ptr<char, decltype(&free)> Buffer;
+
+static char* bufferFor(Buffer& buf)
+{
+	if (!buf) {
+		void* mem = nullptr;
+		if (posix_memalign(&mem, BUF_ALIGNMENT, CHUNK_SIZE) == 0) {
+			buf.reset((char*)mem);
+		}
+	}
+	return buf.get();
+}
+
+static ssize_t writeAll(int fdTo, const char* buf, size_t size, off_t* offset)
+{
+	size_t done = 0;
+	while (done < size) {
+		ssize_t nwritten = offset ? pwrite(fdTo, buf + done, size - done, *offset + done)
+			: write(fdTo, buf + done, size - done);
+		if (nwritten < 0 && errno == EINTR) {
+			continue;
+		}
+		if (nwritten < 0) {
+			return -1;
+		}
+		done += nwritten;
+	}
+	if (offset) {
+		*offset += done;
+	}
+	return done;
+}
+
+// copies up to length bytes with the best method that works, falling back
+// to the next one when the kernel or the filesystem does not support it
+static ssize_t copyChunk(int fdFrom, off_t* offsetFrom, int fdTo, off_t* offsetTo, size_t length, CopyMethod& method, Buffer& buf)
+{
+	while (true) {
+		ssize_t res;
+		if (method == COPY_FILE_RANGE) {
+			res = copy_file_range(fdFrom, offsetFrom, fdTo, offsetTo, length, 0);
+		}
+		else if (method == SEND_FILE) {
+			res = sendfile(fdTo, fdFrom, offsetFrom, length);
+		}
+		else {
+			char* data = bufferFor(buf);
+			if (!data) {
+				errno = ENOMEM;
+				return -1;
+			}
+			res = offsetFrom ? pread(fdFrom, data, length, *offsetFrom) : read(fdFrom, data, length);
+			if (res > 0) {
+				if (offsetFrom) {
+					*offsetFrom += res;
+				}
+				return writeAll(fdTo, data, res, offsetTo);
+			}
+		}
+
+		if (res >= 0) {
+			return res;
+		}
+		if (errno == EINTR) {
+			continue;
+		}
+		if (method == READ_WRITE || !isUnsupported(errno)) {
+			return -1;
+		}
+
+		// sendfile cannot write at an offset
+		method = (method == COPY_FILE_RANGE && !offsetTo) ? SEND_FILE : READ_WRITE;
+	}
+}
+
+int copyFileData(int fdFrom, int fdTo, RateLimiter* limiter)
+{
+	// the io_uring path works on explicit offsets, so a fallback starts from the beginning
+	IoUring* ring = IoUring::forThread();
+	struct stat sb;
+	if (ring && fstat(fdFrom, &sb) == 0 && S_ISREG(sb.st_mode)) {
+		if (ring->copy(fdFrom, fdTo, 0, sb.st_size, limiter) >= 0) {
+			return 0;
+		}
+		if (!isUnsupported(errno)) {
+			return -1;
+		}
+	}
+
+	CopyMethod method = COPY_FILE_RANGE;
+	Buffer buf(nullptr, free);
+	bool isFirst = true;
+
+	while (true) {
+		ssize_t ncopied = copyChunk(fdFrom, nullptr, fdTo, nullptr, CHUNK_SIZE, method, buf);
+		if (ncopied < 0) {
+			return -1;
+		}
+
+		// some filesystems report 0 instead of an error, so an empty first chunk is read again
+		if (ncopied == 0 && isFirst && method != READ_WRITE) {
+			method = READ_WRITE;
+			continue;
+		}
+		if (ncopied == 0) {
+			return 0;
+		}
+		isFirst = false;
+		if (limiter) {
+			limiter->acquire(ncopied);
+		}
+	}
+}
+
+int copyFileRange(int fdFrom, int fdTo, off_t offset, size_t length, RateLimiter* limiter)
+{
+	IoUring* ring = IoUring::forThread();
+	if (ring) {
+		off_t ncopied = ring->copy(fdFrom, fdTo, offset, length, limiter);
+		if (ncopied == (off_t)length) {
+			return 0;
+		}
+		if (ncopied >= 0) {
+			errno = EIO;
+			return -1;
+		}
+		if (!isUnsupported(errno)) {
+			return -1;
+		}
+	}
+
+	CopyMethod method = COPY_FILE_RANGE;
+	Buffer buf(nullptr, free);
+
+	off_t offsetFrom = offset;
+	off_t offsetTo = offset;
+	size_t done = 0;
+	while (done < length) {
+		ssize_t ncopied = copyChunk(fdFrom, &offsetFrom, fdTo, &offsetTo, std::min(CHUNK_SIZE, length - done), method, buf);
+		if (ncopied < 0) {
+			return -1;
+		}
+
+		// some filesystems report 0 instead of an error for copy_file_range
+		if (ncopied == 0) {
+			if (method == READ_WRITE) {
+				errno = EIO;
+				return -1;
+			}
+			method = READ_WRITE;
+			continue;
+		}
+
+		done += ncopied;
+		if (limiter) {
+			limiter->acquire(ncopied);
+		}
+	}
+
+	return 0;
+}
+
+int readFileRange(int fdFrom, char* buf, off_t offset, size_t length, RateLimiter* limiter)
+{
+	size_t done = 0;
+	while (done < length) {
+		ssize_t nread = pread(fdFrom, buf + done, std::min(CHUNK_SIZE, length - done), offset + done);
+		if (nread < 0 && errno == EINTR) {
+			continue;
+		}
+		if (nread <= 0) {
+			if (nread == 0) {
+				errno = EIO;
+			}
+			return -1;
+		}
+
+		done += nread;
+		if (limiter) {
+			limiter->acquire(nread);
+		}
+	}
+
+	return 0;
+}
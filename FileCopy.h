@@ -0,0 +1,17 @@
+/*
+ * Copyright (c) 2024 Nils Zweiling
+ *
+ * This file is part of fusecache which is released under the MIT license.
+ * See file LICENSE or go to https://github.com/zwodev/fusecache/tree/master/LICENSE
+ * for full license details.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+
+#include "RateLimiter.h"
+
+int copyFileData(int fdFrom, int fdTo, RateLimiter* limiter);
+int copyFileRange(int fdFrom, int fdTo, off_t offset, size_t length, RateLimiter* limiter);
+int readFileRange(int fdFrom, char* buf, off_t offset, size_t length, RateLimiter* limiter);
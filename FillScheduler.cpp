@@ -0,0 +1,184 @@
+/*
+ * Copyright (c) 2024 Nils Zweiling
+ *
+ * This file is part of fusecache which is released under the MIT license.
+ * See file LICENSE or go to https://github.com/zwodev/fusecache/tree/master/LICENSE
+ * for full license details.
+ */
+
+#include <algorithm>
+#include <chrono>
+
+#include "Helper.h"
+#include "FillScheduler.h"
+
+thread_local FillTicket* FillScheduler::s_current = nullptr;
+
+FillScheduler::FillScheduler()
+{
+}
+
+FillScheduler::~FillScheduler()
+{
+}
+
+const char* FillScheduler::className(FillClass fillClass)
+{
+	switch (fillClass) {
+		case FILL_OPEN: return "open";
+		case FILL_READAHEAD: return "readahead";
+		case FILL_PREFETCH: return "prefetch";
+		case FILL_REVALIDATE: return "revalidate";
+		default: break;
+	}
+	return "unknown";
+}
+
+bool FillScheduler::canStart(const FillTicket& ticket) const
+{
+	for (int i = 0; i < ticket.fillClass; ++i) {
+		if (m_stats[i].queued > 0) {
+			return false;
+		}
+	}
+
+	int reserved = (ticket.fillClass != FILL_OPEN && m_maxSlots > 1) ? 1 : 0;
+	return m_running < m_maxSlots - reserved;
+}
+
+bool FillScheduler::mustYield(const FillTicket& ticket) const
+{
+	if (ticket.fillClass < FILL_PREFETCH) {
+		return false;
+	}
+
+	for (int i = 0; i < ticket.fillClass; ++i) {
+		if (m_stats[i].queued > 0 || m_stats[i].running > 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void FillScheduler::acquire(FillTicket& ticket)
+{
+	auto queuedAt = std::chrono::steady_clock::now();
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_stats[ticket.fillClass].queued++;
+	m_changed.wait(lock, [this, &ticket] { return canStart(ticket); });
+
+	// the class may have changed while the ticket was queued
+	ClassStats& stats = m_stats[ticket.fillClass];
+	double wait = std::chrono::duration<double>(std::chrono::steady_clock::now() - queuedAt).count();
+	stats.queued--;
+	stats.running++;
+	stats.started++;
+	stats.waitTotal += wait;
+	stats.waitMax = std::max(stats.waitMax, wait);
+	m_running++;
+	ticket.isRunning = true;
+	s_current = &ticket;
+}
+
+void FillScheduler::release(FillTicket& ticket)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stats[ticket.fillClass].running--;
+		m_running--;
+		ticket.isRunning = false;
+		if (s_current == &ticket) {
+			s_current = nullptr;
+		}
+	}
+	m_changed.notify_all();
+}
+
+void FillScheduler::promote(FillTicket& ticket, FillClass fillClass)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (fillClass >= ticket.fillClass) {
+			return;
+		}
+
+		if (ticket.isRunning) {
+			m_stats[ticket.fillClass].running--;
+			m_stats[fillClass].running++;
+		}
+		else {
+			m_stats[ticket.fillClass].queued--;
+			m_stats[fillClass].queued++;
+		}
+		ticket.fillClass = fillClass;
+	}
+	m_changed.notify_all();
+}
+
+void FillScheduler::yield()
+{
+	FillTicket* ticket = s_current;
+	if (!ticket) {
+		return;
+	}
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+	if (!mustYield(*ticket)) {
+		return;
+	}
+
+	// hand the slot back and queue again behind the more urgent fills
+	m_stats[ticket->fillClass].running--;
+	m_stats[ticket->fillClass].queued++;
+	m_stats[ticket->fillClass].preempted++;
+	m_running--;
+	ticket->isRunning = false;
+	m_changed.notify_all();
+
+	m_changed.wait(lock, [this, ticket] { return !mustYield(*ticket) && canStart(*ticket); });
+
+	m_stats[ticket->fillClass].queued--;
+	m_stats[ticket->fillClass].running++;
+	m_running++;
+	ticket->isRunning = true;
+}
+
+std::string FillScheduler::status()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	std::string result = formatStr("slots %d/%d\n", m_running, m_maxSlots);
+	for (int i = 0; i < FILL_CLASS_COUNT; ++i) {
+		const ClassStats& stats = m_stats[i];
+		double waitAvg = stats.started > 0 ? stats.waitTotal / stats.started : 0.0;
+		result += formatStr("class %s running %d queued %d started %llu preempted %llu wait_avg_ms %.1f wait_max_ms %.1f\n",
+			className((FillClass)i), stats.running, stats.queued, (unsigned long long)stats.started,
+			(unsigned long long)stats.preempted, waitAvg * 1000.0, stats.waitMax * 1000.0);
+	}
+	return result;
+}
+
+int FillScheduler::runningCount()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_running;
+}
+
+int FillScheduler::queuedCount()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	int queued = 0;
+	for (int i = 0; i < FILL_CLASS_COUNT; ++i) {
+		queued += m_stats[i].queued;
+	}
+	return queued;
+}
+
+void FillScheduler::setMaxSlots(int maxSlots)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_maxSlots = std::max(1, maxSlots);
+	}
+	m_changed.notify_all();
+}
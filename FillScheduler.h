@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2024 Nils Zweiling
+ *
+ * This file is part of fusecache which is released under the MIT license.
+ * See file LICENSE or go to https://github.com/zwodev/fusecache/tree/master/LICENSE
+ * for full license details.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <mutex>
+#include <condition_variable>
+#include <string>
+
+// Lower values are more urgent.
+enum FillClass
+{
+    FILL_OPEN,
+    FILL_READAHEAD,
+    FILL_PREFETCH,
+    FILL_REVALIDATE,
+    FILL_CLASS_COUNT
+};
+
+struct FillTicket
+{
+    FillClass fillClass = FILL_OPEN;
+    bool isRunning = false;
+};
+
+// Hands out the download slots to fills by class. A fill only starts when
+// no fill of a more urgent class is queued, and every class below
+// FILL_OPEN leaves one slot free for opens. Background fills (prefetch and
+// revalidation) also give up their slot and their share of the bandwidth
+// while more urgent fills are queued or running: they call yield() between
+// chunks and sleep there until the more urgent fills are done.
+class FillScheduler
+{
+
+public:
+    FillScheduler();
+    ~FillScheduler();
+
+    void acquire(FillTicket& ticket);
+    void release(FillTicket& ticket);
+    void promote(FillTicket& ticket, FillClass fillClass);
+    void yield();
+
+    std::string status();
+    int runningCount();
+    int queuedCount();
+
+    void setMaxSlots(int maxSlots);
+
+    static const char* className(FillClass fillClass);
+
+private:
+    bool canStart(const FillTicket& ticket) const;
+    bool mustYield(const FillTicket& ticket) const;
+
+private:
+    struct ClassStats
+    {
+        int queued = 0;
+        int running = 0;
+        uint64_t started = 0;
+        uint64_t preempted = 0;
+        double waitTotal = 0.0;
+        double waitMax = 0.0;
+    };
+
+    std::mutex m_mutex;
+    std::condition_variable m_changed;
+    int m_maxSlots = 4;
+    int m_running = 0;
+    ClassStats m_stats[FILL_CLASS_COUNT];
+
+    static thread_local FillTicket* s_current;
+};
@@ -19,3 +19,41 @@ std::string formatStr(const std::string& format, Args ... args)
     
     return std::string();
 }
+
+// Turns a path below the mount into one relative to a root directory fd
+// without copying it, "/" becomes ".".
+inline const char* relativePath(const char* filePath)
+{
+    while (*filePath == '/') {
+        filePath++;
+    }
+    return *filePath ? filePath : ".";
+}
+
+inline bool hasSuffix(const std::string& str, const std::string& suffix)
+{
+    return str.size() >= suffix.size()
+        && str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// Suffixes of the files kept next to a cached file while it is filled or
+// fetched in blocks. They are reserved, so that user files named like
+// "data.part" are cached and synced like any other file.
+const char PART_SUFFIX[] = ".fusecache.part";
+const char SPARSE_SUFFIX[] = ".fusecache.sparse";
+const char BLOCKS_SUFFIX[] = ".fusecache.blocks";
+
+// Files that fusecache keeps in the cache directory and that are never part
+// of the mount. The log and its rotations, the index, journal, socket and
+// metrics only live in the cache root, files being filled and uploads in
+// progress can be in any directory. Takes a path below the cache root.
+inline bool isInternalFile(const std::string& path)
+{
+    size_t slash = path.find_last_of('/');
+    std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+    if (slash == 0 && (name.compare(0, 13, "fusecache.log") == 0 || name.compare(0, 11, ".fusecache.") == 0)) {
+        return true;
+    }
+    return hasSuffix(name, PART_SUFFIX) || hasSuffix(name, SPARSE_SUFFIX) || hasSuffix(name, BLOCKS_SUFFIX)
+        || (name[0] == '.' && hasSuffix(name, ".fcsync"));
+}
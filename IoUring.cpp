@@ -0,0 +1,368 @@
+/*
+ * Copyright (c) 2024 Nils Zweiling
+ *
+ * This file is part of fusecache which is released under the MIT license.
+ * See file LICENSE or go to https://github.com/zwodev/fusecache/tree/master/LICENSE
+ * for full license details.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include "IoUring.h"
+
+// every request in flight owns one buffer of this size
+static const size_t CHUNK_SIZE = 256 * 1024;
+static const size_t BUF_ALIGNMENT = 4096;
+
+std::atomic<unsigned> IoUring::s_depth { 0 };
+
+static int ioUringSetup(unsigned entries, struct io_uring_params* params)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int ioUringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0);
+}
+
+IoUring::IoUring()
+{
+}
+
+IoUring::~IoUring()
+{
+	if (m_sqes) {
+		munmap(m_sqes, m_sqesSize);
+	}
+	if (m_cqRing && m_cqRing != m_sqRing) {
+		munmap(m_cqRing, m_cqRingSize);
+	}
+	if (m_sqRing) {
+		munmap(m_sqRing, m_sqRingSize);
+	}
+	if (m_fd >= 0) {
+		close(m_fd);
+	}
+	free(m_buffers);
+}
+
+void IoUring::setDepth(unsigned depth)
+{
+	s_depth = depth;
+}
+
+IoUring* IoUring::forThread()
+{
+	unsigned depth = s_depth;
+	if (depth == 0) {
+		return nullptr;
+	}
+
+	// a failed setup is not retried on this thread
+	thread_local std::unique_ptr<IoUring> ring;
+	thread_local bool isFailed = false;
+	if (!ring && !isFailed) {
+		ring.reset(new IoUring());
+		if (ring->init(depth) == -1) {
+			ring.reset();
+			isFailed = true;
+		}
+	}
+	return ring.get();
+}
+
+int IoUring::init(unsigned depth)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	m_fd = ioUringSetup(depth, &params);
+	if (m_fd < 0) {
+		return -1;
+	}
+
+	// IORING_OP_READ and IORING_OP_WRITE arrived in the same release
+	if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		m_sqRingSize = m_cqRingSize = std::max(m_sqRingSize, m_cqRingSize);
+	}
+
+	m_sqRing = mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+	if (m_sqRing == MAP_FAILED) {
+		m_sqRing = nullptr;
+		return -1;
+	}
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		m_cqRing = m_sqRing;
+	}
+	else {
+		m_cqRing = mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+		if (m_cqRing == MAP_FAILED) {
+			m_cqRing = nullptr;
+			return -1;
+		}
+	}
+
+	m_sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	void* sqes = mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED) {
+		return -1;
+	}
+	m_sqes = (struct io_uring_sqe*)sqes;
+
+	char* sq = (char*)m_sqRing;
+	m_sqHead = (unsigned*)(sq + params.sq_off.head);
+	m_sqTail = (unsigned*)(sq + params.sq_off.tail);
+	m_sqMask = (unsigned*)(sq + params.sq_off.ring_mask);
+	m_sqArray = (unsigned*)(sq + params.sq_off.array);
+
+	char* cq = (char*)m_cqRing;
+	m_cqHead = (unsigned*)(cq + params.cq_off.head);
+	m_cqTail = (unsigned*)(cq + params.cq_off.tail);
+	m_cqMask = (unsigned*)(cq + params.cq_off.ring_mask);
+	m_cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+	m_sqeTail = *m_sqTail;
+	m_depth = params.sq_entries;
+	return 0;
+}
+
+unsigned IoUring::depth() const
+{
+	return m_depth;
+}
+
+struct io_uring_sqe* IoUring::getSqe()
+{
+	unsigned head = __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+	if (m_sqeTail - head >= m_depth) {
+		return nullptr;
+	}
+
+	unsigned index = m_sqeTail & *m_sqMask;
+	m_sqArray[index] = index;
+	m_sqeTail++;
+	m_toSubmit++;
+
+	struct io_uring_sqe* sqe = &m_sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+int IoUring::submit(unsigned waitNr)
+{
+	__atomic_store_n(m_sqTail, m_sqeTail, __ATOMIC_RELEASE);
+
+	// entries the kernel did not take yet are submitted with the next call
+	while (true) {
+		int res = ioUringEnter(m_fd, m_toSubmit, waitNr, waitNr > 0 ? IORING_ENTER_GETEVENTS : 0);
+		if (res >= 0) {
+			m_toSubmit -= std::min((unsigned)res, m_toSubmit);
+			return 0;
+		}
+		if (errno != EINTR && errno != EAGAIN) {
+			return -1;
+		}
+	}
+}
+
+bool IoUring::popCqe(struct io_uring_cqe& cqe)
+{
+	unsigned head = *m_cqHead;
+	if (head == __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE)) {
+		return false;
+	}
+
+	cqe = m_cqes[head & *m_cqMask];
+	__atomic_store_n(m_cqHead, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+// Keeps up to depth() chunks in flight. Each slot reads a chunk from the
+// origin and then writes it to the cache file at the same offset, so reads
+// of later chunks overlap with writes of earlier ones. Returns the number
+// of bytes copied, which is less than length if the file ended early.
+off_t IoUring::copy(int fdFrom, int fdTo, off_t offset, off_t length, RateLimiter* limiter)
+{
+	struct Slot
+	{
+		char* buf = nullptr;
+		off_t offset = 0;
+		size_t length = 0;
+		size_t done = 0;
+		bool isWrite = false;
+	};
+
+	// the buffers stay with the ring for the next copy and only grow to the
+	// number of chunks a copy can keep in flight
+	unsigned slotCount = (unsigned)std::max<off_t>(1, std::min<off_t>(m_depth, (length + CHUNK_SIZE - 1) / CHUNK_SIZE));
+	if (m_bufferCount < slotCount) {
+		void* mem = nullptr;
+		if (posix_memalign(&mem, BUF_ALIGNMENT, CHUNK_SIZE * slotCount) != 0) {
+			errno = ENOMEM;
+			return -1;
+		}
+		free(m_buffers);
+		m_buffers = (char*)mem;
+		m_bufferCount = slotCount;
+	}
+
+	std::vector<Slot> slots(slotCount);
+	std::vector<unsigned> freeSlots;
+	for (unsigned i = 0; i < slotCount; ++i) {
+		slots[i].buf = m_buffers + i * CHUNK_SIZE;
+		freeSlots.push_back(slotCount - 1 - i);
+	}
+
+	// ranges still to be read, including the rest of short reads
+	std::deque<std::pair<off_t, size_t>> pending;
+	off_t nextOffset = offset;
+	off_t end = offset + length;
+	unsigned inFlight = 0;
+	int error = 0;
+
+	// a full submission queue ends the copy with an error that makes the
+	// caller fall back to the blocking copy path
+	auto queue = [this](Slot& slot, unsigned index, int fd) {
+		struct io_uring_sqe* sqe = getSqe();
+		if (!sqe) {
+			return false;
+		}
+		sqe->opcode = slot.isWrite ? IORING_OP_WRITE : IORING_OP_READ;
+		sqe->fd = fd;
+		sqe->addr = (uint64_t)(uintptr_t)(slot.buf + slot.done);
+		sqe->len = slot.length - slot.done;
+		sqe->off = slot.offset + slot.done;
+		sqe->user_data = index;
+		return true;
+	};
+
+	while (true) {
+		while (error == 0 && !freeSlots.empty() && (!pending.empty() || nextOffset < end)) {
+			unsigned index = freeSlots.back();
+			freeSlots.pop_back();
+
+			Slot& slot = slots[index];
+			if (!pending.empty()) {
+				slot.offset = pending.front().first;
+				slot.length = pending.front().second;
+				pending.pop_front();
+			}
+			else {
+				slot.offset = nextOffset;
+				slot.length = std::min((off_t)CHUNK_SIZE, end - nextOffset);
+				nextOffset += slot.length;
+			}
+			slot.done = 0;
+			slot.isWrite = false;
+
+			if (limiter) {
+				limiter->acquire(slot.length);
+			}
+			if (!queue(slot, index, fdFrom)) {
+				freeSlots.push_back(index);
+				error = EOPNOTSUPP;
+				break;
+			}
+			inFlight++;
+		}
+
+		if (inFlight == 0) {
+			break;
+		}
+
+		// the kernel may still write into the buffers, so they are left to it and never reused
+		if (submit(1) == -1) {
+			m_buffers = nullptr;
+			m_bufferCount = 0;
+			return -1;
+		}
+
+		struct io_uring_cqe cqe;
+		while (popCqe(cqe)) {
+			unsigned index = (unsigned)cqe.user_data;
+			Slot& slot = slots[index];
+			inFlight--;
+
+			if (cqe.res == -EINTR || cqe.res == -EAGAIN) {
+				if (error == 0) {
+					if (queue(slot, index, slot.isWrite ? fdTo : fdFrom)) {
+						inFlight++;
+						continue;
+					}
+					error = EOPNOTSUPP;
+				}
+			}
+			else if (cqe.res < 0) {
+				if (error == 0) {
+					error = -cqe.res;
+				}
+			}
+			else if (!slot.isWrite) {
+				// the file ended earlier than expected
+				if (cqe.res == 0) {
+					end = std::min(end, slot.offset);
+					freeSlots.push_back(index);
+					continue;
+				}
+				if ((size_t)cqe.res < slot.length) {
+					pending.emplace_back(slot.offset + cqe.res, slot.length - cqe.res);
+					slot.length = cqe.res;
+				}
+				if (error == 0) {
+					slot.isWrite = true;
+					slot.done = 0;
+					if (queue(slot, index, fdTo)) {
+						inFlight++;
+						continue;
+					}
+					error = EOPNOTSUPP;
+				}
+			}
+			else if (cqe.res == 0) {
+				if (error == 0) {
+					error = EIO;
+				}
+			}
+			else {
+				slot.done += cqe.res;
+				if (slot.done < slot.length && error == 0) {
+					if (queue(slot, index, fdTo)) {
+						inFlight++;
+						continue;
+					}
+					error = EOPNOTSUPP;
+				}
+			}
+			freeSlots.push_back(index);
+		}
+
+		// drop ranges past a shortened end
+		while (!pending.empty() && pending.back().first >= end) {
+			pending.pop_back();
+		}
+	}
+
+	if (error != 0) {
+		errno = error;
+		return -1;
+	}
+	return end - offset;
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2024 Nils Zweiling
+ *
+ * This file is part of fusecache which is released under the MIT license.
+ * See file LICENSE or go to https://github.com/zwodev/fusecache/tree/master/LICENSE
+ * for full license details.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <atomic>
+#include <linux/io_uring.h>
+
+#include "RateLimiter.h"
+
+// Minimal io_uring wrapper on top of the raw syscalls, so that no extra
+// library is needed. Rings are not shared between threads: every thread
+// that copies data gets its own ring from forThread(). The backend is off
+// until a queue depth is set, and threads fall back to the blocking copy
+// path when the kernel does not support io_uring.
+class IoUring
+{
+
+public:
+    IoUring();
+    ~IoUring();
+
+    int init(unsigned depth);
+    unsigned depth() const;
+
+    off_t copy(int fdFrom, int fdTo, off_t offset, off_t length, RateLimiter* limiter);
+
+    static void setDepth(unsigned depth);
+    static IoUring* forThread();
+
+private:
+    struct io_uring_sqe* getSqe();
+    int submit(unsigned waitNr);
+    bool popCqe(struct io_uring_cqe& cqe);
+
+private:
+    int m_fd = -1;
+    unsigned m_depth = 0;
+    void* m_sqRing = nullptr;
+    void* m_cqRing = nullptr;
+    size_t m_sqRingSize = 0;
+    size_t m_cqRingSize = 0;
+    struct io_uring_sqe* m_sqes = nullptr;
+    size_t m_sqesSize = 0;
+    unsigned* m_sqHead = nullptr;
+    unsigned* m_sqTail = nullptr;
+    unsigned* m_sqMask = nullptr;
+    unsigned* m_sqArray = nullptr;
+    unsigned* m_cqHead = nullptr;
+    unsigned* m_cqTail = nullptr;
+    unsigned* m_cqMask = nullptr;
+    struct io_uring_cqe* m_cqes = nullptr;
+    unsigned m_sqeTail = 0;
+    unsigned m_toSubmit = 0;
+    char* m_buffers = nullptr;
+    unsigned m_bufferCount = 0;
+
+    static std::atomic<unsigned> s_depth;
+};
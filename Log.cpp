@@ -0,0 +1,257 @@
+/*
+ * Copyright (c) 2024 Nils Zweiling
+ *
+ * This file is part of fusecache which is released under the MIT license.
+ * See file LICENSE or go to https://github.com/zwodev/fusecache/tree/master/LICENSE
+ * for full license details.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+
+#include "Log.h"
+
+static const char* LEVEL_NAMES[] = { "DEBUG", "INFO", "WARNING", "ERROR" };
+
+// a batch is written once it reaches this size, even if more messages are waiting
+static const size_t MAX_BATCH_SIZE = 1024 * 1024;
+
+static void writeAll(int fd, const char* data, size_t size)
+{
+	size_t done = 0;
+	while (done < size) {
+		ssize_t nwritten = write(fd, data + done, size - done);
+		if (nwritten < 0 && errno == EINTR) {
+			continue;
+		}
+		if (nwritten < 0) {
+			return;
+		}
+		done += nwritten;
+	}
+}
+
+// Logs nothing, all messages are filtered out.
+Log::Log()
+{
+	m_level = LEVEL_ERROR + 1;
+}
+
+Log::Log(const std::string& filename, bool logToCommandline)
+{
+	m_logToCommandline = logToCommandline;
+	m_filename = filename;
+	m_fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (m_fd < 0) {
+		fprintf(stderr, "Error opening log file.\n");
+	}
+	else {
+		struct stat sb;
+		m_fileSize = fstat(m_fd, &sb) == 0 ? sb.st_size : 0;
+	}
+
+	m_slots.reset(new Slot[CAPACITY]);
+	for (size_t i = 0; i < CAPACITY; ++i) {
+		m_slots[i].sequence.store(i, std::memory_order_relaxed);
+	}
+
+	m_isRunning = true;
+	m_thread = std::thread(&Log::run, this);
+}
+
+Log::~Log()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_isRunning = false;
+	}
+	m_wakeUp.notify_all();
+
+	if (m_thread.joinable()) {
+		m_thread.join();
+	}
+	if (m_fd >= 0) {
+		close(m_fd);
+	}
+}
+
+// Bounded multi-producer queue after Dmitry Vyukov. Every slot carries a
+// sequence number that tells producers and the consumer whose turn it is.
+void Log::push(Level level, std::string&& message)
+{
+	size_t pos = m_enqueuePos.load(std::memory_order_relaxed);
+	Slot* slot = nullptr;
+	while (true) {
+		slot = &m_slots[pos % CAPACITY];
+		size_t sequence = slot->sequence.load(std::memory_order_acquire);
+		intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+		if (diff == 0) {
+			if (m_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+				break;
+			}
+		}
+		else if (diff < 0) {
+			m_dropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		else {
+			pos = m_enqueuePos.load(std::memory_order_relaxed);
+		}
+	}
+
+	slot->level = level;
+	clock_gettime(CLOCK_REALTIME, &slot->time);
+	slot->message = std::move(message);
+	slot->sequence.store(pos + 1, std::memory_order_release);
+	m_pushed.fetch_add(1, std::memory_order_relaxed);
+
+	// everything else is picked up by the writer's next poll, unless the buffer fills up quickly
+	if (level >= LEVEL_WARNING || pos % (CAPACITY / 8) == 0) {
+		m_wakeUp.notify_one();
+	}
+}
+
+bool Log::pop(Entry& entry)
+{
+	Slot& slot = m_slots[m_dequeuePos % CAPACITY];
+	if (slot.sequence.load(std::memory_order_acquire) != m_dequeuePos + 1) {
+		return false;
+	}
+
+	entry.level = slot.level;
+	entry.time = slot.time;
+	entry.message.swap(slot.message);
+	slot.message.clear();
+	slot.sequence.store(m_dequeuePos + CAPACITY, std::memory_order_release);
+	m_dequeuePos++;
+	return true;
+}
+
+void Log::run()
+{
+	std::string batch;
+	Entry entry;
+	time_t lastSecond = -1;
+	char timestamp[32] = {};
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (true) {
+		lock.unlock();
+
+		uint64_t count = 0;
+		batch.clear();
+		while (batch.size() < MAX_BATCH_SIZE && pop(entry)) {
+			if (entry.time.tv_sec != lastSecond) {
+				struct tm timeinfo;
+				localtime_r(&entry.time.tv_sec, &timeinfo);
+				strftime(timestamp, sizeof(timestamp), "[%Y-%m-%d %H:%M:%S] ", &timeinfo);
+				lastSecond = entry.time.tv_sec;
+			}
+			batch += timestamp;
+			batch += LEVEL_NAMES[entry.level];
+			batch += ": ";
+			batch += entry.message;
+			batch += '\n';
+			count++;
+		}
+
+		uint64_t dropped = m_dropped.exchange(0, std::memory_order_relaxed);
+		if (dropped > 0) {
+			batch += formatStr("%sWARNING: %llu log messages dropped\n", timestamp, (unsigned long long)dropped);
+		}
+		if (!batch.empty()) {
+			writeBatch(batch);
+		}
+
+		lock.lock();
+		if (count > 0) {
+			m_written += count;
+			m_flushed.notify_all();
+			continue;
+		}
+		if (!m_isRunning) {
+			break;
+		}
+		m_wakeUp.wait_for(lock, std::chrono::milliseconds(50));
+	}
+}
+
+void Log::writeBatch(const std::string& batch)
+{
+	if (m_logToCommandline) {
+		writeAll(STDOUT_FILENO, batch.data(), batch.size());
+	}
+	if (m_fd < 0) {
+		return;
+	}
+
+	uint64_t maxSize = m_maxSize.load(std::memory_order_relaxed);
+	if (maxSize > 0 && m_fileSize > 0 && m_fileSize + batch.size() > maxSize) {
+		rotate();
+	}
+	writeAll(m_fd, batch.data(), batch.size());
+	m_fileSize += batch.size();
+}
+
+// "fusecache.log" becomes "fusecache.log.1", the oldest file is removed.
+void Log::rotate()
+{
+	int maxFiles = m_maxFiles.load(std::memory_order_relaxed);
+	close(m_fd);
+	if (maxFiles > 0) {
+		for (int i = maxFiles - 1; i >= 1; --i) {
+			rename(formatStr("%s.%d", m_filename.c_str(), i).c_str(), formatStr("%s.%d", m_filename.c_str(), i + 1).c_str());
+		}
+		rename(m_filename.c_str(), (m_filename + ".1").c_str());
+	}
+	else {
+		unlink(m_filename.c_str());
+	}
+
+	m_fd = open(m_filename.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	m_fileSize = 0;
+}
+
+// Waits until every message logged so far is written.
+void Log::flush()
+{
+	uint64_t target = m_pushed.load(std::memory_order_relaxed);
+	std::unique_lock<std::mutex> lock(m_mutex);
+	if (!m_isRunning) {
+		return;
+	}
+	m_wakeUp.notify_one();
+	m_flushed.wait(lock, [this, target] { return m_written >= target || !m_isRunning; });
+}
+
+void Log::setLevel(Level level)
+{
+	m_level = level;
+}
+
+void Log::setMaxSize(uint64_t bytes)
+{
+	m_maxSize = bytes;
+}
+
+void Log::setMaxFiles(int files)
+{
+	m_maxFiles = std::max(0, files);
+}
+
+bool Log::parseLevel(const std::string& name, Level& level)
+{
+	for (int i = LEVEL_DEBUG; i <= LEVEL_ERROR; ++i) {
+		if (strcasecmp(name.c_str(), LEVEL_NAMES[i]) == 0) {
+			level = (Level)i;
+			return true;
+		}
+	}
+	return false;
+}
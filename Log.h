@@ -8,74 +8,135 @@
 
 #pragma once
 
-#include <ctime> 
-#include <fstream> 
-#include <iostream> 
-#include <sstream> 
+#include <time.h>
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <memory>
+#include <string>
+
+#include "Helper.h"
+
+// Messages below this level are compiled out, e.g. -DFUSECACHE_LOG_LEVEL=1
+// removes all debug messages including the formatting of their arguments.
+#ifndef FUSECACHE_LOG_LEVEL
+#define FUSECACHE_LOG_LEVEL 0
+#endif
+
+// Asynchronous log. Threads that log only format their message and push it
+// into a lock-free ring buffer. A writer thread takes the messages out in
+// batches, adds the timestamps and writes each batch with one write call.
+// When the buffer is full, messages are dropped and counted instead of
+// blocking the caller. The file is rotated when it grows beyond the
+// maximum size.
+class Log {
 
-class Log { 
-    
 public:
-    Log () {}
-
-    Log(const std::string& filename, bool logToCommandline = false) 
-    { 
-        m_logToCommandline = false;
-        m_filename = filename;
-        m_logFile.open(filename, std::ios::app | std::ios::out); 
-        if (!m_logFile.is_open()) { 
-            std::cerr << "Error opening log file." << std::endl; 
-        } 
-    } 
-  
-    ~Log()
-    { 
-        m_logFile.close(); 
-    } 
-  
-    void debug(const std::string& message) {
-        writeLog("DEBUG", message);
+    enum Level { LEVEL_DEBUG = 0, LEVEL_INFO = 1, LEVEL_WARNING = 2, LEVEL_ERROR = 3 };
+
+    Log();
+    Log(const std::string& filename, bool logToCommandline = false);
+    ~Log();
+
+    template<typename ... Args>
+    void debug(const char* format, Args ... args) {
+        if constexpr (LEVEL_DEBUG >= FUSECACHE_LOG_LEVEL) {
+            log(LEVEL_DEBUG, format, args ...);
+        }
     }
 
-    void info(const std::string& message) {
-        writeLog("INFO", message);
+    template<typename ... Args>
+    void info(const char* format, Args ... args) {
+        if constexpr (LEVEL_INFO >= FUSECACHE_LOG_LEVEL) {
+            log(LEVEL_INFO, format, args ...);
+        }
     }
 
-    void warning(const std::string& message) {
-        writeLog("WARNING", message);
+    template<typename ... Args>
+    void warning(const char* format, Args ... args) {
+        if constexpr (LEVEL_WARNING >= FUSECACHE_LOG_LEVEL) {
+            log(LEVEL_WARNING, format, args ...);
+        }
     }
 
-    void error(const std::string& message) {
-        writeLog("ERROR", message);
+    template<typename ... Args>
+    void error(const char* format, Args ... args) {
+        if constexpr (LEVEL_ERROR >= FUSECACHE_LOG_LEVEL) {
+            log(LEVEL_ERROR, format, args ...);
+        }
     }
 
+    void debug(const std::string& message) { debug("%s", message.c_str()); }
+    void info(const std::string& message) { info("%s", message.c_str()); }
+    void warning(const std::string& message) { warning("%s", message.c_str()); }
+    void error(const std::string& message) { error("%s", message.c_str()); }
+
+    void flush();
+
+    void setLevel(Level level);
+    void setMaxSize(uint64_t bytes);
+    void setMaxFiles(int files);
+
+    static bool parseLevel(const std::string& name, Level& level);
+
 private:
-    void writeLog(const std::string& level, const std::string& message) 
-    { 
-        time_t now = time(0); 
-        tm* timeinfo = localtime(&now); 
-        char timestamp[20]; 
-        strftime(timestamp, sizeof(timestamp), 
-                 "%Y-%m-%d %H:%M:%S", timeinfo); 
-  
-        std::ostringstream logEntry; 
-        logEntry << "[" << timestamp << "] "
-                 << level << ": " << message 
-                 << std::endl; 
-  
-        if (m_logToCommandline) {
-            std::cout << logEntry.str();
-        } 
-  
-        if (m_logFile.is_open()) { 
-            m_logFile << logEntry.str(); 
-            m_logFile 
-                .flush();
+    struct Slot
+    {
+        std::atomic<size_t> sequence;
+        Level level;
+        struct timespec time;
+        std::string message;
+    };
+
+    struct Entry
+    {
+        Level level;
+        struct timespec time;
+        std::string message;
+    };
+
+    template<typename ... Args>
+    void log(Level level, const char* format, Args ... args) {
+        if (level < m_level) {
+            return;
+        }
+        if constexpr (sizeof...(args) == 0) {
+            push(level, format);
+        }
+        else {
+            push(level, formatStr(format, args ...));
         }
     }
 
+    void push(Level level, std::string&& message);
+    bool pop(Entry& entry);
+    void run();
+    void writeBatch(const std::string& batch);
+    void rotate();
+
 private:
-    std::ofstream m_logFile;
+    static const size_t CAPACITY = 65536;
+
+    std::unique_ptr<Slot[]> m_slots;
+    std::atomic<size_t> m_enqueuePos { 0 };
+    size_t m_dequeuePos = 0;
+    std::atomic<uint64_t> m_dropped { 0 };
+    std::atomic<uint64_t> m_pushed { 0 };
+    uint64_t m_written = 0;
+    std::atomic<int> m_level { LEVEL_DEBUG };
+
+    std::mutex m_mutex;
+    std::condition_variable m_wakeUp;
+    std::condition_variable m_flushed;
+    std::thread m_thread;
+    bool m_isRunning = false;
+
+    int m_fd = -1;
+    uint64_t m_fileSize = 0;
+    std::atomic<uint64_t> m_maxSize { 64ull * 1024 * 1024 };
+    std::atomic<int> m_maxFiles { 3 };
     std::string m_filename;
     bool m_logToCommandline = false;
-};
\ No newline at end of file
+};
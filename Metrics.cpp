@@ -0,0 +1,440 @@
+/*
+ * Copyright (c) 2024 Nils Zweiling
+ *
+ * This file is part of fusecache which is released under the MIT license.
+ * See file LICENSE or go to https://github.com/zwodev/fusecache/tree/master/LICENSE
+ * for full license details.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include "Helper.h"
+#include "Metrics.h"
+
+static const int SUB_BITS = 3;
+static const int SUB_COUNT = 1 << SUB_BITS;
+static const int MAX_EXPONENT = 39;
+static const int BUCKET_COUNT = (MAX_EXPONENT - SUB_BITS + 2) * SUB_COUNT;
+
+// the exported histogram buckets are the powers of two from about 1 us to 1 min
+static const int FIRST_EXPORT_EXPONENT = 10;
+static const int LAST_EXPORT_EXPONENT = 36;
+
+static const char* OP_NAMES[OP_COUNT] = {
+	"getattr", "access", "readdir", "mkdir", "unlink", "rmdir", "rename", "chmod", "chown",
+	"open", "create", "read", "write", "statfs", "release", "lseek", "truncate", "fsync", "utimens"
+};
+
+static const char* COUNTER_NAMES[METRIC_COUNTER_COUNT][2] = {
+	{ "fusecache_cache_hits_total", "Opens served from the read cache." },
+	{ "fusecache_cache_misses_total", "Opens that had to fetch from the origin." },
+	{ "fusecache_revalidations_total", "Checks of cached files against the origin." },
+	{ "fusecache_fills_total", "Files copied from the origin." },
+	{ "fusecache_fill_errors_total", "Failed copies from the origin." },
+	{ "fusecache_block_fetches_total", "Blocks fetched from the origin in chunked mode." },
+	{ "fusecache_read_bytes_total", "Bytes read through the mount." },
+	{ "fusecache_write_bytes_total", "Bytes written through the mount." }
+};
+
+struct ThreadMetrics
+{
+	std::atomic<uint64_t> counters[METRIC_COUNTER_COUNT];
+	std::atomic<uint64_t> opCount[OP_COUNT];
+	std::atomic<uint64_t> opErrors[OP_COUNT];
+	std::atomic<uint64_t> opNanos[OP_COUNT];
+	std::atomic<uint64_t> buckets[OP_COUNT][BUCKET_COUNT];
+};
+
+struct Totals
+{
+	uint64_t counters[METRIC_COUNTER_COUNT];
+	uint64_t opCount[OP_COUNT];
+	uint64_t opErrors[OP_COUNT];
+	uint64_t opNanos[OP_COUNT];
+	uint64_t buckets[OP_COUNT][BUCKET_COUNT];
+};
+
+struct Registry
+{
+	std::mutex mutex;
+	std::vector<ThreadMetrics*> threads;
+	ThreadMetrics retired;
+};
+
+// never destroyed, so that threads exiting after main() can still retire their counts
+static Registry& registry()
+{
+	static Registry* s_registry = new Registry();
+	return *s_registry;
+}
+
+static void merge(uint64_t* to, const std::atomic<uint64_t>* from, size_t count)
+{
+	for (size_t i = 0; i < count; ++i) {
+		to[i] += from[i].load(std::memory_order_relaxed);
+	}
+}
+
+static void merge(Totals& to, const ThreadMetrics& from)
+{
+	merge(to.counters, from.counters, METRIC_COUNTER_COUNT);
+	merge(to.opCount, from.opCount, OP_COUNT);
+	merge(to.opErrors, from.opErrors, OP_COUNT);
+	merge(to.opNanos, from.opNanos, OP_COUNT);
+	merge(&to.buckets[0][0], &from.buckets[0][0], OP_COUNT * BUCKET_COUNT);
+}
+
+static void retire(std::atomic<uint64_t>* to, const std::atomic<uint64_t>* from, size_t count)
+{
+	for (size_t i = 0; i < count; ++i) {
+		to[i].fetch_add(from[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+	}
+}
+
+struct ThreadSlot
+{
+	ThreadMetrics* metrics = nullptr;
+
+	~ThreadSlot()
+	{
+		if (!metrics) {
+			return;
+		}
+
+		Registry& reg = registry();
+		std::lock_guard<std::mutex> lock(reg.mutex);
+		for (size_t i = 0; i < reg.threads.size(); ++i) {
+			if (reg.threads[i] == metrics) {
+				reg.threads.erase(reg.threads.begin() + i);
+				break;
+			}
+		}
+
+		ThreadMetrics& retired = reg.retired;
+		retire(retired.counters, metrics->counters, METRIC_COUNTER_COUNT);
+		retire(retired.opCount, metrics->opCount, OP_COUNT);
+		retire(retired.opErrors, metrics->opErrors, OP_COUNT);
+		retire(retired.opNanos, metrics->opNanos, OP_COUNT);
+		retire(&retired.buckets[0][0], &metrics->buckets[0][0], OP_COUNT * BUCKET_COUNT);
+		delete metrics;
+	}
+};
+
+static thread_local ThreadSlot s_slot;
+
+static ThreadMetrics& threadMetrics()
+{
+	if (!s_slot.metrics) {
+		ThreadMetrics* metrics = new ThreadMetrics();
+		Registry& reg = registry();
+		std::lock_guard<std::mutex> lock(reg.mutex);
+		reg.threads.push_back(metrics);
+		s_slot.metrics = metrics;
+	}
+	return *s_slot.metrics;
+}
+
+// only the owning thread writes, so a load and a store are enough
+static inline void add(std::atomic<uint64_t>& value, uint64_t n)
+{
+	value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+static inline int bucketFor(uint64_t nanos)
+{
+	if (nanos < (uint64_t)SUB_COUNT) {
+		return nanos;
+	}
+
+	int exponent = 63 - __builtin_clzll(nanos);
+	if (exponent > MAX_EXPONENT) {
+		return BUCKET_COUNT - 1;
+	}
+	return (exponent - SUB_BITS + 1) * SUB_COUNT + ((nanos >> (exponent - SUB_BITS)) & (SUB_COUNT - 1));
+}
+
+static uint64_t bucketLower(int bucket)
+{
+	if (bucket < SUB_COUNT) {
+		return bucket;
+	}
+
+	int exponent = bucket / SUB_COUNT + SUB_BITS - 1;
+	return (uint64_t)(SUB_COUNT + bucket % SUB_COUNT) << (exponent - SUB_BITS);
+}
+
+static uint64_t bucketUpper(int bucket)
+{
+	return bucket + 1 < BUCKET_COUNT ? bucketLower(bucket + 1) : bucketLower(bucket) * 2;
+}
+
+// the middle of the fine bucket the quantile falls into
+static double quantileNanos(const uint64_t* buckets, uint64_t count, double quantile)
+{
+	uint64_t rank = std::max((uint64_t)1, (uint64_t)ceil(quantile * count));
+	uint64_t cumulative = 0;
+	int bucket = 0;
+	while (bucket < BUCKET_COUNT - 1 && cumulative + buckets[bucket] < rank) {
+		cumulative += buckets[bucket++];
+	}
+	return (bucketLower(bucket) + bucketUpper(bucket)) / 2.0;
+}
+
+// the fine buckets summed up to the exported powers of two
+static std::string histogramText(const std::string& name, const std::string& labels, const uint64_t* buckets,
+	uint64_t count, uint64_t nanos)
+{
+	std::string text;
+	std::string separator = labels.empty() ? "" : ",";
+	uint64_t cumulative = 0;
+	int bucket = 0;
+	for (int exponent = FIRST_EXPORT_EXPONENT; exponent <= LAST_EXPORT_EXPONENT; ++exponent) {
+		uint64_t limit = 1ull << exponent;
+		while (bucket < BUCKET_COUNT && bucketUpper(bucket) <= limit) {
+			cumulative += buckets[bucket++];
+		}
+		text += formatStr("%s_bucket{%s%sle=\"%.9g\"} %llu\n", name.c_str(), labels.c_str(), separator.c_str(),
+			limit / 1e9, (unsigned long long)cumulative);
+	}
+	text += formatStr("%s_bucket{%s%sle=\"+Inf\"} %llu\n", name.c_str(), labels.c_str(), separator.c_str(),
+		(unsigned long long)count);
+
+	std::string suffix = labels.empty() ? "" : "{" + labels + "}";
+	text += formatStr("%s_sum%s %.9g\n", name.c_str(), suffix.c_str(), nanos / 1e9);
+	text += formatStr("%s_count%s %llu\n", name.c_str(), suffix.c_str(), (unsigned long long)count);
+	return text;
+}
+
+Histogram::Histogram()
+	: m_buckets(new std::atomic<uint64_t>[BUCKET_COUNT])
+{
+	for (int i = 0; i < BUCKET_COUNT; ++i) {
+		m_buckets[i] = 0;
+	}
+}
+
+void Histogram::record(uint64_t nanos)
+{
+	m_buckets[bucketFor(nanos)].fetch_add(1, std::memory_order_relaxed);
+	m_nanos.fetch_add(nanos, std::memory_order_relaxed);
+	m_count.fetch_add(1, std::memory_order_relaxed);
+}
+
+uint64_t Histogram::count()
+{
+	return m_count.load(std::memory_order_relaxed);
+}
+
+double Histogram::quantile(double fraction)
+{
+	std::vector<uint64_t> buckets(BUCKET_COUNT);
+	merge(buckets.data(), m_buckets.get(), BUCKET_COUNT);
+	uint64_t count = 0;
+	for (uint64_t n : buckets) {
+		count += n;
+	}
+	return count > 0 ? quantileNanos(buckets.data(), count, fraction) : 0.0;
+}
+
+Metrics::Metrics(Log* log)
+{
+	m_log = log;
+}
+
+Metrics::~Metrics()
+{
+	stop();
+}
+
+void Metrics::start()
+{
+	if (m_isRunning || m_path.empty() || m_interval <= 0) {
+		return;
+	}
+
+	m_isRunning = true;
+	m_thread = std::thread(&Metrics::run, this);
+}
+
+void Metrics::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_isRunning = false;
+	}
+	m_wakeUp.notify_all();
+
+	if (m_thread.joinable()) {
+		m_thread.join();
+	}
+}
+
+void Metrics::run()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (m_isRunning) {
+		m_wakeUp.wait_for(lock, std::chrono::seconds(m_interval));
+
+		lock.unlock();
+		if (writeFile() == -1) {
+			m_log->warning("METRICS WARNING - cannot write: %s", m_path.c_str());
+		}
+		lock.lock();
+	}
+}
+
+// Written to a temporary name first, so that scrapers never read a partial file.
+int Metrics::writeFile()
+{
+	std::string text = exportText();
+	std::string tmp = m_path + ".tmp";
+	int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		return -1;
+	}
+
+	size_t done = 0;
+	while (done < text.size()) {
+		ssize_t nwritten = write(fd, text.data() + done, text.size() - done);
+		if (nwritten < 0 && errno == EINTR) {
+			continue;
+		}
+		if (nwritten < 0) {
+			break;
+		}
+		done += nwritten;
+	}
+
+	if (close(fd) == -1 || done < text.size() || rename(tmp.c_str(), m_path.c_str()) == -1) {
+		unlink(tmp.c_str());
+		return -1;
+	}
+	return 0;
+}
+
+void Metrics::addGauge(const std::string& name, const std::string& help, std::function<double()> value)
+{
+	m_values.push_back(Value { name, help, "gauge", value });
+}
+
+void Metrics::addCounter(const std::string& name, const std::string& help, std::function<double()> value)
+{
+	m_values.push_back(Value { name, help, "counter", value });
+}
+
+void Metrics::addHistogram(const std::string& name, const std::string& help, Histogram* histogram)
+{
+	m_histograms.push_back(HistogramValue { name, help, histogram });
+}
+
+std::string Metrics::exportText()
+{
+	std::unique_ptr<Totals> totals = std::make_unique<Totals>();
+	{
+		Registry& reg = registry();
+		std::lock_guard<std::mutex> lock(reg.mutex);
+		merge(*totals, reg.retired);
+		for (ThreadMetrics* metrics : reg.threads) {
+			merge(*totals, *metrics);
+		}
+	}
+
+	const uint64_t* counters = totals->counters;
+	const uint64_t* opCount = totals->opCount;
+	const uint64_t* opErrors = totals->opErrors;
+	const uint64_t* opNanos = totals->opNanos;
+	const uint64_t (*buckets)[BUCKET_COUNT] = totals->buckets;
+
+	std::string text;
+	text += "# HELP fusecache_op_duration_seconds Latency of FUSE operations.\n";
+	text += "# TYPE fusecache_op_duration_seconds histogram\n";
+	for (int op = 0; op < OP_COUNT; ++op) {
+		if (opCount[op] == 0) {
+			continue;
+		}
+
+		text += histogramText("fusecache_op_duration_seconds", formatStr("op=\"%s\"", OP_NAMES[op]), buckets[op],
+			opCount[op], opNanos[op]);
+	}
+
+	// quantiles from the fine buckets, at the middle of the bucket they fall into
+	text += "# HELP fusecache_op_duration_quantile_seconds Latency quantiles of FUSE operations.\n";
+	text += "# TYPE fusecache_op_duration_quantile_seconds gauge\n";
+	for (int op = 0; op < OP_COUNT; ++op) {
+		if (opCount[op] == 0) {
+			continue;
+		}
+
+		for (double quantile : { 0.5, 0.9, 0.99, 0.999 }) {
+			double nanos = quantileNanos(buckets[op], opCount[op], quantile);
+			text += formatStr("fusecache_op_duration_quantile_seconds{op=\"%s\",quantile=\"%g\"} %.9g\n",
+				OP_NAMES[op], quantile, nanos / 1e9);
+		}
+	}
+
+	text += "# HELP fusecache_op_errors_total FUSE operations that returned an error.\n";
+	text += "# TYPE fusecache_op_errors_total counter\n";
+	for (int op = 0; op < OP_COUNT; ++op) {
+		if (opCount[op] > 0) {
+			text += formatStr("fusecache_op_errors_total{op=\"%s\"} %llu\n", OP_NAMES[op], (unsigned long long)opErrors[op]);
+		}
+	}
+
+	for (int i = 0; i < METRIC_COUNTER_COUNT; ++i) {
+		text += formatStr("# HELP %s %s\n# TYPE %s counter\n%s %llu\n", COUNTER_NAMES[i][0], COUNTER_NAMES[i][1],
+			COUNTER_NAMES[i][0], COUNTER_NAMES[i][0], (unsigned long long)counters[i]);
+	}
+
+	for (const Value& value : m_values) {
+		text += formatStr("# HELP %s %s\n# TYPE %s %s\n%s %.17g\n", value.name.c_str(), value.help.c_str(),
+			value.name.c_str(), value.type.c_str(), value.name.c_str(), value.value());
+	}
+
+	// counted from the buckets, so the +Inf bucket always matches the count
+	for (const HistogramValue& value : m_histograms) {
+		std::vector<uint64_t> histogramBuckets(BUCKET_COUNT);
+		merge(histogramBuckets.data(), value.histogram->m_buckets.get(), BUCKET_COUNT);
+		uint64_t nanos = value.histogram->m_nanos.load(std::memory_order_relaxed);
+		uint64_t count = 0;
+		for (uint64_t n : histogramBuckets) {
+			count += n;
+		}
+		text += formatStr("# HELP %s %s\n# TYPE %s histogram\n", value.name.c_str(), value.help.c_str(), value.name.c_str());
+		text += histogramText(value.name, "", histogramBuckets.data(), count, nanos);
+	}
+
+	return text;
+}
+
+void Metrics::setPath(const std::string& path)
+{
+	m_path = path;
+}
+
+void Metrics::setInterval(int seconds)
+{
+	m_interval = seconds;
+}
+
+void Metrics::count(MetricCounter counter, uint64_t n)
+{
+	add(threadMetrics().counters[counter], n);
+}
+
+void Metrics::recordOp(MetricOp op, uint64_t nanos, bool isError)
+{
+	ThreadMetrics& metrics = threadMetrics();
+	add(metrics.opCount[op], 1);
+	add(metrics.opNanos[op], nanos);
+	add(metrics.buckets[op][bucketFor(nanos)], 1);
+	if (isError) {
+		add(metrics.opErrors[op], 1);
+	}
+}
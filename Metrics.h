@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2024 Nils Zweiling
+ *
+ * This file is part of fusecache which is released under the MIT license.
+ * See file LICENSE or go to https://github.com/zwodev/fusecache/tree/master/LICENSE
+ * for full license details.
+ */
+
+#pragma once
+
+#include <time.h>
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Log.h"
+
+enum MetricOp
+{
+    OP_GETATTR,
+    OP_ACCESS,
+    OP_READDIR,
+    OP_MKDIR,
+    OP_UNLINK,
+    OP_RMDIR,
+    OP_RENAME,
+    OP_CHMOD,
+    OP_CHOWN,
+    OP_OPEN,
+    OP_CREATE,
+    OP_READ,
+    OP_WRITE,
+    OP_STATFS,
+    OP_RELEASE,
+    OP_LSEEK,
+    OP_TRUNCATE,
+    OP_FSYNC,
+    OP_UTIMENS,
+    OP_COUNT
+};
+
+enum MetricCounter
+{
+    METRIC_CACHE_HITS,
+    METRIC_CACHE_MISSES,
+    METRIC_REVALIDATIONS,
+    METRIC_FILLS,
+    METRIC_FILL_ERRORS,
+    METRIC_BLOCK_FETCHES,
+    METRIC_READ_BYTES,
+    METRIC_WRITE_BYTES,
+    METRIC_COUNTER_COUNT
+};
+
+// Latency histogram of a single event that is not a FUSE operation, shared
+// by all threads that record it. It uses the same buckets as the operation
+// histograms and is exported once it is added to the metrics.
+class Histogram
+{
+
+public:
+    Histogram();
+
+    void record(uint64_t nanos);
+    uint64_t count();
+    double quantile(double fraction);
+
+private:
+    friend class Metrics;
+    std::unique_ptr<std::atomic<uint64_t>[]> m_buckets;
+    std::atomic<uint64_t> m_count { 0 };
+    std::atomic<uint64_t> m_nanos { 0 };
+};
+
+// Counters and latency histograms in Prometheus text format. Every thread
+// records into its own block of counters, so recording is a plain relaxed
+// store without any lock or shared cache line. The blocks are summed up
+// when the metrics are exported, and the counts of a thread that exits are
+// kept. Latencies go into log-linear buckets with 8 sub-buckets per power
+// of two like an HDR histogram, which bounds the error to 12.5%. Values of
+// other components are added as gauges and read on export. The text is
+// written to a stats file at a fixed interval and served on request.
+class Metrics
+{
+
+public:
+    Metrics(Log* log);
+    ~Metrics();
+
+    void start();
+    void stop();
+
+    void addGauge(const std::string& name, const std::string& help, std::function<double()> value);
+    void addCounter(const std::string& name, const std::string& help, std::function<double()> value);
+    void addHistogram(const std::string& name, const std::string& help, Histogram* histogram);
+    std::string exportText();
+
+    void setPath(const std::string& path);
+    void setInterval(int seconds);
+
+    static void count(MetricCounter counter, uint64_t n = 1);
+    static void recordOp(MetricOp op, uint64_t nanos, bool isError);
+
+    static inline uint64_t now()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    }
+
+private:
+    struct Value
+    {
+        std::string name;
+        std::string help;
+        std::string type;
+        std::function<double()> value;
+    };
+
+    struct HistogramValue
+    {
+        std::string name;
+        std::string help;
+        Histogram* histogram;
+    };
+
+    void run();
+    int writeFile();
+
+private:
+    Log* m_log = nullptr;
+    std::mutex m_mutex;
+    std::condition_variable m_wakeUp;
+    std::thread m_thread;
+    bool m_isRunning = false;
+    std::string m_path;
+    int m_interval = 10;
+    std::vector<Value> m_values;
+    std::vector<HistogramValue> m_histograms;
+};
+
+// Wraps a FUSE operation so that its latency and errors are recorded, e.g.
+// op.read = TimedOp<OP_READ, fc_read>::call.
+template <MetricOp op, auto fn>
+struct TimedOp;
+
+template <MetricOp op, typename R, typename... Args, R (*fn)(Args...)>
+struct TimedOp<op, fn>
+{
+    static R call(Args... args)
+    {
+        uint64_t start = Metrics::now();
+        R res = fn(args...);
+        Metrics::recordOp(op, Metrics::now() - start, res < 0);
+        return res;
+    }
+};
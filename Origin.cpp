@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) 2024 Nils Zweiling
+ *
+ * This file is part of fusecache which is released under the MIT license.
+ * See file LICENSE or go to https://github.com/zwodev/fusecache/tree/master/LICENSE
+ * for full license details.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "Helper.h"
+#include "Origin.h"
+#include "SimulatedOrigin.h"
+
+Origin::Origin(Log* log)
+{
+	m_log = log;
+}
+
+Origin::~Origin()
+{
+	if (m_dirFd >= 0) {
+		close(m_dirFd);
+	}
+}
+
+int Origin::open(const std::string& rootPath)
+{
+	if (m_dirFd >= 0) {
+		close(m_dirFd);
+	}
+
+	m_rootPath = rootPath;
+	m_dirFd = ::open(rootPath.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+	return m_dirFd < 0 ? -1 : 0;
+}
+
+int Origin::dirFd()
+{
+	return m_dirFd;
+}
+
+const std::string& Origin::rootPath()
+{
+	return m_rootPath;
+}
+
+std::string Origin::filePath(const std::string& path)
+{
+	return m_rootPath + path;
+}
+
+int Origin::stat(const char* path, struct stat* st)
+{
+	return fstatat(m_dirFd, relativePath(path), st, AT_SYMLINK_NOFOLLOW);
+}
+
+int Origin::access(const char* path, int mask)
+{
+	return faccessat(m_dirFd, relativePath(path), mask, 0);
+}
+
+int Origin::openFile(const char* path, int flags, mode_t mode)
+{
+	return openat(m_dirFd, relativePath(path), flags | O_CLOEXEC, mode);
+}
+
+DIR* Origin::openDir(const char* path)
+{
+	int fd = openat(m_dirFd, relativePath(path), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		return nullptr;
+	}
+
+	DIR* dp = fdopendir(fd);
+	if (!dp) {
+		int saved_errno = errno;
+		close(fd);
+		errno = saved_errno;
+	}
+	return dp;
+}
+
+int Origin::mkdir(const char* path, mode_t mode)
+{
+	return mkdirat(m_dirFd, relativePath(path), mode);
+}
+
+int Origin::rmdir(const char* path)
+{
+	return unlinkat(m_dirFd, relativePath(path), AT_REMOVEDIR);
+}
+
+int Origin::rename(const char* from, const char* to)
+{
+	return renameat(m_dirFd, relativePath(from), m_dirFd, relativePath(to));
+}
+
+int Origin::unlink(const char* path)
+{
+	return unlinkat(m_dirFd, relativePath(path), 0);
+}
+
+int Origin::chmod(const char* path, mode_t mode)
+{
+	return fchmodat(m_dirFd, relativePath(path), mode, 0);
+}
+
+int Origin::chown(const char* path, uid_t uid, gid_t gid)
+{
+	return fchownat(m_dirFd, relativePath(path), uid, gid, AT_SYMLINK_NOFOLLOW);
+}
+
+int Origin::statfs(struct statvfs* st)
+{
+	return fstatvfs(m_dirFd, st);
+}
+
+// Creates the directory and its missing parents. Directories that already
+// exist cost a single call.
+int Origin::createDirectories(const std::string& path)
+{
+	if (path.empty() || path == "/") {
+		return 0;
+	}
+	if (mkdir(path.c_str(), 0777) == 0 || errno == EEXIST) {
+		return 0;
+	}
+	if (errno != ENOENT || createDirectories(path.substr(0, path.find_last_of('/'))) == -1) {
+		return -1;
+	}
+	return mkdir(path.c_str(), 0777) == 0 || errno == EEXIST ? 0 : -1;
+}
+
+RateLimiter* Origin::downLink()
+{
+	return nullptr;
+}
+
+RateLimiter* Origin::upLink()
+{
+	return nullptr;
+}
+
+std::string Origin::description()
+{
+	return "local";
+}
+
+// Accepts "local" or "sim" with options, e.g. "sim:latency=20,bandwidth=10".
+Origin* Origin::create(const std::string& spec, Log* log)
+{
+	size_t pos = spec.find(':');
+	std::string name = spec.substr(0, pos);
+	if (name == "local" && pos == std::string::npos) {
+		return new Origin(log);
+	}
+	if (name == "sim") {
+		SimulatedOrigin* origin = new SimulatedOrigin(log);
+		if (pos == std::string::npos || origin->parse(spec.substr(pos + 1))) {
+			return origin;
+		}
+		delete origin;
+	}
+	return nullptr;
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2024 Nils Zweiling
+ *
+ * This file is part of fusecache which is released under the MIT license.
+ * See file LICENSE or go to https://github.com/zwodev/fusecache/tree/master/LICENSE
+ * for full license details.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <dirent.h>
+#include <string>
+
+#include "Log.h"
+#include "RateLimiter.h"
+
+// Access to the origin directory. Paths are given below the origin root,
+// like the paths of the mount, and are resolved relative to a directory fd
+// that is opened once. The base class passes every call straight to the
+// local file system. Subclasses change how the origin behaves, e.g. to
+// simulate a slow network share, and can add link limiters that every
+// transfer from or to the origin has to pass.
+class Origin
+{
+
+public:
+    Origin(Log* log);
+    virtual ~Origin();
+
+    int open(const std::string& rootPath);
+    int dirFd();
+    const std::string& rootPath();
+    std::string filePath(const std::string& path);
+
+    virtual int stat(const char* path, struct stat* st);
+    virtual int access(const char* path, int mask);
+    virtual int openFile(const char* path, int flags, mode_t mode = 0);
+    virtual DIR* openDir(const char* path);
+    virtual int mkdir(const char* path, mode_t mode);
+    virtual int rmdir(const char* path);
+    virtual int rename(const char* from, const char* to);
+    virtual int unlink(const char* path);
+    virtual int chmod(const char* path, mode_t mode);
+    virtual int chown(const char* path, uid_t uid, gid_t gid);
+    virtual int statfs(struct statvfs* st);
+    int createDirectories(const std::string& path);
+
+    virtual RateLimiter* downLink();
+    virtual RateLimiter* upLink();
+    virtual std::string description();
+
+    static Origin* create(const std::string& spec, Log* log);
+
+protected:
+    Log* m_log = nullptr;
+
+private:
+    std::string m_rootPath;
+    int m_dirFd = -1;
+};
@@ -0,0 +1,439 @@
+/*
+ * Copyright (c) 2024 Nils Zweiling
+ *
+ * This file is part of fusecache which is released under the MIT license.
+ * See file LICENSE or go to https://github.com/zwodev/fusecache/tree/master/LICENSE
+ * for full license details.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <algorithm>
+#include <sstream>
+
+#include "Helper.h"
+#include "Signature.h"
+#include "Prefetcher.h"
+
+static const size_t MAX_FINISHED_JOBS = 32;
+
+static const char* stateName(PrefetchJob::State state)
+{
+	switch (state) {
+		case PrefetchJob::SCANNING: return "scanning";
+		case PrefetchJob::QUEUED: return "queued";
+		case PrefetchJob::RUNNING: return "running";
+		case PrefetchJob::DONE: return "done";
+		case PrefetchJob::CANCELLED: return "cancelled";
+	}
+	return "unknown";
+}
+
+static bool isFinished(const PrefetchJob& job)
+{
+	return job.state == PrefetchJob::DONE || job.state == PrefetchJob::CANCELLED;
+}
+
+Prefetcher::Prefetcher(Log* log)
+{
+	m_log = log;
+}
+
+Prefetcher::~Prefetcher()
+{
+	stop();
+}
+
+void Prefetcher::start(int numThreads)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_isRunning) {
+		return;
+	}
+
+	m_isRunning = true;
+	for (int i = 0; i < std::max(1, numThreads); ++i) {
+		m_threads.emplace_back(&Prefetcher::run, this);
+	}
+}
+
+void Prefetcher::stop()
+{
+	std::map<int, std::shared_ptr<PrefetchJob>> jobs;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_isRunning = false;
+		jobs.swap(m_jobs);
+		for (auto& it : jobs) {
+			it.second->isCancelled = true;
+		}
+	}
+	m_workAdded.notify_all();
+
+	for (std::thread& thread : m_threads) {
+		thread.join();
+	}
+	m_threads.clear();
+
+	for (auto& it : jobs) {
+		if (it.second->scanner.joinable()) {
+			it.second->scanner.join();
+		}
+	}
+}
+
+int Prefetcher::submit(const std::vector<std::string>& entries, int priority)
+{
+	std::shared_ptr<PrefetchJob> job = std::make_shared<PrefetchJob>();
+	job->priority = priority;
+	job->entries = entries;
+	job->startedAt = std::chrono::steady_clock::now();
+
+	std::vector<std::shared_ptr<PrefetchJob>> removed;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (!m_isRunning) {
+			return -1;
+		}
+
+		removed = removeFinished();
+		job->id = m_nextId++;
+		m_jobs[job->id] = job;
+
+		// scanning a large tree on the origin can take a while, so it runs on its own
+		job->scanner = std::thread(&Prefetcher::scan, this, job);
+	}
+
+	// the scanner of a cancelled job can still be running and needs the lock to finish
+	for (auto& it : removed) {
+		it->scanner.join();
+	}
+
+	m_log->info("PREFETCH job %d submitted with %zu entries, priority %d", job->id, entries.size(), priority);
+	return job->id;
+}
+
+bool Prefetcher::cancel(int id)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto it = m_jobs.find(id);
+	if (it == m_jobs.end()) {
+		return false;
+	}
+
+	PrefetchJob& job = *it->second;
+	job.isCancelled = true;
+	if (!isFinished(job)) {
+		job.state = PrefetchJob::CANCELLED;
+		job.finishedAt = std::chrono::steady_clock::now();
+		m_log->info("PREFETCH job %d cancelled", id);
+	}
+	return true;
+}
+
+std::string Prefetcher::status(int id)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	std::string result;
+	for (auto& it : m_jobs) {
+		if (id <= 0 || it.first == id) {
+			result += describe(*it.second);
+		}
+	}
+	return result;
+}
+
+std::string Prefetcher::describe(const PrefetchJob& job)
+{
+	auto end = isFinished(job) ? job.finishedAt : std::chrono::steady_clock::now();
+	double elapsed = std::chrono::duration<double>(end - job.startedAt).count();
+	double rate = elapsed > 0 ? job.bytesFetched / elapsed : 0.0;
+	long long eta = -1;
+	if (job.state == PrefetchJob::DONE) {
+		eta = 0;
+	}
+	else if ((job.state == PrefetchJob::QUEUED || job.state == PrefetchJob::RUNNING) && elapsed >= 1.0 && rate > 0) {
+		eta = (long long)((job.bytesTotal - job.bytesDone) / rate);
+	}
+
+	return formatStr("job %d %s priority %d files %zu/%zu failed %zu bytes %llu/%llu rate %.2f eta %lld\n",
+		job.id, stateName(job.state), job.priority, job.filesDone + job.filesFailed, job.items.size(), job.filesFailed,
+		(unsigned long long)job.bytesDone, (unsigned long long)job.bytesTotal, rate / (1024.0 * 1024.0), eta);
+}
+
+// Takes the oldest finished jobs out of the list. Their scanners have to be
+// joined by the caller without holding the lock.
+std::vector<std::shared_ptr<PrefetchJob>> Prefetcher::removeFinished()
+{
+	std::vector<std::shared_ptr<PrefetchJob>> removed;
+	size_t finished = 0;
+	for (auto& it : m_jobs) {
+		if (isFinished(*it.second)) {
+			finished++;
+		}
+	}
+
+	// the oldest finished jobs go first
+	for (auto it = m_jobs.begin(); it != m_jobs.end() && finished > MAX_FINISHED_JOBS; ) {
+		if (isFinished(*it->second) && it->second->active == 0 && it->second->scanner.joinable()) {
+			removed.push_back(it->second);
+			it = m_jobs.erase(it);
+			finished--;
+		}
+		else {
+			++it;
+		}
+	}
+	return removed;
+}
+
+std::string Prefetcher::toFilePath(const std::string& entry)
+{
+	// entries may be given as paths in the mount, on the origin, or relative to the mount
+	std::string path = entry;
+	for (const std::string& prefix : { m_mountPoint, m_origin->rootPath() }) {
+		if (!prefix.empty() && path.compare(0, prefix.size(), prefix) == 0
+			&& (path.size() == prefix.size() || path[prefix.size()] == '/')) {
+			path = path.substr(prefix.size());
+			break;
+		}
+	}
+
+	if (path.empty() || path[0] != '/') {
+		path = "/" + path;
+	}
+	while (path.size() > 1 && path.back() == '/') {
+		path.pop_back();
+	}
+	return path;
+}
+
+// Jobs are scanned through the origin, so that they see the same latency and
+// errors as every other call to it.
+void Prefetcher::addPath(PrefetchJob& job, const std::string& path)
+{
+	struct stat sb;
+	if (m_origin->stat(path.c_str(), &sb) == -1) {
+		m_log->warning("PREFETCH job %d - not found: %s", job.id, path.c_str());
+		return;
+	}
+
+	if (S_ISREG(sb.st_mode)) {
+		job.items.push_back(PrefetchItem { path, (uint64_t)sb.st_size });
+		return;
+	}
+	if (S_ISDIR(sb.st_mode)) {
+		addDir(job, path);
+	}
+}
+
+void Prefetcher::addDir(PrefetchJob& job, const std::string& path)
+{
+	DIR* dp = m_origin->openDir(path.c_str());
+	if (!dp) {
+		return;
+	}
+
+	std::vector<std::string> dirs;
+	struct dirent* de;
+	while ((de = readdir(dp)) != nullptr && !job.isCancelled) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+			continue;
+		}
+
+		std::string filePath = (path == "/" ? "" : path) + "/" + de->d_name;
+		struct stat sb;
+		if (Signature::isSigPath(filePath) || m_origin->stat(filePath.c_str(), &sb) == -1) {
+			continue;
+		}
+		if (S_ISREG(sb.st_mode)) {
+			job.items.push_back(PrefetchItem { filePath, (uint64_t)sb.st_size });
+		}
+		else if (S_ISDIR(sb.st_mode)) {
+			dirs.push_back(filePath);
+		}
+	}
+	closedir(dp);
+
+	for (const std::string& dir : dirs) {
+		addDir(job, dir);
+	}
+}
+
+// Expands a glob one path component at a time, listing only the
+// directories that components with wildcards have to be matched in.
+void Prefetcher::addMatches(PrefetchJob& job, const std::string& pattern)
+{
+	std::vector<std::string> paths { "" };
+	std::stringstream stream(pattern);
+	std::string component;
+	while (std::getline(stream, component, '/') && !paths.empty()) {
+		if (component.empty()) {
+			continue;
+		}
+
+		std::vector<std::string> matches;
+		for (const std::string& path : paths) {
+			if (component.find_first_of("*?[") == std::string::npos) {
+				matches.push_back(path + "/" + component);
+				continue;
+			}
+
+			DIR* dp = m_origin->openDir(path.empty() ? "/" : path.c_str());
+			if (!dp) {
+				continue;
+			}
+			struct dirent* de;
+			while ((de = readdir(dp)) != nullptr) {
+				if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0
+					&& fnmatch(component.c_str(), de->d_name, FNM_PERIOD) == 0) {
+					matches.push_back(path + "/" + de->d_name);
+				}
+			}
+			closedir(dp);
+		}
+		paths.swap(matches);
+	}
+
+	// literal components that do not exist are not an error for a glob
+	for (const std::string& path : paths) {
+		struct stat sb;
+		if (!path.empty() && m_origin->stat(path.c_str(), &sb) == 0) {
+			addPath(job, path);
+		}
+	}
+}
+
+void Prefetcher::scan(std::shared_ptr<PrefetchJob> job)
+{
+	PrefetchJob scanned;
+	scanned.id = job->id;
+	for (const std::string& entry : job->entries) {
+		if (job->isCancelled) {
+			break;
+		}
+		if (entry.empty()) {
+			continue;
+		}
+
+		std::string path = toFilePath(entry);
+
+		// frame padding of render job file lists, e.g. shot.####.exr
+		if (path.find('#') != std::string::npos && m_origin->access(path.c_str(), F_OK) == -1) {
+			std::string pattern;
+			for (char c : path) {
+				pattern += (c == '#') ? std::string("[0-9]") : std::string(1, c);
+			}
+			path = pattern;
+		}
+
+		if (path.find_first_of("*?[") == std::string::npos) {
+			addPath(scanned, path);
+			continue;
+		}
+
+		addMatches(scanned, path);
+	}
+
+	// small files first, so that many files are usable early, and duplicates next to each other
+	std::sort(scanned.items.begin(), scanned.items.end(), [](const PrefetchItem& a, const PrefetchItem& b) {
+		return a.size < b.size || (a.size == b.size && a.path < b.path);
+	});
+	auto last = std::unique(scanned.items.begin(), scanned.items.end(), [](const PrefetchItem& a, const PrefetchItem& b) {
+		return a.path == b.path;
+	});
+	scanned.items.erase(last, scanned.items.end());
+
+	uint64_t bytesTotal = 0;
+	for (const PrefetchItem& item : scanned.items) {
+		bytesTotal += item.size;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		job->items.swap(scanned.items);
+		job->bytesTotal = bytesTotal;
+		if (job->state == PrefetchJob::SCANNING) {
+			job->state = job->items.empty() ? PrefetchJob::DONE : PrefetchJob::QUEUED;
+			job->finishedAt = std::chrono::steady_clock::now();
+		}
+		m_log->info("PREFETCH job %d scanned %zu files, %llu bytes", job->id, job->items.size(), (unsigned long long)bytesTotal);
+	}
+	m_workAdded.notify_all();
+}
+
+std::shared_ptr<PrefetchJob> Prefetcher::nextJob()
+{
+	std::shared_ptr<PrefetchJob> best;
+	for (auto& it : m_jobs) {
+		PrefetchJob& job = *it.second;
+		if (job.isCancelled || (job.state != PrefetchJob::QUEUED && job.state != PrefetchJob::RUNNING)
+			|| job.next >= job.items.size()) {
+			continue;
+		}
+		if (!best || job.priority > best->priority) {
+			best = it.second;
+		}
+	}
+	return best;
+}
+
+void Prefetcher::run()
+{
+	while (true) {
+		std::shared_ptr<PrefetchJob> job;
+		PrefetchItem item;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_workAdded.wait(lock, [this, &job] { return !m_isRunning || (job = nextJob()) != nullptr; });
+			if (!m_isRunning) {
+				return;
+			}
+			item = job->items[job->next++];
+			job->active++;
+			job->state = PrefetchJob::RUNNING;
+		}
+
+		int res = m_fetch ? m_fetch(item.path) : -1;
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		job->active--;
+		if (res == -1) {
+			job->filesFailed++;
+			m_log->warning("PREFETCH job %d - failed: %s", job->id, item.path.c_str());
+		}
+		else {
+			job->filesDone++;
+			job->bytesDone += item.size;
+			if (res == 1) {
+				job->bytesFetched += item.size;
+			}
+		}
+
+		if (job->state == PrefetchJob::RUNNING && job->next >= job->items.size() && job->active == 0) {
+			job->state = PrefetchJob::DONE;
+			job->finishedAt = std::chrono::steady_clock::now();
+			m_log->info("PREFETCH job %d done, %zu files, %zu failed", job->id, job->filesDone, job->filesFailed);
+		}
+	}
+}
+
+void Prefetcher::setOrigin(Origin* origin)
+{
+	m_origin = origin;
+}
+
+void Prefetcher::setMountPoint(const std::string& mountPoint)
+{
+	m_mountPoint = mountPoint;
+}
+
+void Prefetcher::setFetch(std::function<int(const std::string&)> fetch)
+{
+	m_fetch = fetch;
+}
@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2024 Nils Zweiling
+ *
+ * This file is part of fusecache which is released under the MIT license.
+ * See file LICENSE or go to https://github.com/zwodev/fusecache/tree/master/LICENSE
+ * for full license details.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <map>
+
+#include "Log.h"
+#include "Origin.h"
+
+struct PrefetchItem
+{
+    std::string path;
+    uint64_t size = 0;
+};
+
+struct PrefetchJob
+{
+    enum State { SCANNING, QUEUED, RUNNING, DONE, CANCELLED };
+
+    int id = 0;
+    int priority = 0;
+    State state = SCANNING;
+    std::vector<std::string> entries;
+    std::vector<PrefetchItem> items;
+    size_t next = 0;
+    int active = 0;
+    std::atomic<bool> isCancelled { false };
+    size_t filesDone = 0;
+    size_t filesFailed = 0;
+    uint64_t bytesTotal = 0;
+    uint64_t bytesDone = 0;
+    uint64_t bytesFetched = 0;
+    std::chrono::steady_clock::time_point startedAt;
+    std::chrono::steady_clock::time_point finishedAt;
+    std::thread scanner;
+};
+
+// Warms the read cache from a manifest of paths, directories and globs.
+// Jobs are scanned on the origin first, then their files are handed to the
+// worker threads ordered by job priority and, within a job, smallest files
+// first. Fills go through the normal cache path and therefore share the
+// download slots and the bandwidth budget with demand fills.
+class Prefetcher
+{
+
+public:
+    Prefetcher(Log* log);
+    ~Prefetcher();
+
+    void start(int numThreads);
+    void stop();
+
+    int submit(const std::vector<std::string>& entries, int priority);
+    bool cancel(int id);
+    std::string status(int id);
+
+    void setOrigin(Origin* origin);
+    void setMountPoint(const std::string& mountPoint);
+    void setFetch(std::function<int(const std::string&)> fetch);
+
+private:
+    void run();
+    void scan(std::shared_ptr<PrefetchJob> job);
+    void addPath(PrefetchJob& job, const std::string& path);
+    void addDir(PrefetchJob& job, const std::string& path);
+    void addMatches(PrefetchJob& job, const std::string& pattern);
+    std::string toFilePath(const std::string& entry);
+    std::shared_ptr<PrefetchJob> nextJob();
+    std::string describe(const PrefetchJob& job);
+    std::vector<std::shared_ptr<PrefetchJob>> removeFinished();
+
+private:
+    Log* m_log = nullptr;
+    std::mutex m_mutex;
+    std::condition_variable m_workAdded;
+    std::vector<std::thread> m_threads;
+    std::map<int, std::shared_ptr<PrefetchJob>> m_jobs;
+    int m_nextId = 1;
+    bool m_isRunning = false;
+    Origin* m_origin = nullptr;
+    std::string m_mountPoint;
+    std::function<int(const std::string&)> m_fetch;
+};
@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2024 Nils Zweiling
+ *
+ * This file is part of fusecache which is released under the MIT license.
+ * See file LICENSE or go to https://github.com/zwodev/fusecache/tree/master/LICENSE
+ * for full license details.
+ */
+
+#include <algorithm>
+
+#include "RateLimiter.h"
+
+RateLimiter::RateLimiter()
+{
+	m_lastRefill = std::chrono::steady_clock::now();
+	m_tokens = m_burst;
+}
+
+RateLimiter::~RateLimiter()
+{
+}
+
+void RateLimiter::refill(std::chrono::steady_clock::time_point now)
+{
+	double elapsed = std::chrono::duration<double>(now - m_lastRefill).count();
+	m_lastRefill = now;
+	m_tokens = std::min(m_burst, m_tokens + elapsed * m_rate);
+}
+
+void RateLimiter::acquire(size_t bytes)
+{
+	if (m_onAcquire) {
+		m_onAcquire();
+	}
+
+	take(bytes);
+	if (m_next) {
+		m_next->acquire(bytes);
+	}
+}
+
+void RateLimiter::take(size_t bytes)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_totalBytes += bytes;
+	while (m_rate > 0) {
+		refill(std::chrono::steady_clock::now());
+		if (m_tokens >= 0) {
+			m_tokens -= bytes;
+			return;
+		}
+
+		// wait until the debt is paid off, or until the rate changes
+		double seconds = -m_tokens / m_rate;
+		m_rateChanged.wait_for(lock, std::chrono::duration<double>(seconds));
+	}
+}
+
+void RateLimiter::setRate(double bytesPerSecond)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		refill(std::chrono::steady_clock::now());
+		m_rate = std::max(0.0, bytesPerSecond);
+		if (m_rate == 0) {
+			m_tokens = m_burst;
+		}
+	}
+	m_rateChanged.notify_all();
+}
+
+void RateLimiter::setBurst(double bytes)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	refill(std::chrono::steady_clock::now());
+	m_burst = std::max(1.0, bytes);
+	m_tokens = std::min(m_tokens, m_burst);
+}
+
+void RateLimiter::setOnAcquire(std::function<void()> onAcquire)
+{
+	m_onAcquire = onAcquire;
+}
+
+void RateLimiter::setNext(RateLimiter* next)
+{
+	m_next = next;
+}
+
+double RateLimiter::rate()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_rate;
+}
+
+uint64_t RateLimiter::totalBytes()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_totalBytes;
+}
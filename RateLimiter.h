@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2024 Nils Zweiling
+ *
+ * This file is part of fusecache which is released under the MIT license.
+ * See file LICENSE or go to https://github.com/zwodev/fusecache/tree/master/LICENSE
+ * for full license details.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+
+// Token bucket shared by all transfers in one direction. Tokens are bytes
+// and refill at the configured rate on the monotonic clock, up to the burst
+// size. A transfer may take more tokens than are left and leaves the bucket
+// in debt, which later transfers wait out. The rate can be changed while
+// transfers are running. A rate of 0 disables the limit. The acquire hook
+// runs before every acquire and lets a transfer pause between chunks. A
+// chained limiter is acquired after this one, e.g. for the link itself.
+class RateLimiter
+{
+
+public:
+    RateLimiter();
+    ~RateLimiter();
+
+    void acquire(size_t bytes);
+
+    void setRate(double bytesPerSecond);
+    void setBurst(double bytes);
+    void setOnAcquire(std::function<void()> onAcquire);
+    void setNext(RateLimiter* next);
+    double rate();
+    uint64_t totalBytes();
+
+private:
+    void take(size_t bytes);
+    void refill(std::chrono::steady_clock::time_point now);
+
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_rateChanged;
+    double m_rate = 0.0;
+    double m_burst = 1024.0 * 1024.0;
+    double m_tokens = 0.0;
+    uint64_t m_totalBytes = 0;
+    std::chrono::steady_clock::time_point m_lastRefill;
+    std::function<void()> m_onAcquire;
+    RateLimiter* m_next = nullptr;
+};
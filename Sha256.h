@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2024 Nils Zweiling
+ *
+ * This file is part of fusecache which is released under the MIT license.
+ * See file LICENSE or go to https://github.com/zwodev/fusecache/tree/master/LICENSE
+ * for full license details.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+// SHA-256 as specified in FIPS 180-4, so that no crypto library is needed.
+class Sha256
+{
+
+public:
+    static const size_t DIGEST_SIZE = 32;
+
+    Sha256();
+
+    void update(const void* data, size_t length);
+    void finish(uint8_t digest[DIGEST_SIZE]);
+
+    static std::string toHex(const uint8_t* digest, size_t length);
+
+private:
+    void transform(const uint8_t* block);
+
+private:
+    uint32_t m_state[8];
+    uint8_t m_buffer[64];
+    size_t m_bufferSize = 0;
+    uint64_t m_length = 0;
+};
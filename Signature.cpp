@@ -0,0 +1,250 @@
+/*
+ * Copyright (c) 2024 Nils Zweiling
+ *
+ * This file is part of fusecache which is released under the MIT license.
+ * See file LICENSE or go to https://github.com/zwodev/fusecache/tree/master/LICENSE
+ * for full license details.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <filesystem>
+
+#include "Signature.h"
+
+static const char MAGIC[8] = { 'F', 'C', 'S', 'I', 'G', '1', 0, 0 };
+static const std::string SIG_DIR = "/.fusecache/sig";
+
+static bool readFull(int fd, void* buf, size_t length, off_t offset)
+{
+	size_t done = 0;
+	while (done < length) {
+		ssize_t nread = pread(fd, (char*)buf + done, length - done, offset + done);
+		if (nread < 0 && errno == EINTR) {
+			continue;
+		}
+		if (nread <= 0) {
+			return false;
+		}
+		done += nread;
+	}
+	return true;
+}
+
+static bool writeFull(int fd, const void* buf, size_t length)
+{
+	size_t done = 0;
+	while (done < length) {
+		ssize_t nwritten = write(fd, (const char*)buf + done, length - done);
+		if (nwritten < 0 && errno == EINTR) {
+			continue;
+		}
+		if (nwritten < 0) {
+			return false;
+		}
+		done += nwritten;
+	}
+	return true;
+}
+
+Signature::Signature()
+{
+}
+
+Signature::~Signature()
+{
+}
+
+// The weak checksum is the one of rsync: two 16 bit sums that can be
+// rolled forward one byte at a time.
+uint32_t Signature::weakSum(const uint8_t* data, size_t length)
+{
+	uint32_t a = 0;
+	uint32_t b = 0;
+	for (size_t i = 0; i < length; ++i) {
+		a += data[i];
+		b += (uint32_t)(length - i) * data[i];
+	}
+	return (a & 0xffff) | ((b & 0xffff) << 16);
+}
+
+void Signature::strongSum(const uint8_t* data, size_t length, uint8_t strong[STRONG_SIZE])
+{
+	uint8_t digest[Sha256::DIGEST_SIZE];
+	Sha256 sha;
+	sha.update(data, length);
+	sha.finish(digest);
+	memcpy(strong, digest, STRONG_SIZE);
+}
+
+int Signature::compute(int fd, size_t blockSize)
+{
+	struct stat sb;
+	if (fstat(fd, &sb) == -1) {
+		return -1;
+	}
+
+	m_size = sb.st_size;
+	m_mtime = sb.st_mtim.tv_sec;
+	m_blockSize = blockSize;
+	m_blocks.clear();
+	m_blocks.reserve((m_size + blockSize - 1) / blockSize);
+
+	Sha256 fileSha;
+	std::vector<uint8_t> buf(blockSize * 16);
+	uint64_t offset = 0;
+	while (offset < m_size) {
+		size_t length = std::min((uint64_t)buf.size(), m_size - offset);
+		if (!readFull(fd, buf.data(), length, offset)) {
+			if (errno == 0) {
+				errno = EIO;
+			}
+			return -1;
+		}
+
+		fileSha.update(buf.data(), length);
+		for (size_t pos = 0; pos < length; pos += blockSize) {
+			size_t n = std::min(blockSize, length - pos);
+			Block block;
+			block.weak = weakSum(buf.data() + pos, n);
+			strongSum(buf.data() + pos, n, block.strong);
+			m_blocks.push_back(block);
+		}
+		offset += length;
+	}
+
+	fileSha.finish(m_fileHash);
+	return 0;
+}
+
+int Signature::load(const std::string& sigPath)
+{
+	int fd = open(sigPath.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+
+	int res = load(fd);
+	close(fd);
+	return res;
+}
+
+int Signature::load(int fd)
+{
+	Header header;
+	struct stat sb;
+	bool isValid = fstat(fd, &sb) == 0 && readFull(fd, &header, sizeof(header), 0)
+		&& memcmp(header.magic, MAGIC, sizeof(MAGIC)) == 0 && header.blockSize > 0;
+
+	size_t count = 0;
+	if (isValid) {
+		count = (header.size + header.blockSize - 1) / header.blockSize;
+		isValid = (uint64_t)sb.st_size == sizeof(header) + count * sizeof(Block);
+	}
+	if (isValid) {
+		m_blocks.resize(count);
+		isValid = count == 0 || readFull(fd, m_blocks.data(), count * sizeof(Block), sizeof(header));
+	}
+
+	if (!isValid) {
+		m_blocks.clear();
+		errno = EINVAL;
+		return -1;
+	}
+
+	m_size = header.size;
+	m_mtime = header.mtime;
+	m_blockSize = header.blockSize;
+	memcpy(m_fileHash, header.fileHash, sizeof(m_fileHash));
+	return 0;
+}
+
+int Signature::save(const std::string& sigPath) const
+{
+	std::error_code ec;
+	std::filesystem::create_directories(std::filesystem::path(sigPath).parent_path(), ec);
+
+	// written to a temporary name so that readers never see a partial signature
+	std::string tmp = sigPath + ".XXXXXX";
+	int fd = mkstemp(&tmp[0]);
+	if (fd < 0) {
+		return -1;
+	}
+	fchmod(fd, 0644);
+
+	bool isWritten = writeTo(fd) == 0;
+	int saved_errno = errno;
+	if (close(fd) == -1 && isWritten) {
+		saved_errno = errno;
+		isWritten = false;
+	}
+	if (isWritten) {
+		if (rename(tmp.c_str(), sigPath.c_str()) == 0) {
+			return 0;
+		}
+		saved_errno = errno;
+	}
+
+	unlink(tmp.c_str());
+	errno = saved_errno;
+	return -1;
+}
+
+int Signature::writeTo(int fd) const
+{
+	Header header;
+	memcpy(header.magic, MAGIC, sizeof(MAGIC));
+	header.size = m_size;
+	header.mtime = m_mtime;
+	header.blockSize = m_blockSize;
+	memcpy(header.fileHash, m_fileHash, sizeof(m_fileHash));
+
+	bool isWritten = writeFull(fd, &header, sizeof(header))
+		&& writeFull(fd, m_blocks.data(), m_blocks.size() * sizeof(Block));
+	return isWritten ? 0 : -1;
+}
+
+bool Signature::matches(const struct stat& sb) const
+{
+	return (uint64_t)sb.st_size == m_size && sb.st_mtim.tv_sec == m_mtime;
+}
+
+uint64_t Signature::size() const
+{
+	return m_size;
+}
+
+size_t Signature::blockSize() const
+{
+	return m_blockSize;
+}
+
+const std::vector<Signature::Block>& Signature::blocks() const
+{
+	return m_blocks;
+}
+
+const uint8_t* Signature::fileHash() const
+{
+	return m_fileHash;
+}
+
+std::string Signature::sigDir(const std::string& originDir)
+{
+	return originDir + SIG_DIR;
+}
+
+std::string Signature::sigPath(const std::string& originDir, const std::string& filePath)
+{
+	return originDir + SIG_DIR + filePath + ".sig";
+}
+
+bool Signature::isSigPath(const std::string& filePath)
+{
+	return filePath.compare(0, 11, "/.fusecache") == 0 && (filePath.size() == 11 || filePath[11] == '/');
+}
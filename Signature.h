@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2024 Nils Zweiling
+ *
+ * This file is part of fusecache which is released under the MIT license.
+ * See file LICENSE or go to https://github.com/zwodev/fusecache/tree/master/LICENSE
+ * for full license details.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "Sha256.h"
+
+// Block checksums of an origin file, stored on the origin under
+// ".fusecache/sig/<path>.sig". Every block has a weak rolling checksum and
+// the first bytes of its SHA-256, and the whole file has a full SHA-256.
+// A signature belongs to the version of the file with the recorded size
+// and modification time.
+class Signature
+{
+
+public:
+    static const size_t DEFAULT_BLOCK_SIZE = 64 * 1024;
+    static const size_t STRONG_SIZE = 16;
+
+    struct Block
+    {
+        uint32_t weak;
+        uint8_t strong[STRONG_SIZE];
+    };
+
+    Signature();
+    ~Signature();
+
+    int compute(int fd, size_t blockSize);
+    int load(const std::string& sigPath);
+    int load(int fd);
+    int save(const std::string& sigPath) const;
+    int writeTo(int fd) const;
+    bool matches(const struct stat& sb) const;
+
+    uint64_t size() const;
+    size_t blockSize() const;
+    const std::vector<Block>& blocks() const;
+    const uint8_t* fileHash() const;
+
+    static uint32_t weakSum(const uint8_t* data, size_t length);
+    static void strongSum(const uint8_t* data, size_t length, uint8_t strong[STRONG_SIZE]);
+    static std::string sigDir(const std::string& originDir);
+    static std::string sigPath(const std::string& originDir, const std::string& filePath);
+    static bool isSigPath(const std::string& filePath);
+
+private:
+    struct Header
+    {
+        char magic[8];
+        uint64_t size;
+        int64_t mtime;
+        uint64_t blockSize;
+        uint8_t fileHash[Sha256::DIGEST_SIZE];
+    };
+
+    uint64_t m_size = 0;
+    int64_t m_mtime = 0;
+    size_t m_blockSize = DEFAULT_BLOCK_SIZE;
+    uint8_t m_fileHash[Sha256::DIGEST_SIZE] = {};
+    std::vector<Block> m_blocks;
+};
@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) 2024 Nils Zweiling
+ *
+ * This file is part of fusecache which is released under the MIT license.
+ * See file LICENSE or go to https://github.com/zwodev/fusecache/tree/master/LICENSE
+ * for full license details.
+ */
+
+#include <errno.h>
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+#include <thread>
+
+#include "Helper.h"
+#include "SimulatedOrigin.h"
+
+static const char* OP_NAMES[] = { "stat", "access", "open", "readdir" };
+
+SimulatedOrigin::SimulatedOrigin(Log* log)
+	: Origin(log)
+	, m_random(std::random_device()())
+{
+}
+
+// Comma separated options, times in milliseconds and bandwidth in MB/sec:
+// latency (every call), stat, access, open, readdir (single calls), jitter,
+// bandwidth and errors (fraction of failing calls), e.g.
+// "latency=20,open=40,jitter=5,bandwidth=10,errors=0.001".
+bool SimulatedOrigin::parse(const std::string& options)
+{
+	std::stringstream stream(options);
+	std::string option;
+	double opLatency[OP_COUNT];
+	std::fill(opLatency, opLatency + OP_COUNT, -1.0);
+
+	while (std::getline(stream, option, ',')) {
+		size_t pos = option.find('=');
+		if (pos == std::string::npos) {
+			return false;
+		}
+
+		std::string name = option.substr(0, pos);
+		double value;
+		try {
+			value = std::stod(option.substr(pos + 1));
+		}
+		catch (...) {
+			return false;
+		}
+		if (value < 0) {
+			return false;
+		}
+
+		bool isOp = false;
+		for (int op = 0; op < OP_OTHER; ++op) {
+			if (name == OP_NAMES[op]) {
+				opLatency[op] = value;
+				isOp = true;
+			}
+		}
+		if (isOp) {
+			continue;
+		}
+
+		if (name == "latency") {
+			opLatency[OP_OTHER] = value;
+		}
+		else if (name == "jitter") {
+			m_jitter = value;
+		}
+		else if (name == "bandwidth") {
+			m_bandwidth = value;
+		}
+		else if (name == "errors" && value <= 1.0) {
+			m_errorRate = value;
+		}
+		else {
+			return false;
+		}
+	}
+
+	// calls without their own latency take the general one
+	double latency = std::max(0.0, opLatency[OP_OTHER]);
+	for (int op = 0; op < OP_COUNT; ++op) {
+		m_latency[op] = opLatency[op] >= 0 ? opLatency[op] : latency;
+	}
+	m_downLink.setRate(m_bandwidth * 1024.0 * 1024.0);
+	m_upLink.setRate(m_bandwidth * 1024.0 * 1024.0);
+	return true;
+}
+
+int SimulatedOrigin::simulate(Op op)
+{
+	double delay;
+	bool isError;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		std::uniform_real_distribution<double> jitter(-m_jitter, m_jitter);
+		std::uniform_real_distribution<double> chance(0.0, 1.0);
+		delay = std::max(0.0, m_latency[op] + (m_jitter > 0 ? jitter(m_random) : 0.0));
+		isError = m_errorRate > 0 && chance(m_random) < m_errorRate;
+	}
+
+	if (delay > 0) {
+		std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(delay));
+	}
+	if (isError) {
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
+int SimulatedOrigin::stat(const char* path, struct stat* st)
+{
+	return simulate(OP_STAT) == -1 ? -1 : Origin::stat(path, st);
+}
+
+int SimulatedOrigin::access(const char* path, int mask)
+{
+	return simulate(OP_ACCESS) == -1 ? -1 : Origin::access(path, mask);
+}
+
+int SimulatedOrigin::openFile(const char* path, int flags, mode_t mode)
+{
+	return simulate(OP_OPEN) == -1 ? -1 : Origin::openFile(path, flags, mode);
+}
+
+DIR* SimulatedOrigin::openDir(const char* path)
+{
+	return simulate(OP_READDIR) == -1 ? nullptr : Origin::openDir(path);
+}
+
+int SimulatedOrigin::mkdir(const char* path, mode_t mode)
+{
+	return simulate(OP_OTHER) == -1 ? -1 : Origin::mkdir(path, mode);
+}
+
+int SimulatedOrigin::rmdir(const char* path)
+{
+	return simulate(OP_OTHER) == -1 ? -1 : Origin::rmdir(path);
+}
+
+int SimulatedOrigin::rename(const char* from, const char* to)
+{
+	return simulate(OP_OTHER) == -1 ? -1 : Origin::rename(from, to);
+}
+
+int SimulatedOrigin::unlink(const char* path)
+{
+	return simulate(OP_OTHER) == -1 ? -1 : Origin::unlink(path);
+}
+
+int SimulatedOrigin::chmod(const char* path, mode_t mode)
+{
+	return simulate(OP_OTHER) == -1 ? -1 : Origin::chmod(path, mode);
+}
+
+int SimulatedOrigin::chown(const char* path, uid_t uid, gid_t gid)
+{
+	return simulate(OP_OTHER) == -1 ? -1 : Origin::chown(path, uid, gid);
+}
+
+int SimulatedOrigin::statfs(struct statvfs* st)
+{
+	return simulate(OP_OTHER) == -1 ? -1 : Origin::statfs(st);
+}
+
+RateLimiter* SimulatedOrigin::downLink()
+{
+	return m_bandwidth > 0 ? &m_downLink : nullptr;
+}
+
+RateLimiter* SimulatedOrigin::upLink()
+{
+	return m_bandwidth > 0 ? &m_upLink : nullptr;
+}
+
+std::string SimulatedOrigin::description()
+{
+	return formatStr("simulated, latency: %g ms (stat %g, access %g, open %g, readdir %g) jitter: %g ms bandwidth: %g MB/s errors: %g",
+		m_latency[OP_OTHER], m_latency[OP_STAT], m_latency[OP_ACCESS], m_latency[OP_OPEN], m_latency[OP_READDIR],
+		m_jitter, m_bandwidth, m_errorRate);
+}
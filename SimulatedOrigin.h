@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2024 Nils Zweiling
+ *
+ * This file is part of fusecache which is released under the MIT license.
+ * See file LICENSE or go to https://github.com/zwodev/fusecache/tree/master/LICENSE
+ * for full license details.
+ */
+
+#pragma once
+
+#include <mutex>
+#include <random>
+#include <string>
+
+#include "Origin.h"
+
+// Local origin that behaves like a share behind a slow network link. Every
+// call waits for a latency with random jitter and fails with EIO at the
+// configured rate. Transfers in each direction share a link limited to the
+// configured bandwidth, on top of the limits set for fusecache itself.
+// Meant for benchmarks and for testing fills and uploads on a single box.
+class SimulatedOrigin : public Origin
+{
+
+public:
+    SimulatedOrigin(Log* log);
+
+    bool parse(const std::string& options);
+
+    int stat(const char* path, struct stat* st) override;
+    int access(const char* path, int mask) override;
+    int openFile(const char* path, int flags, mode_t mode = 0) override;
+    DIR* openDir(const char* path) override;
+    int mkdir(const char* path, mode_t mode) override;
+    int rmdir(const char* path) override;
+    int rename(const char* from, const char* to) override;
+    int unlink(const char* path) override;
+    int chmod(const char* path, mode_t mode) override;
+    int chown(const char* path, uid_t uid, gid_t gid) override;
+    int statfs(struct statvfs* st) override;
+
+    RateLimiter* downLink() override;
+    RateLimiter* upLink() override;
+    std::string description() override;
+
+private:
+    enum Op { OP_STAT, OP_ACCESS, OP_OPEN, OP_READDIR, OP_OTHER, OP_COUNT };
+
+    int simulate(Op op);
+
+private:
+    double m_latency[OP_COUNT] = {};
+    double m_jitter = 0.0;
+    double m_errorRate = 0.0;
+    double m_bandwidth = 0.0;
+    RateLimiter m_downLink;
+    RateLimiter m_upLink;
+    std::mutex m_mutex;
+    std::mt19937 m_random;
+};
@@ -0,0 +1,489 @@
+/*
+ * Copyright (c) 2024 Nils Zweiling
+ *
+ * This file is part of fusecache which is released under the MIT license.
+ * See file LICENSE or go to https://github.com/zwodev/fusecache/tree/master/LICENSE
+ * for full license details.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <utime.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <filesystem>
+
+#include "Helper.h"
+#include "FileCopy.h"
+#include "Metrics.h"
+#include "SparseFile.h"
+
+static const char BLOCK_MAP_MAGIC[8] = { 'F', 'C', 'B', 'L', 'O', 'C', 'K', '2' };
+
+SparseFile::SparseFile(Log* log, size_t blockSize, RateLimiter* limiter, Codec codec, int level)
+{
+	m_log = log;
+	m_blockSize = blockSize;
+	m_limiter = limiter;
+	m_codec = codec;
+	m_level = level;
+}
+
+SparseFile::~SparseFile()
+{
+	flushBlockMap();
+	closeFiles();
+}
+
+// Keeps errno, so that error paths can close the files and still report
+// what went wrong.
+void SparseFile::closeFiles()
+{
+	int saved_errno = errno;
+	for (int* fd : { &m_origFd, &m_dataFd, &m_mapFd }) {
+		if (*fd >= 0) {
+			close(*fd);
+			*fd = -1;
+		}
+	}
+	errno = saved_errno;
+}
+
+std::string SparseFile::dataFilePath(const std::string& cachePath)
+{
+	return cachePath + SPARSE_SUFFIX;
+}
+
+std::string SparseFile::blockMapPath(const std::string& cachePath)
+{
+	return cachePath + BLOCKS_SUFFIX;
+}
+
+int SparseFile::open(Origin* origin, const std::string& filePath, const std::string& cachePath)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_isOpen) {
+		return 0;
+	}
+
+	m_origPath = origin->filePath(filePath);
+	m_cachePath = cachePath;
+	m_dataPath = dataFilePath(cachePath);
+	m_mapPath = blockMapPath(cachePath);
+
+	m_origFd = origin->openFile(filePath.c_str(), O_RDONLY);
+	if (m_origFd < 0) {
+		return -1;
+	}
+
+	struct stat sb;
+	if (fstat(m_origFd, &sb) == -1) {
+		closeFiles();
+		return -1;
+	}
+	m_size = sb.st_size;
+	m_mtime = sb.st_mtim.tv_sec;
+	m_blockCount = (m_size + m_blockSize - 1) / m_blockSize;
+
+	std::string dir = std::filesystem::path(m_dataPath).parent_path().u8string();
+	try {
+		std::filesystem::create_directories(dir);
+	}
+	catch (const std::exception& ex)
+	{
+		m_log->error("Error creating dirs: %s\nException: %s", dir.c_str(), ex.what());
+	}
+
+	// resume a previous partial fill if the origin file did not change
+	if (loadBlockMap() == -1 && createBlockMap() == -1) {
+		m_log->error("SPARSE ERROR - cannot create block map: %s", m_mapPath.c_str());
+		closeFiles();
+		return -1;
+	}
+
+	m_isOpen = true;
+	return 0;
+}
+
+int SparseFile::loadBlockMap()
+{
+	int mapFd = ::open(m_mapPath.c_str(), O_RDWR);
+	if (mapFd < 0) {
+		return -1;
+	}
+
+	Header header;
+	std::vector<uint8_t> blockMap((m_blockCount + 7) / 8, 0);
+	std::vector<uint32_t> lengths(isCompressed() ? m_blockCount : 0, 0);
+	ssize_t lengthsSize = lengths.size() * sizeof(uint32_t);
+	bool isValid = pread(mapFd, &header, sizeof(header), 0) == sizeof(header)
+		&& memcmp(header.magic, BLOCK_MAP_MAGIC, sizeof(header.magic)) == 0
+		&& header.size == (uint64_t)m_size
+		&& header.mtime == (int64_t)m_mtime
+		&& header.blockSize == m_blockSize
+		&& header.codec == (uint32_t)m_codec
+		&& pread(mapFd, blockMap.data(), blockMap.size(), sizeof(header)) == (ssize_t)blockMap.size()
+		&& pread(mapFd, lengths.data(), lengthsSize, sizeof(header) + blockMap.size()) == lengthsSize;
+
+	int dataFd = isValid ? ::open(m_dataPath.c_str(), O_RDWR) : -1;
+	if (dataFd < 0) {
+		close(mapFd);
+		return -1;
+	}
+
+	m_mapFd = mapFd;
+	m_dataFd = dataFd;
+	m_blockMap.swap(blockMap);
+	m_flushedMap = m_blockMap;
+	m_lengths.swap(lengths);
+	m_presentCount = 0;
+	for (size_t i = 0; i < m_blockCount; ++i) {
+		if (isPresent(i)) {
+			m_presentCount++;
+		}
+	}
+
+	m_log->debug("SPARSE RESUME - %zu of %zu blocks present: %s", m_presentCount, m_blockCount, m_cachePath.c_str());
+	return 0;
+}
+
+int SparseFile::createBlockMap()
+{
+	m_dataFd = ::open(m_dataPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (m_dataFd < 0) {
+		return -1;
+	}
+	if (ftruncate(m_dataFd, m_size) == -1) {
+		return -1;
+	}
+
+	m_mapFd = ::open(m_mapPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (m_mapFd < 0) {
+		return -1;
+	}
+
+	Header header;
+	memcpy(header.magic, BLOCK_MAP_MAGIC, sizeof(header.magic));
+	header.size = m_size;
+	header.mtime = m_mtime;
+	header.blockSize = m_blockSize;
+	header.codec = m_codec;
+	header.reserved = 0;
+
+	m_blockMap.assign((m_blockCount + 7) / 8, 0);
+	m_flushedMap = m_blockMap;
+	m_lengths.assign(isCompressed() ? m_blockCount : 0, 0);
+	m_presentCount = 0;
+	ssize_t lengthsSize = m_lengths.size() * sizeof(uint32_t);
+	if (pwrite(m_mapFd, &header, sizeof(header), 0) != sizeof(header)
+		|| pwrite(m_mapFd, m_blockMap.data(), m_blockMap.size(), sizeof(header)) != (ssize_t)m_blockMap.size()
+		|| pwrite(m_mapFd, m_lengths.data(), lengthsSize, sizeof(header) + m_blockMap.size()) != lengthsSize) {
+		return -1;
+	}
+
+	return 0;
+}
+
+bool SparseFile::isPresent(size_t block) const
+{
+	return (m_blockMap[block / 8] & (1 << (block % 8))) != 0;
+}
+
+int SparseFile::fetchRange(off_t offset, size_t size)
+{
+	if (offset >= m_size || size == 0) {
+		return 0;
+	}
+
+	off_t end = std::min((off_t)(offset + size), m_size);
+	size_t first = offset / m_blockSize;
+	size_t last = (end - 1) / m_blockSize;
+	for (size_t block = first; block <= last; ++block) {
+		if (fetchBlock(block) == -1) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int SparseFile::fetchBlock(size_t block)
+{
+	if (block >= m_blockCount) {
+		return 0;
+	}
+
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (!isPresent(block) && m_fetching.count(block) > 0) {
+			m_blockFetched.wait(lock);
+		}
+		if (isPresent(block)) {
+			return 0;
+		}
+		m_fetching.insert(block);
+	}
+
+	off_t offset = (off_t)block * m_blockSize;
+	size_t length = blockLength(block);
+	uint32_t storedLength = length;
+	int res;
+	if (isCompressed()) {
+		// blocks that do not get smaller are stored as they are
+		std::vector<uint8_t> data(length);
+		std::vector<uint8_t> compressed;
+		res = readFileRange(m_origFd, (char*)data.data(), offset, length, m_limiter);
+		if (res == 0) {
+			size_t compressedLength = Compressor::compress(m_codec, m_level, data.data(), length, compressed);
+			const uint8_t* src = data.data();
+			if (compressedLength > 0) {
+				src = compressed.data();
+				storedLength = compressedLength;
+			}
+			if (pwrite(m_dataFd, src, storedLength, offset) != (ssize_t)storedLength) {
+				res = -1;
+			}
+		}
+	}
+	else {
+		res = copyFileRange(m_origFd, m_dataFd, offset, length, m_limiter);
+	}
+
+	bool needsFlush = false;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_fetching.erase(block);
+		if (res == 0) {
+			Metrics::count(METRIC_BLOCK_FETCHES);
+			if (isCompressed()) {
+				m_lengths[block] = storedLength;
+			}
+			m_blockMap[block / 8] |= (1 << (block % 8));
+			m_presentCount++;
+			m_unflushed.push_back(block);
+			needsFlush = m_unflushed.size() >= FLUSH_BLOCKS;
+		}
+		else {
+			m_log->error("SPARSE ERROR - fetching block %zu of: %s", block, m_origPath.c_str());
+		}
+		m_blockFetched.notify_all();
+	}
+
+	if (needsFlush) {
+		flushBlockMap();
+	}
+	return res;
+}
+
+// Marks the blocks fetched since the last flush in the block map, after
+// their data is on disk. The length of a compressed block is written
+// before the bit that makes it count as present.
+void SparseFile::flushBlockMap()
+{
+	std::vector<size_t> blocks;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		blocks.swap(m_unflushed);
+	}
+	if (blocks.empty() || m_dataFd < 0 || m_mapFd < 0) {
+		return;
+	}
+
+	if (fdatasync(m_dataFd) == -1) {
+		m_log->error("SPARSE ERROR - cannot flush: %s", m_dataPath.c_str());
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	bool isWritten = true;
+	for (size_t block : blocks) {
+		if (isCompressed()) {
+			off_t lengthOffset = sizeof(Header) + m_blockMap.size() + block * sizeof(uint32_t);
+			isWritten &= pwrite(m_mapFd, &m_lengths[block], sizeof(uint32_t), lengthOffset) == sizeof(uint32_t);
+		}
+	}
+	// blocks fetched after the sync may share a byte, their bits stay unset on disk
+	for (size_t block : blocks) {
+		size_t index = block / 8;
+		m_flushedMap[index] |= (1 << (block % 8));
+		isWritten &= pwrite(m_mapFd, &m_flushedMap[index], 1, sizeof(Header) + index) == 1;
+	}
+	if (!isWritten) {
+		m_log->error("SPARSE ERROR - cannot update block map: %s", m_mapPath.c_str());
+	}
+}
+
+bool SparseFile::isCached(off_t offset, size_t size)
+{
+	if (offset >= m_size || size == 0) {
+		return true;
+	}
+
+	off_t end = std::min((off_t)(offset + size), m_size);
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (size_t block = offset / m_blockSize; block <= (size_t)(end - 1) / m_blockSize; ++block) {
+		if (!isPresent(block)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool SparseFile::isComplete()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_isOpen && m_presentCount == m_blockCount;
+}
+
+int SparseFile::finalize()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (!m_isOpen || m_presentCount != m_blockCount) {
+		return -1;
+	}
+
+	// the complete file is used without its block map, so all of it has to be on disk
+	m_unflushed.clear();
+	if (fdatasync(m_dataFd) == -1) {
+		return -1;
+	}
+
+	struct utimbuf tb;
+	tb.actime = m_mtime;
+	tb.modtime = m_mtime;
+	if (utime(m_dataPath.c_str(), &tb) == -1) {
+		return -1;
+	}
+
+	m_log->debug("SPARSE COMPLETE - rename sparse file: %s", m_dataPath.c_str());
+	if (rename(m_dataPath.c_str(), m_cachePath.c_str()) == -1) {
+		return -1;
+	}
+	unlink(m_mapPath.c_str());
+	m_isOpen = false;
+
+	return 0;
+}
+
+size_t SparseFile::blockLength(size_t block) const
+{
+	return std::min((off_t)m_blockSize, m_size - (off_t)block * (off_t)m_blockSize);
+}
+
+// Decompressed blocks are kept for a few reads, since the kernel reads a
+// block in many smaller requests.
+std::shared_ptr<std::vector<uint8_t>> SparseFile::decodeBlock(size_t block)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_decodedMutex);
+		for (auto it = m_decoded.begin(); it != m_decoded.end(); ++it) {
+			if (it->first == block) {
+				m_decoded.splice(m_decoded.begin(), m_decoded, it);
+				return it->second;
+			}
+		}
+	}
+
+	size_t length = blockLength(block);
+	uint32_t storedLength = m_lengths[block];
+	std::vector<uint8_t> stored(storedLength);
+	if (pread(m_dataFd, stored.data(), storedLength, (off_t)block * m_blockSize) != (ssize_t)storedLength) {
+		return nullptr;
+	}
+
+	std::shared_ptr<std::vector<uint8_t>> data = std::make_shared<std::vector<uint8_t>>(length);
+	if (Compressor::decompress(m_codec, stored.data(), storedLength, data->data(), length) == -1) {
+		m_log->error("SPARSE ERROR - corrupt block %zu of: %s", block, m_dataPath.c_str());
+		errno = EIO;
+		return nullptr;
+	}
+
+	std::lock_guard<std::mutex> lock(m_decodedMutex);
+	m_decoded.emplace_front(block, data);
+	if (m_decoded.size() > DECODED_BLOCKS) {
+		m_decoded.pop_back();
+	}
+	return data;
+}
+
+// Reads from a compressed file. The range must have been fetched before.
+ssize_t SparseFile::read(char* buf, size_t size, off_t offset)
+{
+	if (offset >= m_size) {
+		return 0;
+	}
+
+	size = std::min((off_t)size, m_size - offset);
+	size_t done = 0;
+	while (done < size) {
+		size_t block = (offset + done) / m_blockSize;
+		size_t blockOffset = (offset + done) % m_blockSize;
+		size_t length = blockLength(block);
+		size_t n = std::min(size - done, length - blockOffset);
+		if (m_lengths[block] == length) {
+			ssize_t nread = pread(m_dataFd, buf + done, n, offset + done);
+			if (nread <= 0) {
+				return nread < 0 ? -1 : done;
+			}
+			n = nread;
+		}
+		else {
+			std::shared_ptr<std::vector<uint8_t>> data = decodeBlock(block);
+			if (!data) {
+				return -1;
+			}
+			memcpy(buf + done, data->data() + blockOffset, n);
+		}
+		done += n;
+	}
+
+	return done;
+}
+
+size_t SparseFile::blockCount() const
+{
+	return m_blockCount;
+}
+
+size_t SparseFile::blockSize() const
+{
+	return m_blockSize;
+}
+
+off_t SparseFile::size() const
+{
+	return m_size;
+}
+
+// The disk space of the file, counting blocks that are not fetched yet with
+// their full size.
+uint64_t SparseFile::storedSize()
+{
+	if (!isCompressed()) {
+		return m_size;
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	uint64_t size = 0;
+	for (size_t i = 0; i < m_blockCount; ++i) {
+		size += isPresent(i) ? m_lengths[i] : blockLength(i);
+	}
+	return size;
+}
+
+bool SparseFile::isCompressed() const
+{
+	return m_codec != CODEC_NONE;
+}
+
+time_t SparseFile::mtime() const
+{
+	return m_mtime;
+}
+
+const std::string& SparseFile::dataPath() const
+{
+	return m_dataPath;
+}
@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2024 Nils Zweiling
+ *
+ * This file is part of fusecache which is released under the MIT license.
+ * See file LICENSE or go to https://github.com/zwodev/fusecache/tree/master/LICENSE
+ * for full license details.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <mutex>
+#include <condition_variable>
+#include <string>
+#include <vector>
+#include <list>
+#include <memory>
+#include <set>
+
+#include "Log.h"
+#include "Origin.h"
+#include "RateLimiter.h"
+#include "Compressor.h"
+
+// A cached file that is filled block by block on demand. The data lives in
+// a sparse "<path>.fusecache.sparse" file next to a "<path>.fusecache.blocks"
+// bitmap, and is moved to "<path>" by finalize() once every block is present.
+// With a codec set, every block is compressed into the start of its slot in
+// the sparse file and the block map also keeps the stored length of each
+// block. Such files are read through read() and are never moved into place.
+// A block counts as present in memory as soon as it is written, but it is
+// only marked in the block map once its data has been flushed to disk, so
+// that a crash never leaves holes marked as present.
+class SparseFile
+{
+
+public:
+    SparseFile(Log* log, size_t blockSize, RateLimiter* limiter, Codec codec = CODEC_NONE, int level = 0);
+    ~SparseFile();
+
+    int open(Origin* origin, const std::string& filePath, const std::string& cachePath);
+    int fetchRange(off_t offset, size_t size);
+    int fetchBlock(size_t block);
+    bool isCached(off_t offset, size_t size);
+    bool isComplete();
+    int finalize();
+    ssize_t read(char* buf, size_t size, off_t offset);
+
+    size_t blockCount() const;
+    size_t blockSize() const;
+    off_t size() const;
+    uint64_t storedSize();
+    bool isCompressed() const;
+    time_t mtime() const;
+    const std::string& dataPath() const;
+
+    static std::string dataFilePath(const std::string& cachePath);
+    static std::string blockMapPath(const std::string& cachePath);
+
+private:
+    bool isPresent(size_t block) const;
+    void closeFiles();
+    void flushBlockMap();
+    int loadBlockMap();
+    int createBlockMap();
+    size_t blockLength(size_t block) const;
+    std::shared_ptr<std::vector<uint8_t>> decodeBlock(size_t block);
+
+private:
+    struct Header
+    {
+        char magic[8];
+        uint64_t size;
+        int64_t mtime;
+        uint64_t blockSize;
+        uint32_t codec;
+        uint32_t reserved;
+    };
+
+    static const size_t DECODED_BLOCKS = 4;
+    static const size_t FLUSH_BLOCKS = 16;
+
+    Log* m_log = nullptr;
+    RateLimiter* m_limiter = nullptr;
+    std::mutex m_mutex;
+    std::condition_variable m_blockFetched;
+    std::vector<uint8_t> m_blockMap;
+    std::vector<uint32_t> m_lengths;
+    Codec m_codec = CODEC_NONE;
+    int m_level = 0;
+    std::mutex m_decodedMutex;
+    std::list<std::pair<size_t, std::shared_ptr<std::vector<uint8_t>>>> m_decoded;
+    std::set<size_t> m_fetching;
+    bool m_isOpen = false;
+    int m_origFd = -1;
+    int m_dataFd = -1;
+    int m_mapFd = -1;
+    off_t m_size = 0;
+    time_t m_mtime = 0;
+    size_t m_blockSize = 0;
+    size_t m_blockCount = 0;
+    size_t m_presentCount = 0;
+    std::vector<size_t> m_unflushed;
+    std::vector<uint8_t> m_flushedMap;
+    std::string m_origPath;
+    std::string m_cachePath;
+    std::string m_dataPath;
+    std::string m_mapPath;
+};
@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2024 Nils Zweiling
+ *
+ * This file is part of fusecache which is released under the MIT license.
+ * See file LICENSE or go to https://github.com/zwodev/fusecache/tree/master/LICENSE
+ * for full license details.
+ */
+
+#include <functional>
+
+#include "StatCache.h"
+
+StatCache::StatCache()
+{
+	setTtl(1.0);
+	setNegativeTtl(1.0);
+}
+
+StatCache::Shard& StatCache::shardFor(const std::string& path)
+{
+	return m_shards[std::hash<std::string>()(path) % SHARD_COUNT];
+}
+
+bool StatCache::lookup(const std::string& path, struct stat* st, int& err)
+{
+	Shard& shard = shardFor(path);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	auto it = shard.entries.find(path);
+	if (it == shard.entries.end()) {
+		return false;
+	}
+	if (it->second.expires < Clock::now()) {
+		shard.entries.erase(it);
+		return false;
+	}
+
+	err = it->second.err;
+	if (err == 0) {
+		*st = it->second.st;
+	}
+	return true;
+}
+
+// Hits from the FUSE handlers reuse a per-thread key instead of building a new string.
+bool StatCache::lookup(const char* path, struct stat* st, int& err)
+{
+	static thread_local std::string key;
+	key.assign(path);
+	return lookup(key, st, err);
+}
+
+void StatCache::put(const std::string& path, const struct stat& st)
+{
+	if (m_ttl == Clock::duration::zero()) {
+		return;
+	}
+
+	Entry entry;
+	entry.st = st;
+	entry.err = 0;
+	entry.expires = Clock::now() + m_ttl;
+	insert(path, entry);
+}
+
+void StatCache::putNegative(const std::string& path, int err)
+{
+	if (m_negativeTtl == Clock::duration::zero()) {
+		return;
+	}
+
+	Entry entry {};
+	entry.err = err;
+	entry.expires = Clock::now() + m_negativeTtl;
+	insert(path, entry);
+}
+
+void StatCache::insert(const std::string& path, const Entry& entry)
+{
+	Shard& shard = shardFor(path);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+
+	// drop expired entries first and start over if that is not enough
+	if (shard.entries.size() >= MAX_SHARD_ENTRIES) {
+		Clock::time_point now = Clock::now();
+		for (auto it = shard.entries.begin(); it != shard.entries.end();) {
+			it = it->second.expires < now ? shard.entries.erase(it) : std::next(it);
+		}
+		if (shard.entries.size() >= MAX_SHARD_ENTRIES) {
+			shard.entries.clear();
+		}
+	}
+
+	shard.entries[path] = entry;
+}
+
+void StatCache::invalidate(const std::string& path)
+{
+	Shard& shard = shardFor(path);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	shard.entries.erase(path);
+}
+
+void StatCache::clear()
+{
+	for (Shard& shard : m_shards) {
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		shard.entries.clear();
+	}
+}
+
+void StatCache::setTtl(double seconds)
+{
+	m_ttl = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds < 0 ? 0 : seconds));
+}
+
+void StatCache::setNegativeTtl(double seconds)
+{
+	m_negativeTtl = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds < 0 ? 0 : seconds));
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2024 Nils Zweiling
+ *
+ * This file is part of fusecache which is released under the MIT license.
+ * See file LICENSE or go to https://github.com/zwodev/fusecache/tree/master/LICENSE
+ * for full license details.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// Short-lived attributes of paths below the mount, so that repeated
+// lookups do not each go to the origin. Lookups of missing files are
+// cached as well. The map is split into shards to keep lock contention
+// low on the multithreaded FUSE loop.
+class StatCache
+{
+
+public:
+    StatCache();
+
+    bool lookup(const std::string& path, struct stat* st, int& err);
+    bool lookup(const char* path, struct stat* st, int& err);
+    void put(const std::string& path, const struct stat& st);
+    void putNegative(const std::string& path, int err);
+    void invalidate(const std::string& path);
+    void clear();
+
+    void setTtl(double seconds);
+    void setNegativeTtl(double seconds);
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Entry
+    {
+        struct stat st;
+        int err;
+        Clock::time_point expires;
+    };
+
+    struct Shard
+    {
+        std::mutex mutex;
+        std::unordered_map<std::string, Entry> entries;
+    };
+
+    Shard& shardFor(const std::string& path);
+    void insert(const std::string& path, const Entry& entry);
+
+private:
+    static const size_t SHARD_COUNT = 16;
+    static const size_t MAX_SHARD_ENTRIES = 65536;
+
+    Shard m_shards[SHARD_COUNT];
+    Clock::duration m_ttl;
+    Clock::duration m_negativeTtl;
+};
@@ -0,0 +1,544 @@
+/*
+ * Copyright (c) 2024 Nils Zweiling
+ *
+ * This file is part of fusecache which is released under the MIT license.
+ * See file LICENSE or go to https://github.com/zwodev/fusecache/tree/master/LICENSE
+ * for full license details.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+#include <filesystem>
+#include <vector>
+
+#include "Helper.h"
+#include "FileCopy.h"
+#include "Signature.h"
+#include "ContentStore.h"
+#include "SyncEngine.h"
+
+SyncEngine::SyncEngine(Log* log)
+{
+	m_log = log;
+}
+
+SyncEngine::~SyncEngine()
+{
+	stop();
+}
+
+bool SyncEngine::isTempFile(const std::string& name)
+{
+	return name.size() > 1 && name[0] == '.' && hasSuffix(name, ".fcsync");
+}
+
+void SyncEngine::start()
+{
+	if (m_isRunning) {
+		return;
+	}
+
+	// the journal is read before start() returns, so pendingPaths() is complete
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_hasJournal = loadJournal();
+	}
+
+	m_isRunning = true;
+	m_workers.start(m_numWorkers);
+	m_thread = std::thread(&SyncEngine::run, this);
+}
+
+void SyncEngine::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_isRunning = false;
+	}
+	m_wakeUp.notify_all();
+
+	if (m_thread.joinable()) {
+		m_thread.join();
+	}
+	m_workers.stop();
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_journalFd >= 0) {
+		close(m_journalFd);
+		m_journalFd = -1;
+	}
+}
+
+void SyncEngine::markDirty(const std::string& path)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto res = m_dirty.emplace(path, 0);
+	res.first->second = ++m_generation;
+	if (res.second) {
+		appendJournal(path);
+	}
+}
+
+size_t SyncEngine::dirtyCount()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_dirty.size();
+}
+
+// True while the path is waiting for its upload or being uploaded.
+bool SyncEngine::isPending(const std::string& path)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_dirty.count(path) > 0 || m_inFlight.count(path) > 0;
+}
+
+std::vector<std::string> SyncEngine::pendingPaths()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	std::vector<std::string> paths;
+	for (auto& it : m_dirty) {
+		paths.push_back(it.first);
+	}
+	return paths;
+}
+
+void SyncEngine::requestUpload(const std::string& path)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_dirty.count(path) == 0) {
+		return;
+	}
+
+	// the first request of a burst starts the delay, later ones join it
+	auto now = std::chrono::steady_clock::now();
+	m_requestedAt.emplace(path, now);
+	if (!m_isFlushPending) {
+		m_isFlushPending = true;
+		m_flushAt = now + std::chrono::milliseconds(m_delay);
+		m_wakeUp.notify_all();
+	}
+}
+
+void SyncEngine::run()
+{
+	// without a journal the write cache has to be compared with the origin once
+	if (!m_hasJournal) {
+		m_log->info("SYNC - no journal found, comparing write cache with origin");
+		reconcile("");
+	}
+
+	// requested uploads are flushed after the delay, everything else on the interval
+	std::unique_lock<std::mutex> lock(m_mutex);
+	auto nextPass = std::chrono::steady_clock::now();
+	while (m_isRunning) {
+		auto now = std::chrono::steady_clock::now();
+		if (now < nextPass && !(m_isFlushPending && now >= m_flushAt)) {
+			m_wakeUp.wait_until(lock, m_isFlushPending ? std::min(m_flushAt, nextPass) : nextPass);
+			continue;
+		}
+
+		if (now >= nextPass) {
+			nextPass = now + std::chrono::seconds(m_interval);
+		}
+		m_isFlushPending = false;
+
+		lock.unlock();
+		syncDirty();
+		lock.lock();
+	}
+}
+
+void SyncEngine::syncDirty()
+{
+	std::vector<std::pair<std::string, uint64_t>> paths;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		for (auto& it : m_dirty) {
+			if (m_inFlight.count(it.first) > 0) {
+				continue;
+			}
+
+			// files still open for writing are uploaded after they are closed
+			if (m_isBusy && m_isBusy(it.first)) {
+				continue;
+			}
+
+			m_inFlight.insert(it.first);
+			paths.emplace_back(it.first, it.second);
+		}
+	}
+
+	if (!paths.empty()) {
+		m_log->info("SYNC - uploading %zu paths", paths.size());
+	}
+
+	for (auto& it : paths) {
+		std::string path = it.first;
+		uint64_t generation = it.second;
+		m_workers.enqueue([this, path, generation] { uploadPath(path, generation); });
+	}
+}
+
+void SyncEngine::uploadPath(const std::string& path, uint64_t generation)
+{
+	auto startedAt = std::chrono::steady_clock::now();
+	int res = upload(path);
+	if (res >= 0 && m_onUploaded) {
+		m_onUploaded(path);
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_inFlight.erase(path);
+	if (res == -1) {
+		m_log->error("SYNC ERROR - %s: %s", path.c_str(), strerror(errno));
+		return;
+	}
+
+	// a newer change that came in during the upload keeps the file dirty
+	auto it = m_dirty.find(path);
+	if (it != m_dirty.end() && it->second == generation) {
+		m_dirty.erase(it);
+	}
+	compactJournal();
+
+	// time from the close of the file until it is visible on the origin,
+	// only for uploads that actually copied the file
+	auto requested = m_requestedAt.find(path);
+	if (requested != m_requestedAt.end() && requested->second <= startedAt) {
+		if (res == 1) {
+			auto latency = std::chrono::steady_clock::now() - requested->second;
+			m_uploadLatency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count());
+		}
+		m_requestedAt.erase(requested);
+	}
+
+	if (m_inFlight.empty() && m_uploadLatency.count() > 0) {
+		m_log->info("SYNC DONE - %zu dirty, close to origin latency p50: %.0f ms p90: %.0f ms p99: %.0f ms",
+			m_dirty.size(), m_uploadLatency.quantile(0.5) / 1e6, m_uploadLatency.quantile(0.9) / 1e6,
+			m_uploadLatency.quantile(0.99) / 1e6);
+	}
+}
+
+Histogram* SyncEngine::uploadLatency()
+{
+	return &m_uploadLatency;
+}
+
+// Returns 1 if the file was copied to the origin, 0 if there was nothing to
+// copy and -1 on errors.
+int SyncEngine::upload(const std::string& path)
+{
+	std::string from = m_writeCacheDir + path;
+
+	// nothing left to sync if the file was removed in the meantime
+	struct stat sb_from;
+	if (lstat(from.c_str(), &sb_from) == -1) {
+		return errno == ENOENT ? 0 : -1;
+	}
+
+	if (S_ISDIR(sb_from.st_mode)) {
+		if (m_origin->createDirectories(path) == -1) {
+			return -1;
+		}
+
+		// a new or renamed directory brings its contents along
+		std::error_code ec;
+		for (auto& entry : std::filesystem::directory_iterator(from, ec)) {
+			std::string filePath = path + "/" + entry.path().filename().u8string();
+			if (!isInternalFile(filePath)) {
+				markDirty(filePath);
+			}
+		}
+		return 0;
+	}
+
+	if (!S_ISREG(sb_from.st_mode)) {
+		return 0;
+	}
+
+	// do not overwrite newer files on the origin and skip files that are already there
+	struct stat sb_to;
+	if (m_origin->stat(path.c_str(), &sb_to) == 0) {
+		if (sb_to.st_mtim.tv_sec > sb_from.st_mtim.tv_sec) {
+			return 0;
+		}
+		if (sb_to.st_mtim.tv_sec == sb_from.st_mtim.tv_sec && sb_to.st_size == sb_from.st_size) {
+			if ((sb_to.st_mode & 07777) != (sb_from.st_mode & 07777)) {
+				return m_origin->chmod(path.c_str(), sb_from.st_mode & 07777);
+			}
+			return 0;
+		}
+	}
+
+	return uploadFile(path, from, sb_from);
+}
+
+int SyncEngine::uploadFile(const std::string& path, const std::string& from, const struct stat& sb_from)
+{
+	std::string parentPath = path.substr(0, path.find_last_of('/'));
+	m_origin->createDirectories(parentPath);
+
+	std::string tmpPath = parentPath + "/." + path.substr(path.find_last_of('/') + 1) + ".fcsync";
+	int fd_from = open(from.c_str(), O_RDONLY);
+	if (fd_from < 0) {
+		return errno == ENOENT ? 0 : -1;
+	}
+
+	int fd_to = m_origin->openFile(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, sb_from.st_mode & 07777);
+	if (fd_to < 0) {
+		int saved_errno = errno;
+		close(fd_from);
+		errno = saved_errno;
+		return -1;
+	}
+
+	int res = copyFileData(fd_from, fd_to, m_limiter);
+	if (res == 0) {
+		struct timespec times[2] = { sb_from.st_atim, sb_from.st_mtim };
+		res = futimens(fd_to, times);
+	}
+
+	int saved_errno = errno;
+	close(fd_from);
+	if (close(fd_to) == -1 && res == 0) {
+		saved_errno = errno;
+		res = -1;
+	}
+	if (res == 0 && m_origin->rename(tmpPath.c_str(), path.c_str()) == -1) {
+		saved_errno = errno;
+		res = -1;
+	}
+	if (res == -1) {
+		m_origin->unlink(tmpPath.c_str());
+		errno = saved_errno;
+		return -1;
+	}
+
+	m_log->debug("SYNC SUCCESS - %s", path.c_str());
+	if (m_publishSignatures) {
+		publishSignature(path, from);
+	}
+	return 1;
+}
+
+// Other instances refill their stale copies of the file with a delta transfer
+// against this signature. It is computed from the local copy, which has the
+// same content and modification time as the uploaded file.
+void SyncEngine::publishSignature(const std::string& path, const std::string& from)
+{
+	int fd = open(from.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return;
+	}
+
+	Signature sig;
+	int res = sig.compute(fd, Signature::DEFAULT_BLOCK_SIZE);
+	close(fd);
+
+	// written to a temporary name so that readers never see a partial signature
+	std::string sigPath = Signature::sigPath("", path);
+	std::string tmpPath = sigPath + ".fcsync";
+	if (res == 0) {
+		m_origin->createDirectories(sigPath.substr(0, sigPath.find_last_of('/')));
+		int fd_to = m_origin->openFile(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		res = fd_to < 0 ? -1 : sig.writeTo(fd_to);
+		if (fd_to >= 0 && close(fd_to) == -1) {
+			res = -1;
+		}
+		if (res == 0) {
+			res = m_origin->rename(tmpPath.c_str(), sigPath.c_str());
+		}
+		if (res == -1 && fd_to >= 0) {
+			m_origin->unlink(tmpPath.c_str());
+		}
+	}
+	if (res == -1) {
+		m_log->warning("SYNC WARNING - cannot publish signature: %s", path.c_str());
+	}
+}
+
+void SyncEngine::reconcile(const std::string& dir)
+{
+	std::error_code ec;
+	for (auto& entry : std::filesystem::directory_iterator(m_writeCacheDir + dir, ec)) {
+		std::string path = dir + "/" + entry.path().filename().u8string();
+		if (isInternalFile(path) || ContentStore::isStorePath(path)) {
+			continue;
+		}
+		struct stat sb_from;
+		struct stat sb_to;
+		if (lstat(entry.path().c_str(), &sb_from) == -1) {
+			continue;
+		}
+
+		bool existsOnOrigin = m_origin->stat(path.c_str(), &sb_to) == 0;
+		if (!existsOnOrigin && m_onMissing && (S_ISDIR(sb_from.st_mode) || sb_from.st_nlink == 1)) {
+			m_onMissing(path);
+		}
+		if (S_ISDIR(sb_from.st_mode)) {
+			if (existsOnOrigin) {
+				reconcile(path);
+			}
+			else {
+				markDirty(path);
+			}
+		}
+		else if (S_ISREG(sb_from.st_mode) && sb_from.st_nlink == 1) {
+			// files linked to the content store are unshared before every modification
+			if (!existsOnOrigin || sb_to.st_mtim.tv_sec < sb_from.st_mtim.tv_sec
+				|| (sb_to.st_mtim.tv_sec == sb_from.st_mtim.tv_sec && sb_to.st_size != sb_from.st_size)) {
+				markDirty(path);
+			}
+		}
+	}
+}
+
+bool SyncEngine::loadJournal()
+{
+	std::string journalPath = m_writeCacheDir + "/.fusecache.journal";
+	bool exists = access(journalPath.c_str(), F_OK) == 0;
+
+	m_journalFd = open(journalPath.c_str(), O_RDWR | O_CREAT, 0644);
+	if (m_journalFd < 0) {
+		m_log->error("SYNC ERROR - cannot open journal: %s", journalPath.c_str());
+		return false;
+	}
+
+	std::string data;
+	char buf[65536];
+	ssize_t nread;
+	while ((nread = read(m_journalFd, buf, sizeof(buf))) > 0) {
+		data.append(buf, nread);
+	}
+
+	size_t pos = 0;
+	size_t end;
+	while ((end = data.find('\n', pos)) != std::string::npos) {
+		if (end > pos) {
+			m_dirty[data.substr(pos, end - pos)] = ++m_generation;
+			m_journalRecords++;
+		}
+		pos = end + 1;
+	}
+
+	// drop a line that was cut off by a crash
+	if (pos < data.size() && ftruncate(m_journalFd, pos) == -1) {
+		m_log->error("SYNC ERROR - cannot repair journal: %s", journalPath.c_str());
+	}
+	lseek(m_journalFd, pos, SEEK_SET);
+
+	if (!m_dirty.empty()) {
+		m_log->info("SYNC - %zu dirty paths in journal", m_dirty.size());
+	}
+	return exists;
+}
+
+void SyncEngine::appendJournal(const std::string& path)
+{
+	if (m_journalFd < 0) {
+		return;
+	}
+
+	std::string line = path + "\n";
+	if (write(m_journalFd, line.data(), line.size()) != (ssize_t)line.size()) {
+		m_log->error("SYNC ERROR - cannot append to journal: %s", path.c_str());
+		return;
+	}
+	m_journalRecords++;
+}
+
+void SyncEngine::compactJournal()
+{
+	if (m_journalFd < 0) {
+		return;
+	}
+
+	if (m_dirty.empty()) {
+		if (ftruncate(m_journalFd, 0) == 0) {
+			lseek(m_journalFd, 0, SEEK_SET);
+			m_journalRecords = 0;
+		}
+		return;
+	}
+
+	if (m_journalRecords <= 2 * m_dirty.size() + 1024) {
+		return;
+	}
+
+	std::string data;
+	for (auto& it : m_dirty) {
+		data += it.first + "\n";
+	}
+
+	std::string journalPath = m_writeCacheDir + "/.fusecache.journal";
+	std::string tmpPath = journalPath + ".tmp";
+	int fd = open(tmpPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		return;
+	}
+	if (write(fd, data.data(), data.size()) != (ssize_t)data.size() || rename(tmpPath.c_str(), journalPath.c_str()) == -1) {
+		close(fd);
+		unlink(tmpPath.c_str());
+		return;
+	}
+
+	close(m_journalFd);
+	m_journalFd = fd;
+	m_journalRecords = m_dirty.size();
+}
+
+void SyncEngine::setWriteCacheDir(const std::string& writeCacheDir)
+{
+	m_writeCacheDir = writeCacheDir;
+}
+
+void SyncEngine::setWorkers(int numWorkers)
+{
+	m_numWorkers = std::max(1, numWorkers);
+}
+
+void SyncEngine::setInterval(int seconds)
+{
+	m_interval = std::max(1, seconds);
+}
+
+void SyncEngine::setDelay(int milliseconds)
+{
+	m_delay = std::max(0, milliseconds);
+}
+
+void SyncEngine::setOrigin(Origin* origin)
+{
+	m_origin = origin;
+}
+
+void SyncEngine::setRateLimiter(RateLimiter* limiter)
+{
+	m_limiter = limiter;
+}
+
+void SyncEngine::setPublishSignatures(bool enabled)
+{
+	m_publishSignatures = enabled;
+}
+
+void SyncEngine::setIsBusy(std::function<bool(const std::string&)> isBusy)
+{
+	m_isBusy = isBusy;
+}
+
+// Called for entries that reconcile finds in the write cache but not on the origin.
+void SyncEngine::setOnMissing(std::function<void(const std::string&)> onMissing)
+{
+	m_onMissing = onMissing;
+}
+
+void SyncEngine::setOnUploaded(std::function<void(const std::string&)> onUploaded)
+{
+	m_onUploaded = onUploaded;
+}
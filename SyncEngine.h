@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2024 Nils Zweiling
+ *
+ * This file is part of fusecache which is released under the MIT license.
+ * See file LICENSE or go to https://github.com/zwodev/fusecache/tree/master/LICENSE
+ * for full license details.
+ */
+
+#pragma once
+
+#include <sys/stat.h>
+#include <stdint.h>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "Log.h"
+#include "Metrics.h"
+#include "WorkerPool.h"
+#include "RateLimiter.h"
+#include "Origin.h"
+
+// Uploads files from the write cache to the origin. Operations that modify
+// a file through the mount mark it dirty. Dirty paths are recorded in an
+// append-only journal so that pending uploads survive a restart, and only
+// those paths are synced. Files are written to a temporary name on the
+// origin and renamed into place once complete. Closing the last writable
+// handle of a dirty file schedules an upload after a short delay, so that
+// bursts of closes are uploaded together. With delta transfer enabled the
+// signature of every uploaded file is published on the origin as well.
+class SyncEngine
+{
+
+public:
+    SyncEngine(Log* log);
+    ~SyncEngine();
+
+    void start();
+    void stop();
+
+    void markDirty(const std::string& path);
+    void requestUpload(const std::string& path);
+    size_t dirtyCount();
+    bool isPending(const std::string& path);
+    std::vector<std::string> pendingPaths();
+    Histogram* uploadLatency();
+
+    void setWriteCacheDir(const std::string& writeCacheDir);
+    void setOrigin(Origin* origin);
+    void setWorkers(int numWorkers);
+    void setInterval(int seconds);
+    void setDelay(int milliseconds);
+    void setRateLimiter(RateLimiter* limiter);
+    void setPublishSignatures(bool enabled);
+    void setIsBusy(std::function<bool(const std::string&)> isBusy);
+    void setOnUploaded(std::function<void(const std::string&)> onUploaded);
+    void setOnMissing(std::function<void(const std::string&)> onMissing);
+
+    static bool isTempFile(const std::string& name);
+
+private:
+    void run();
+    void syncDirty();
+    void uploadPath(const std::string& path, uint64_t generation);
+    int upload(const std::string& path);
+    int uploadFile(const std::string& path, const std::string& from, const struct stat& sb_from);
+    void publishSignature(const std::string& path, const std::string& from);
+    void reconcile(const std::string& dir);
+    bool loadJournal();
+    void appendJournal(const std::string& path);
+    void compactJournal();
+
+private:
+    Log* m_log = nullptr;
+    std::mutex m_mutex;
+    std::condition_variable m_wakeUp;
+    std::thread m_thread;
+    WorkerPool m_workers;
+    bool m_isRunning = false;
+    std::unordered_map<std::string, uint64_t> m_dirty;
+    std::unordered_set<std::string> m_inFlight;
+    uint64_t m_generation = 0;
+    bool m_isFlushPending = false;
+    std::chrono::steady_clock::time_point m_flushAt;
+    std::unordered_map<std::string, std::chrono::steady_clock::time_point> m_requestedAt;
+    Histogram m_uploadLatency;
+    int m_journalFd = -1;
+    bool m_hasJournal = false;
+    size_t m_journalRecords = 0;
+    std::string m_writeCacheDir;
+    Origin* m_origin = nullptr;
+    int m_numWorkers = 4;
+    int m_interval = 30;
+    int m_delay = 200;
+    RateLimiter* m_limiter = nullptr;
+    bool m_publishSignatures = false;
+    std::function<bool(const std::string&)> m_isBusy;
+    std::function<void(const std::string&)> m_onUploaded;
+    std::function<void(const std::string&)> m_onMissing;
+};
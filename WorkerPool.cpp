@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2024 Nils Zweiling
+ *
+ * This file is part of fusecache which is released under the MIT license.
+ * See file LICENSE or go to https://github.com/zwodev/fusecache/tree/master/LICENSE
+ * for full license details.
+ */
+
+#include "WorkerPool.h"
+
+WorkerPool::WorkerPool()
+{
+}
+
+WorkerPool::~WorkerPool()
+{
+	stop();
+}
+
+void WorkerPool::start(int numThreads)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_isRunning) {
+		return;
+	}
+
+	m_isRunning = true;
+	for (int i = 0; i < numThreads; ++i) {
+		m_threads.emplace_back(&WorkerPool::run, this);
+	}
+}
+
+void WorkerPool::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_isRunning = false;
+		m_tasks.clear();
+	}
+	m_taskAdded.notify_all();
+
+	for (std::thread& thread : m_threads) {
+		thread.join();
+	}
+	m_threads.clear();
+}
+
+void WorkerPool::enqueue(std::function<void()> task)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (!m_isRunning) {
+			return;
+		}
+		m_tasks.push_back(std::move(task));
+	}
+	m_taskAdded.notify_one();
+}
+
+size_t WorkerPool::queueSize()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_tasks.size();
+}
+
+void WorkerPool::run()
+{
+	while (true) {
+		std::function<void()> task;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_taskAdded.wait(lock, [this] { return !m_isRunning || !m_tasks.empty(); });
+			if (!m_isRunning) {
+				return;
+			}
+			task = std::move(m_tasks.front());
+			m_tasks.pop_front();
+		}
+		task();
+	}
+}
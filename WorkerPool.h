@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2024 Nils Zweiling
+ *
+ * This file is part of fusecache which is released under the MIT license.
+ * See file LICENSE or go to https://github.com/zwodev/fusecache/tree/master/LICENSE
+ * for full license details.
+ */
+
+#pragma once
+
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <vector>
+#include <deque>
+
+class WorkerPool
+{
+
+public:
+    WorkerPool();
+    ~WorkerPool();
+
+    void start(int numThreads);
+    void stop();
+    void enqueue(std::function<void()> task);
+    size_t queueSize();
+
+private:
+    void run();
+
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_taskAdded;
+    std::deque<std::function<void()>> m_tasks;
+    std::vector<std::thread> m_threads;
+    bool m_isRunning = false;
+};
@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2024 Nils Zweiling
+ *
+ * This file is part of fusecache which is released under the MIT license.
+ * See file LICENSE or go to https://github.com/zwodev/fusecache/tree/master/LICENSE
+ * for full license details.
+ */
+
+#include "WriteOverlay.h"
+
+WriteOverlay::WriteOverlay()
+{
+}
+
+void WriteOverlay::splitPath(const std::string& path, std::string& dirPath, std::string& name)
+{
+	size_t pos = path.find_last_of('/');
+	dirPath = pos == 0 ? "/" : path.substr(0, pos);
+	name = path.substr(pos + 1);
+}
+
+void WriteOverlay::add(const std::string& path)
+{
+	std::string dirPath, name;
+	splitPath(path, dirPath, name);
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_dirs[dirPath].insert(name);
+}
+
+// Uploaded directories keep their children that are not uploaded yet.
+void WriteOverlay::remove(const std::string& path, bool withChildren)
+{
+	std::string dirPath, name;
+	splitPath(path, dirPath, name);
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto it = m_dirs.find(dirPath);
+	if (it != m_dirs.end()) {
+		it->second.erase(name);
+		if (it->second.empty()) {
+			m_dirs.erase(it);
+		}
+	}
+	if (withChildren) {
+		removeChildren(path);
+	}
+}
+
+void WriteOverlay::removeChildren(const std::string& dirPath)
+{
+	std::string prefix = dirPath + "/";
+	for (auto it = m_dirs.begin(); it != m_dirs.end();) {
+		if (it->first == dirPath || it->first.compare(0, prefix.size(), prefix) == 0) {
+			it = m_dirs.erase(it);
+		}
+		else {
+			++it;
+		}
+	}
+}
+
+void WriteOverlay::rename(const std::string& from, const std::string& to)
+{
+	std::string fromDir, fromName, toDir, toName;
+	splitPath(from, fromDir, fromName);
+	splitPath(to, toDir, toName);
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto it = m_dirs.find(fromDir);
+	if (it != m_dirs.end()) {
+		it->second.erase(fromName);
+		if (it->second.empty()) {
+			m_dirs.erase(it);
+		}
+	}
+	m_dirs[toDir].insert(toName);
+
+	// a renamed directory takes its children along
+	removeChildren(to);
+	std::string prefix = from + "/";
+	std::vector<std::pair<std::string, std::set<std::string>>> moved;
+	for (auto dir = m_dirs.begin(); dir != m_dirs.end();) {
+		if (dir->first == from || dir->first.compare(0, prefix.size(), prefix) == 0) {
+			moved.emplace_back(to + dir->first.substr(from.size()), std::move(dir->second));
+			dir = m_dirs.erase(dir);
+		}
+		else {
+			++dir;
+		}
+	}
+	for (auto& dir : moved) {
+		m_dirs[dir.first] = std::move(dir.second);
+	}
+}
+
+std::vector<std::string> WriteOverlay::children(const std::string& dirPath)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto it = m_dirs.find(dirPath);
+	if (it == m_dirs.end()) {
+		return std::vector<std::string>();
+	}
+	return std::vector<std::string>(it->second.begin(), it->second.end());
+}
@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2024 Nils Zweiling
+ *
+ * This file is part of fusecache which is released under the MIT license.
+ * See file LICENSE or go to https://github.com/zwodev/fusecache/tree/master/LICENSE
+ * for full license details.
+ */
+
+#pragma once
+
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Names of the files and directories that exist in the write cache but not
+// on the origin yet, by parent directory, so listings can include them. It
+// is filled from the pending uploads on startup, kept up to date by the
+// operations that create, remove or rename entries, and an entry is dropped
+// once it is uploaded.
+class WriteOverlay
+{
+
+public:
+    WriteOverlay();
+
+    void add(const std::string& path);
+    void remove(const std::string& path, bool withChildren = true);
+    void rename(const std::string& from, const std::string& to);
+    std::vector<std::string> children(const std::string& dirPath);
+
+private:
+    static void splitPath(const std::string& path, std::string& dirPath, std::string& name);
+    void removeChildren(const std::string& dirPath);
+
+private:
+    std::mutex m_mutex;
+    std::unordered_map<std::string, std::set<std::string>> m_dirs;
+};
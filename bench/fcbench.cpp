@@ -0,0 +1,588 @@
+/*
+ * Copyright (c) 2024 Nils Zweiling
+ *
+ * This file is part of fusecache which is released under the MIT license.
+ * See file LICENSE or go to https://github.com/zwodev/fusecache/tree/master/LICENSE
+ * for full license details.
+ */
+
+// Benchmark of a running fusecache mount. The test data is written straight
+// to the origin directory and then read through the mount, so every scenario
+// starts cold. Results are printed as JSON with one value per line, see
+// scripts/benchmark.sh for a complete run.
+//
+//   fcbench -mnt <mount> -orig <origin> [options] > results.json
+//   fcbench -compare <baseline.json> <results.json> [-tolerance <percent>]
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct Config
+{
+	std::string mnt;
+	std::string orig;
+	std::string scenarios = "open,seqread,randread,metadata,concurrent,writeback";
+	int files = 200;
+	int fileSize = 64;
+	int size = 256;
+	int randomReads = 10000;
+	int metaFiles = 100000;
+	int threads = 16;
+	int writes = 20;
+	int timeout = 30;
+};
+
+struct Result
+{
+	std::string name;
+	double value;
+};
+
+static Config s_config;
+static std::vector<Result> s_results;
+static std::string s_runDir;
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fail(const char* what, const std::string& path)
+{
+	fprintf(stderr, "fcbench: %s %s: %s\n", what, path.c_str(), strerror(errno));
+	exit(1);
+}
+
+static void addResult(const std::string& name, double value)
+{
+	s_results.push_back(Result { name, value });
+	fprintf(stderr, "  %-32s %12.1f\n", name.c_str(), value);
+}
+
+// Latencies are given in microseconds.
+static void addLatencies(const std::string& name, std::vector<double> seconds)
+{
+	if (seconds.empty()) {
+		return;
+	}
+
+	std::sort(seconds.begin(), seconds.end());
+	double sum = 0;
+	for (double value : seconds) {
+		sum += value;
+	}
+	auto quantile = [&seconds](double q) {
+		size_t rank = std::min(seconds.size() - 1, (size_t)(q * seconds.size()));
+		return seconds[rank] * 1e6;
+	};
+
+	addResult(name + "_mean_us", sum / seconds.size() * 1e6);
+	addResult(name + "_p50_us", quantile(0.5));
+	addResult(name + "_p90_us", quantile(0.9));
+	addResult(name + "_p99_us", quantile(0.99));
+	addResult(name + "_max_us", seconds.back() * 1e6);
+}
+
+static void makeDirs(const std::string& path)
+{
+	for (size_t pos = 1; pos != std::string::npos; pos = path.find('/', pos + 1)) {
+		std::string dir = path.substr(0, pos);
+		if (!dir.empty() && mkdir(dir.c_str(), 0755) == -1 && errno != EEXIST) {
+			fail("cannot create", dir);
+		}
+	}
+	if (mkdir(path.c_str(), 0755) == -1 && errno != EEXIST) {
+		fail("cannot create", path);
+	}
+}
+
+static void writeFile(const std::string& path, size_t size, uint32_t seed)
+{
+	int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fail("cannot create", path);
+	}
+
+	// random data, so that compression does not flatter the numbers
+	std::vector<uint32_t> buf(256 * 1024);
+	std::mt19937 rng(seed);
+	size_t done = 0;
+	while (done < size) {
+		for (uint32_t& word : buf) {
+			word = rng();
+		}
+		size_t length = std::min(size - done, buf.size() * sizeof(uint32_t));
+		if (write(fd, buf.data(), length) != (ssize_t)length) {
+			fail("cannot write", path);
+		}
+		done += length;
+	}
+	close(fd);
+}
+
+// Reads the whole file with 1 MB reads and returns the number of bytes.
+static size_t readFile(const std::string& path)
+{
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		fail("cannot open", path);
+	}
+
+	std::vector<char> buf(1024 * 1024);
+	size_t total = 0;
+	ssize_t nread;
+	while ((nread = read(fd, buf.data(), buf.size())) > 0) {
+		total += nread;
+	}
+	if (nread < 0) {
+		fail("cannot read", path);
+	}
+	close(fd);
+	return total;
+}
+
+static std::string origPath(const std::string& relPath)
+{
+	return s_config.orig + "/" + s_runDir + "/" + relPath;
+}
+
+static std::string mntPath(const std::string& relPath)
+{
+	return s_config.mnt + "/" + s_runDir + "/" + relPath;
+}
+
+// Open, read one byte and close, once while the files are only on the
+// origin and once more when they are cached.
+static void benchOpen()
+{
+	makeDirs(origPath("open"));
+	for (int i = 0; i < s_config.files; ++i) {
+		writeFile(origPath("open/" + std::to_string(i)), (size_t)s_config.fileSize * 1024, i);
+	}
+
+	for (const char* pass : { "cold", "warm" }) {
+		std::vector<double> latencies;
+		for (int i = 0; i < s_config.files; ++i) {
+			std::string path = mntPath("open/" + std::to_string(i));
+			char c;
+			double start = now();
+			int fd = open(path.c_str(), O_RDONLY);
+			if (fd < 0 || read(fd, &c, 1) != 1) {
+				fail("cannot read", path);
+			}
+			close(fd);
+			latencies.push_back(now() - start);
+		}
+		addLatencies(std::string("open_") + pass, latencies);
+	}
+}
+
+static void benchSeqRead()
+{
+	makeDirs(origPath("seq"));
+	size_t size = (size_t)s_config.size * 1024 * 1024;
+	writeFile(origPath("seq/data"), size, 1);
+
+	for (const char* pass : { "cold", "warm" }) {
+		double start = now();
+		size_t total = readFile(mntPath("seq/data"));
+		double seconds = now() - start;
+		if (total != size) {
+			errno = EIO;
+			fail("short read", mntPath("seq/data"));
+		}
+		addResult(std::string("seqread_") + pass + "_mbps", size / seconds / (1024 * 1024));
+	}
+}
+
+// 4 KB reads at random offsets, the cold pass starts with an uncached file.
+static void benchRandRead()
+{
+	makeDirs(origPath("rand"));
+	size_t size = (size_t)s_config.size * 1024 * 1024;
+	writeFile(origPath("rand/data"), size, 2);
+
+	std::mt19937_64 rng(3);
+	for (const char* pass : { "cold", "warm" }) {
+		std::string path = mntPath("rand/data");
+		std::vector<double> latencies;
+		char buf[4096];
+
+		double start = now();
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0) {
+			fail("cannot open", path);
+		}
+		for (int i = 0; i < s_config.randomReads; ++i) {
+			off_t offset = (rng() % (size / sizeof(buf))) * sizeof(buf);
+			double readStart = now();
+			if (pread(fd, buf, sizeof(buf), offset) != (ssize_t)sizeof(buf)) {
+				fail("cannot read", path);
+			}
+			latencies.push_back(now() - readStart);
+		}
+		close(fd);
+		double seconds = now() - start;
+
+		addResult(std::string("randread_") + pass + "_iops", s_config.randomReads / seconds);
+		addLatencies(std::string("randread_") + pass, latencies);
+	}
+}
+
+// Runs fn(i) for i in [0, count) on all threads and returns the wall time.
+template<typename Fn>
+static double runParallel(int count, Fn fn)
+{
+	std::atomic<int> next { 0 };
+	std::vector<std::thread> threads;
+	double start = now();
+	for (int t = 0; t < s_config.threads; ++t) {
+		threads.emplace_back([&] {
+			for (int i = next++; i < count; i = next++) {
+				fn(i);
+			}
+		});
+	}
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+	return now() - start;
+}
+
+// Empty files in directories of 1000, listed and then statted one by one.
+static void benchMetadata()
+{
+	const int filesPerDir = 1000;
+	int dirCount = (s_config.metaFiles + filesPerDir - 1) / filesPerDir;
+	for (int d = 0; d < dirCount; ++d) {
+		std::string dir = origPath("meta/" + std::to_string(d));
+		makeDirs(dir);
+		for (int i = d * filesPerDir; i < std::min(s_config.metaFiles, (d + 1) * filesPerDir); ++i) {
+			std::string path = dir + "/" + std::to_string(i);
+			int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (fd < 0) {
+				fail("cannot create", path);
+			}
+			close(fd);
+		}
+	}
+
+	for (const char* pass : { "cold", "warm" }) {
+		std::atomic<long> entries { 0 };
+		double seconds = runParallel(dirCount, [&](int d) {
+			std::string dir = mntPath("meta/" + std::to_string(d));
+			DIR* dp = opendir(dir.c_str());
+			if (!dp) {
+				fail("cannot list", dir);
+			}
+			while (readdir(dp)) {
+				entries++;
+			}
+			closedir(dp);
+		});
+		addResult(std::string("readdir_") + pass + "_entries_per_s", entries / seconds);
+
+		std::atomic<int> errors { 0 };
+		seconds = runParallel(s_config.metaFiles, [&](int i) {
+			struct stat st;
+			std::string path = mntPath("meta/" + std::to_string(i / filesPerDir) + "/" + std::to_string(i));
+			if (stat(path.c_str(), &st) == -1) {
+				errors++;
+			}
+		});
+		if (errors > 0) {
+			errno = ENOENT;
+			fail("stat failed for files in", mntPath("meta"));
+		}
+		addResult(std::string("stat_") + pass + "_ops_per_s", s_config.metaFiles / seconds);
+	}
+}
+
+// All threads open the same uncached file at once and read it completely.
+static void benchConcurrent()
+{
+	makeDirs(origPath("concurrent"));
+	size_t size = std::max((size_t)1, (size_t)s_config.size / 4) * 1024 * 1024;
+	writeFile(origPath("concurrent/data"), size, 4);
+
+	std::mutex mutex;
+	std::condition_variable go;
+	bool isReady = false;
+	std::vector<double> latencies(s_config.threads);
+	std::vector<std::thread> threads;
+	for (int t = 0; t < s_config.threads; ++t) {
+		threads.emplace_back([&, t] {
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				go.wait(lock, [&] { return isReady; });
+			}
+			double start = now();
+			if (readFile(mntPath("concurrent/data")) != size) {
+				errno = EIO;
+				fail("short read", mntPath("concurrent/data"));
+			}
+			latencies[t] = now() - start;
+		});
+	}
+
+	double start = now();
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		isReady = true;
+	}
+	go.notify_all();
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+
+	addResult("concurrent_wall_us", (now() - start) * 1e6);
+	addLatencies("concurrent_read", latencies);
+}
+
+// Time from closing a file written through the mount until it is complete
+// on the origin.
+static void benchWriteback()
+{
+	makeDirs(mntPath("writeback"));
+	const size_t size = 1024 * 1024;
+	std::vector<char> buf(size, 'w');
+
+	std::vector<double> latencies;
+	for (int i = 0; i < s_config.writes; ++i) {
+		std::string name = "writeback/" + std::to_string(i);
+		int fd = open(mntPath(name).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0 || write(fd, buf.data(), size) != (ssize_t)size) {
+			fail("cannot write", mntPath(name));
+		}
+		close(fd);
+
+		double start = now();
+		struct stat st;
+		while (stat(origPath(name).c_str(), &st) == -1 || (size_t)st.st_size != size) {
+			if (now() - start > s_config.timeout) {
+				errno = ETIMEDOUT;
+				fail("not uploaded", origPath(name));
+			}
+			usleep(1000);
+		}
+		latencies.push_back(now() - start);
+	}
+	addLatencies("writeback_visible", latencies);
+}
+
+static void printJson()
+{
+	time_t t = time(nullptr);
+	char date[32];
+	strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&t));
+
+	printf("{\n");
+	printf("  \"version\": 1,\n");
+	printf("  \"date\": \"%s\",\n", date);
+	printf("  \"config\": {\n");
+	printf("    \"scenarios\": \"%s\",\n", s_config.scenarios.c_str());
+	printf("    \"files\": %d,\n", s_config.files);
+	printf("    \"file_size_kb\": %d,\n", s_config.fileSize);
+	printf("    \"size_mb\": %d,\n", s_config.size);
+	printf("    \"random_reads\": %d,\n", s_config.randomReads);
+	printf("    \"meta_files\": %d,\n", s_config.metaFiles);
+	printf("    \"threads\": %d,\n", s_config.threads);
+	printf("    \"writes\": %d\n", s_config.writes);
+	printf("  },\n");
+	printf("  \"results\": {\n");
+	for (size_t i = 0; i < s_results.size(); ++i) {
+		printf("    \"%s\": %.3f%s\n", s_results[i].name.c_str(), s_results[i].value, i + 1 < s_results.size() ? "," : "");
+	}
+	printf("  }\n");
+	printf("}\n");
+}
+
+// Reads the "results" object of a file written by printJson.
+static bool loadResults(const char* filename, std::map<std::string, double>& results)
+{
+	FILE* file = fopen(filename, "r");
+	if (!file) {
+		return false;
+	}
+
+	char line[512];
+	bool inResults = false;
+	while (fgets(line, sizeof(line), file)) {
+		if (strstr(line, "\"results\"")) {
+			inResults = true;
+			continue;
+		}
+		char name[256];
+		double value;
+		if (inResults && sscanf(line, " \"%255[^\"]\": %lf", name, &value) == 2) {
+			results[name] = value;
+		}
+	}
+	fclose(file);
+	return true;
+}
+
+// Latencies are better when lower, throughputs when higher. Returns 1 if
+// any result got worse by more than the tolerance.
+static int compare(const char* baselineFile, const char* resultsFile, double tolerance)
+{
+	std::map<std::string, double> baseline;
+	std::map<std::string, double> results;
+	if (!loadResults(baselineFile, baseline) || !loadResults(resultsFile, results)) {
+		fprintf(stderr, "fcbench: cannot read results\n");
+		return 2;
+	}
+
+	int regressions = 0;
+	for (const auto& [name, value] : results) {
+		auto it = baseline.find(name);
+		if (it == baseline.end() || it->second == 0) {
+			continue;
+		}
+
+		bool lowerIsBetter = name.size() > 3 && name.compare(name.size() - 3, 3, "_us") == 0;
+		double change = (value - it->second) / it->second * 100.0;
+		bool isRegression = lowerIsBetter ? change > tolerance : -change > tolerance;
+		printf("%-32s %12.1f %12.1f %+8.1f%%%s\n", name.c_str(), it->second, value, change, isRegression ? "  REGRESSION" : "");
+		if (isRegression) {
+			regressions++;
+		}
+	}
+	return regressions > 0 ? 1 : 0;
+}
+
+static void usage()
+{
+	fprintf(stderr,
+		"usage: fcbench -mnt <mount> -orig <origin> [options]\n"
+		"       fcbench -compare <baseline.json> <results.json> [-tolerance <percent>]\n"
+		"options:\n"
+		"  -scenarios <list>   comma separated: open,seqread,randread,metadata,concurrent,writeback\n"
+		"  -files <n>          files for the open test (default 200)\n"
+		"  -filesize <kb>      size of those files (default 64)\n"
+		"  -size <mb>          size of the read test files (default 256)\n"
+		"  -randomreads <n>    4 KB reads per random read pass (default 10000)\n"
+		"  -metafiles <n>      files for the metadata test (default 100000)\n"
+		"  -threads <n>        threads for the metadata and concurrent tests (default 16)\n"
+		"  -writes <n>         files for the write-back test (default 20)\n"
+		"  -timeout <s>        maximum wait for an upload (default 30)\n");
+}
+
+int main(int argc, char* argv[])
+{
+	double tolerance = 10.0;
+	const char* compareFiles[2] = { nullptr, nullptr };
+
+	for (int i = 1; i < argc; ++i) {
+		std::string arg(argv[i]);
+		bool hasValue = i + 1 < argc;
+		if (arg == "-compare" && i + 2 < argc) {
+			compareFiles[0] = argv[++i];
+			compareFiles[1] = argv[++i];
+		}
+		else if (arg == "-tolerance" && hasValue) {
+			tolerance = atof(argv[++i]);
+		}
+		else if (arg == "-mnt" && hasValue) {
+			s_config.mnt = argv[++i];
+		}
+		else if (arg == "-orig" && hasValue) {
+			s_config.orig = argv[++i];
+		}
+		else if (arg == "-scenarios" && hasValue) {
+			s_config.scenarios = argv[++i];
+		}
+		else if (arg == "-files" && hasValue) {
+			s_config.files = atoi(argv[++i]);
+		}
+		else if (arg == "-filesize" && hasValue) {
+			s_config.fileSize = atoi(argv[++i]);
+		}
+		else if (arg == "-size" && hasValue) {
+			s_config.size = atoi(argv[++i]);
+		}
+		else if (arg == "-randomreads" && hasValue) {
+			s_config.randomReads = atoi(argv[++i]);
+		}
+		else if (arg == "-metafiles" && hasValue) {
+			s_config.metaFiles = atoi(argv[++i]);
+		}
+		else if (arg == "-threads" && hasValue) {
+			s_config.threads = std::max(1, atoi(argv[++i]));
+		}
+		else if (arg == "-writes" && hasValue) {
+			s_config.writes = atoi(argv[++i]);
+		}
+		else if (arg == "-timeout" && hasValue) {
+			s_config.timeout = atoi(argv[++i]);
+		}
+		else {
+			usage();
+			return 2;
+		}
+	}
+
+	if (compareFiles[0]) {
+		return compare(compareFiles[0], compareFiles[1], tolerance);
+	}
+	if (s_config.mnt.empty() || s_config.orig.empty()) {
+		usage();
+		return 2;
+	}
+
+	// every run works in its own directory, so nothing is cached from earlier runs
+	s_runDir = "fcbench-" + std::to_string(getpid()) + "-" + std::to_string(time(nullptr));
+	makeDirs(s_config.orig + "/" + s_runDir);
+
+	std::string scenarios = "," + s_config.scenarios + ",";
+	auto isEnabled = [&scenarios](const char* name) {
+		return scenarios.find(std::string(",") + name + ",") != std::string::npos;
+	};
+
+	if (isEnabled("open")) {
+		fprintf(stderr, "open\n");
+		benchOpen();
+	}
+	if (isEnabled("seqread")) {
+		fprintf(stderr, "seqread\n");
+		benchSeqRead();
+	}
+	if (isEnabled("randread")) {
+		fprintf(stderr, "randread\n");
+		benchRandRead();
+	}
+	if (isEnabled("metadata")) {
+		fprintf(stderr, "metadata\n");
+		benchMetadata();
+	}
+	if (isEnabled("concurrent")) {
+		fprintf(stderr, "concurrent\n");
+		benchConcurrent();
+	}
+	if (isEnabled("writeback")) {
+		fprintf(stderr, "writeback\n");
+		benchWriteback();
+	}
+
+	printJson();
+	return 0;
+}
@@ -15,6 +15,7 @@
 #include <stdbool.h>
 #include <fuse.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -22,62 +23,89 @@
 #include <dirent.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <signal.h>
 
 #include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <unordered_set>
 
 #include "Helper.h"
 #include "Log.h"
 #include "CacheManager.h"
+#include "ControlServer.h"
+#include "Signature.h"
+#include "Metrics.h"
 
 static fuse_fill_dir_flags fill_dir_plus = (fuse_fill_dir_flags ) 0;
 
 CacheManager* cache_manager = nullptr;
 Log* g_log = nullptr;
 
+static double entry_timeout = 0;
+static double attr_timeout = 0;
+static double negative_timeout = 0;
+
 static void *fc_init(struct fuse_conn_info *conn,
 		      struct fuse_config *cfg)
 {
-	(void) conn;
+	// move file data between the kernel and the cache files without copying it through userspace
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+
 	cfg->use_ino = 1;
-	cfg->entry_timeout = 0;
-	cfg->attr_timeout = 0;
-	cfg->negative_timeout = 0;
+	cfg->entry_timeout = entry_timeout;
+	cfg->attr_timeout = attr_timeout;
+	cfg->negative_timeout = negative_timeout;
 
 	return NULL;
 }
 
+static void invalidate_stat(const char *path)
+{
+	std::string file_path(path);
+	std::string parent_path = std::filesystem::path(file_path).parent_path().u8string();
+	cache_manager->statCache().invalidate(file_path);
+	cache_manager->statCache().invalidate(parent_path);
+	cache_manager->dirCache().invalidate(file_path);
+	cache_manager->dirCache().invalidate(parent_path);
+}
+
 static int fc_getattr(const char *path, struct stat *stbuf,
 		       struct fuse_file_info *fi)
 {
-	//g_log->debug(formatStr("fc_getattr: %s", path));
+	//g_log->debug("fc_getattr: %s", path);
 
 	(void) fi;
 	int res;
 
-	std::string orig_path = cache_manager->origFilePath(path);
-	res = lstat(orig_path.c_str(), stbuf);
-	if (res == -1) {
-		std::string cache_path = cache_manager->writeCacheFilePath(path);
-		res = lstat(cache_path.c_str(), stbuf);
-	}
+	int err;
+	if (cache_manager->statCache().lookup(path, stbuf, err))
+		return -err;
 
+	res = cache_manager->origin().stat(path, stbuf);
 	if (res == -1)
-		return -errno;
+		res = fstatat(cache_manager->writeCacheDirFd(), relativePath(path), stbuf, AT_SYMLINK_NOFOLLOW);
+
+	if (res == -1) {
+		err = errno;
+		if (err == ENOENT)
+			cache_manager->statCache().putNegative(path, err);
+		return -err;
+	}
 
+	cache_manager->statCache().put(path, *stbuf);
 	return 0;
 }
 
 static int fc_access(const char *path, int mask)
 {
-	g_log->debug(formatStr("fc_access: %s", path));
+	g_log->debug("fc_access: %s", path);
 	
 	int res;
-	std::string orig_path = cache_manager->origFilePath(path);
-	res = access(orig_path.c_str(), mask);
-	if (res == -1) {
-		std::string cache_path = cache_manager->writeCacheFilePath(path);
-		res = access(cache_path.c_str(), mask);
-	}
+	res = cache_manager->origin().access(path, mask);
+	if (res == -1)
+		res = faccessat(cache_manager->writeCacheDirFd(), relativePath(path), mask, 0);
 
 	if (res == -1)
 		return -errno;
@@ -85,71 +113,174 @@ static int fc_access(const char *path, int mask)
 	return 0;
 }
 
+static DIR *open_dir(int root_fd, const char *path)
+{
+	int fd = openat(root_fd, relativePath(path), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	DIR *dp = fdopendir(fd);
+	if (dp == NULL) {
+		int saved_errno = errno;
+		close(fd);
+		errno = saved_errno;
+	}
+	return dp;
+}
+
+static DirListing read_dir_listing(const char *path, DIR *dp, int& err)
+{
+	struct dirent *de;
+
+	if (dp == NULL) {
+		err = errno;
+		return nullptr;
+	}
+
+	std::string dir_path(path);
+	if (dir_path.back() != '/')
+		dir_path += "/";
+
+	// one pass over the origin directory collects the attributes of every entry
+	std::shared_ptr<std::vector<DirEntry>> entries = std::make_shared<std::vector<DirEntry>>();
+	while ((de = readdir(dp)) != NULL) {
+		// uploads in progress and the signatures on the origin are not part of the listing
+		if (SyncEngine::isTempFile(de->d_name))
+			continue;
+		if (dir_path == "/" && Signature::isSigPath(dir_path + de->d_name))
+			continue;
+
+		DirEntry entry;
+		entry.name = de->d_name;
+		entry.hasStat = fstatat(dirfd(dp), de->d_name, &entry.st, AT_SYMLINK_NOFOLLOW) == 0;
+		if (!entry.hasStat) {
+			memset(&entry.st, 0, sizeof(entry.st));
+			entry.st.st_ino = de->d_ino;
+			entry.st.st_mode = de->d_type << 12;
+		}
+		else if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0) {
+			cache_manager->statCache().put(dir_path + entry.name, entry.st);
+		}
+		entries->push_back(std::move(entry));
+	}
+
+	closedir(dp);
+	return entries;
+}
+
 static int fc_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 		       off_t offset, struct fuse_file_info *fi,
 		       enum fuse_readdir_flags flags)
 {
-	//g_log->debug(formatStr("fc_readdir: %s", path));
-
-	DIR *dp;
-	struct dirent *de;
+	//g_log->debug("fc_readdir: %s", path);
 
 	(void) offset;
 	(void) fi;
 	(void) flags;
 
-	std::string orig_path = cache_manager->origFilePath(path).c_str();
-
-	dp = opendir(orig_path.c_str());
-	if (dp == NULL)
+	int err = 0;
+	struct stat dir_st;
+	if (cache_manager->statCache().lookup(path, &dir_st, err)) {
+		if (err != 0)
+			return -err;
+	}
+	else if (cache_manager->origin().stat(path, &dir_st) == 0) {
+		cache_manager->statCache().put(path, dir_st);
+	}
+	else if (errno != ENOENT || fstatat(cache_manager->writeCacheDirFd(), relativePath(path), &dir_st, AT_SYMLINK_NOFOLLOW) == -1) {
 		return -errno;
+	}
+
+	DirListing entries = cache_manager->dirCache().lookup(path, dir_st);
+	if (!entries) {
+		entries = read_dir_listing(path, cache_manager->origin().openDir(path), err);
+		if (entries)
+			cache_manager->dirCache().put(path, dir_st, entries);
+	}
+
+	// directories created through the mount may not exist on the origin yet
+	if (!entries && err == ENOENT && !cache_manager->isReadCacheOnly())
+		entries = read_dir_listing(path, open_dir(cache_manager->writeCacheDirFd(), path), err);
+	if (!entries)
+		return -err;
+
+	for (const DirEntry& entry : *entries) {
+		fuse_fill_dir_flags fill_flags = entry.hasStat ? fill_dir_plus : (fuse_fill_dir_flags) 0;
+		if (filler(buf, entry.name.c_str(), &entry.st, 0, fill_flags))
+			return 0;
+	}
+
+	// add files that only exist in the write cache so far
+	std::vector<std::string> overlay = cache_manager->writeOverlay().children(path);
+	if (overlay.empty())
+		return 0;
+
+	std::unordered_set<std::string> names;
+	for (const DirEntry& entry : *entries)
+		names.insert(entry.name);
+
+	std::string dir_path(path);
+	if (dir_path.back() != '/')
+		dir_path += "/";
+
+	for (const std::string& name : overlay) {
+		if (names.count(name) > 0)
+			continue;
 
-	while ((de = readdir(dp)) != NULL) {
 		struct stat st;
-		memset(&st, 0, sizeof(st));
-		st.st_ino = de->d_ino;
-		st.st_mode = de->d_type << 12;
-		if (filler(buf, de->d_name, &st, 0, fill_dir_plus))
+		std::string child_path = dir_path + name;
+		if (fstatat(cache_manager->writeCacheDirFd(), relativePath(child_path.c_str()), &st, AT_SYMLINK_NOFOLLOW) == -1) {
+			cache_manager->writeOverlay().remove(dir_path + name);
+			continue;
+		}
+		if (filler(buf, name.c_str(), &st, 0, fill_dir_plus))
 			break;
 	}
 
-	closedir(dp);
 	return 0;
 }
 
 static int fc_mkdir(const char *path, mode_t mode)
 {
-	g_log->debug(formatStr("fc_mkdir: %s", path));
+	g_log->debug("fc_mkdir: %s", path);
 
-	std::string cache_path = cache_manager->writeCacheFilePath(path);
-	int res = mkdir(cache_path.c_str(), mode);
+	int res = mkdirat(cache_manager->writeCacheDirFd(), relativePath(path), mode);
 	if (res == -1)
 		return -errno;
 
+	cache_manager->writeOverlay().add(path);
+	cache_manager->markDirty(path);
+	invalidate_stat(path);
+
 	return 0;
 }
 
 static int fc_unlink(const char *path)
 {
-	g_log->debug(formatStr("fc_unlink: %s", path));
+	g_log->debug("fc_unlink: %s", path);
 
-	int res = unlink(cache_manager->writeCacheFilePath(path).c_str());
+	int res = unlinkat(cache_manager->writeCacheDirFd(), relativePath(path), 0);
 	if (res == -1)
 		return -errno;
 
+	cache_manager->writeOverlay().remove(path);
+	invalidate_stat(path);
+
 	return 0;
 }
 
 static int fc_rmdir(const char *path)
 {
-	g_log->debug(formatStr("fc_rmdir: %s", path));
+	g_log->debug("fc_rmdir: %s", path);
 	
 	int res;
-	std::string orig_path = cache_manager->origFilePath(path);
-	res = rmdir(orig_path.c_str());
+	res = cache_manager->origin().rmdir(path);
 	if (res == -1)
 		return -errno;
 
+	cache_manager->writeOverlay().remove(path);
+	invalidate_stat(path);
+
 	return 0;
 }
 
@@ -158,13 +289,16 @@ static int fc_rename(const char *from, const char *to, unsigned int flags)
 	if (flags)
 		return -EINVAL;
 
-	std::string cache_path_from = cache_manager->writeCacheFilePath(from);
-	std::string cache_path_to = cache_manager->writeCacheFilePath(to);
-
-	int res = rename(cache_path_from.c_str(), cache_path_to.c_str());
+	int root_fd = cache_manager->writeCacheDirFd();
+	int res = renameat(root_fd, relativePath(from), root_fd, relativePath(to));
 	if (res == -1)
 		return -errno;
 
+	cache_manager->writeOverlay().rename(from, to);
+	cache_manager->markDirty(to);
+	invalidate_stat(from);
+	invalidate_stat(to);
+
 	return 0;
 }
 
@@ -173,11 +307,33 @@ static int fc_chmod(const char *path, mode_t mode,
 {
 	(void) fi;
 
-	std::string cache_path = cache_manager->writeCacheFilePath(path);
-	int res = chmod(cache_path.c_str(), mode);
+	if (cache_manager->unshareFile(path) == -1)
+		return -EIO;
+	int res = fchmodat(cache_manager->writeCacheDirFd(), relativePath(path), mode, 0);
 	if (res == -1)
 		return -errno;
 
+	cache_manager->markDirty(path);
+	invalidate_stat(path);
+
+	return 0;
+}
+
+static int fc_utimens(const char *path, const struct timespec tv[2],
+		       struct fuse_file_info *fi)
+{
+	(void) fi;
+
+	// a file linked to the content store shares its times with every copy
+	if (cache_manager->unshareFile(path) == -1)
+		return -EIO;
+	int res = utimensat(cache_manager->writeCacheDirFd(), relativePath(path), tv, AT_SYMLINK_NOFOLLOW);
+	if (res == -1)
+		return -errno;
+
+	cache_manager->markDirty(path);
+	invalidate_stat(path);
+
 	return 0;
 }
 
@@ -185,17 +341,18 @@ static int fc_chown(const char *path, uid_t uid, gid_t gid, struct fuse_file_inf
 {
 	(void) fi;
 
-	std::string orig_path = cache_manager->origFilePath(path);
-	int res = lchown(orig_path.c_str(), uid, gid);
+	int res = cache_manager->origin().chown(path, uid, gid);
 	if (res == -1)
 		return -errno;
 
+	invalidate_stat(path);
+
 	return 0;
 }
 
 static int fc_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
-	g_log->debug(formatStr("fc_create: %s", path));
+	g_log->debug("fc_create: %s", path);
 	
 	int res = cache_manager->createFile(path, mode, fi->flags);
 	
@@ -203,17 +360,20 @@ static int fc_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 	 	return res;
 	}
 
+	cache_manager->writeOverlay().add(path);
+	invalidate_stat(path);
+
 	fi->fh = res;
 	return 0;
 }
 
 static int fc_open(const char *path, struct fuse_file_info *fi)
 {
-	g_log->debug(formatStr("fc_open: %s", path));
+	g_log->debug("fc_open: %s", path);
 
 	int res = cache_manager->openFile(path, fi->flags);
 	if (res < 0) {
-		g_log->debug(formatStr("ERROR OPENING FILE - FLAGS: %d", fi->flags));
+		g_log->debug("ERROR OPENING FILE - FLAGS: %d", fi->flags);
 	 	return res;
 	}
 
@@ -225,24 +385,91 @@ static int fc_open(const char *path, struct fuse_file_info *fi)
 static int fc_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
 	int res = cache_manager->readFile(fi->fh, buf, size, offset);
+	if (res > 0)
+		Metrics::count(METRIC_READ_BYTES, res);
 
 	return res;
 }
 
+static int fc_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	// compressed blocks are decompressed into memory
+	if (cache_manager->isCompressed(fi->fh)) {
+		struct fuse_bufvec *src = (struct fuse_bufvec *) malloc(sizeof(struct fuse_bufvec));
+		void *mem = malloc(size);
+		if (src == NULL || mem == NULL) {
+			free(src);
+			free(mem);
+			return -ENOMEM;
+		}
+
+		int res = cache_manager->readFile(fi->fh, (char *) mem, size, offset);
+		if (res < 0) {
+			free(src);
+			free(mem);
+			return res;
+		}
+
+		*src = FUSE_BUFVEC_INIT((size_t) res);
+		src->buf[0].mem = mem;
+		*bufp = src;
+		Metrics::count(METRIC_READ_BYTES, res);
+		return 0;
+	}
+
+	int res = cache_manager->prepareRead(fi->fh, size, offset);
+	if (res < 0)
+		return res;
+	size_t readSize = res;
+
+	// libfuse splices the data straight from the cache file
+	struct fuse_bufvec *src = (struct fuse_bufvec *) malloc(sizeof(struct fuse_bufvec));
+	if (src == NULL)
+		return -ENOMEM;
+
+	*src = FUSE_BUFVEC_INIT(size);
+	src->buf[0].flags = (fuse_buf_flags) (FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+	src->buf[0].fd = fi->fh;
+	src->buf[0].pos = offset;
+
+	// libfuse copies the data after we return and stops at the end of the file
+	*bufp = src;
+	Metrics::count(METRIC_READ_BYTES, readSize);
+	return 0;
+}
+
+static int fc_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi)
+{
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(buf));
+	dst.buf[0].flags = (fuse_buf_flags) (FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+	dst.buf[0].fd = fi->fh;
+	dst.buf[0].pos = offset;
+
+	ssize_t res = fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
+	if (res >= 0) {
+		cache_manager->markWritten(fi->fh, offset + res);
+		Metrics::count(METRIC_WRITE_BYTES, res);
+	}
+	cache_manager->statCache().invalidate(path);
+	return res;
+}
+
 static int fc_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
 	int res = cache_manager->writeFile(fi->fh, buf, size, offset);
+	if (res > 0)
+		Metrics::count(METRIC_WRITE_BYTES, res);
+	cache_manager->statCache().invalidate(path);
 	return res;
 }
 
 static int fc_statfs(const char *path, struct statvfs *stbuf)
 {
-	g_log->debug(formatStr("fc_statfs: %s", path));
+	g_log->debug("fc_statfs: %s", path);
 
 	int res;
 
-	std::string orig_path = cache_manager->origFilePath(path);
-	res = statvfs(orig_path.c_str(), stbuf);
+	res = cache_manager->origin().statfs(stbuf);
 	if (res == -1)
 		return -errno;
 
@@ -251,11 +478,13 @@ static int fc_statfs(const char *path, struct statvfs *stbuf)
 
 static int fc_release(const char *path, struct fuse_file_info *fi)
 {
-	g_log->debug(formatStr("fc_release: %s", path));
+	g_log->debug("fc_release: %s", path);
 
 	(void) path;
 	
 	int res = cache_manager->closeFile(fi->fh);
+	if ((fi->flags & O_ACCMODE) != O_RDONLY)
+		cache_manager->statCache().invalidate(path);
 	return res;
 }
 
@@ -264,10 +493,8 @@ static off_t fc_lseek(const char *path, off_t off, int whence, struct fuse_file_
 	int fd;
 	off_t res;
 
-	std::string orig_path = cache_manager->origFilePath(path);
-
 	if (fi == NULL)
-		fd = open(orig_path.c_str(), O_RDONLY);
+		fd = cache_manager->origin().openFile(path, O_RDONLY);
 	else
 		fd = fi->fh;
 
@@ -286,18 +513,31 @@ static off_t fc_lseek(const char *path, off_t off, int whence, struct fuse_file_
 static int fc_truncate(const char *path, off_t size,
                         struct fuse_file_info *fi)
 {
-	g_log->debug(formatStr("fc_truncate: %s", path));
+	g_log->debug("fc_truncate: %s", path);
 	
-	std::string cache_path = cache_manager->writeCacheFilePath(path);
-
 	int res;
-	if (fi != NULL)
+	if (fi == NULL && cache_manager->unshareFile(path) == -1)
+		return -EIO;
+	if (fi != NULL) {
 		res = ftruncate(fi->fh, size);
-	else
-		res = truncate(cache_path.c_str(), size);
+		if (res == 0) {
+			cache_manager->markTruncated(fi->fh, size);
+		}
+	}
+	else {
+		int fd = openat(cache_manager->writeCacheDirFd(), relativePath(path), O_WRONLY | O_CLOEXEC);
+		res = fd < 0 ? -1 : ftruncate(fd, size);
+		if (fd >= 0) {
+			int err = errno;
+			close(fd);
+			errno = err;
+		}
+	}
 	if (res == -1)
 		return -errno;
- 
+
+	cache_manager->markDirty(path);
+	invalidate_stat(path);
 
     return 0;
 }
@@ -305,7 +545,7 @@ static int fc_truncate(const char *path, off_t size,
 static int fc_fsync(const char *path, int isdatasync,
                      struct fuse_file_info *fi)
 {
-	g_log->debug(formatStr("fc_sync: %s", path));
+	g_log->debug("fc_sync: %s", path);
 
 	(void) path;
 	(void) isdatasync;
@@ -313,26 +553,227 @@ static int fc_fsync(const char *path, int isdatasync,
 	return 0;
 }
 
+static volatile sig_atomic_t prefetch_interrupted = 0;
+
+static void on_prefetch_interrupt(int signum)
+{
+	(void) signum;
+	prefetch_interrupted = 1;
+}
+
+// A manifest is a file with one path, directory or glob per line,
+// '-' to read it from stdin, or a single directory or glob.
+static bool read_manifest(const std::string& source, std::string& body)
+{
+	std::error_code ec;
+	if (source == "-") {
+		std::stringstream ss;
+		ss << std::cin.rdbuf();
+		body = ss.str();
+		return true;
+	}
+	if (std::filesystem::is_regular_file(source, ec)) {
+		std::ifstream file(source);
+		if (!file) {
+			return false;
+		}
+		std::stringstream ss;
+		ss << file.rdbuf();
+		body = ss.str();
+		return true;
+	}
+	if (std::filesystem::exists(source, ec)) {
+		body = std::filesystem::absolute(source, ec).u8string() + "\n";
+		return true;
+	}
+
+	body = source + "\n";
+	return true;
+}
+
+static std::string format_duration(long long seconds)
+{
+	if (seconds < 0) {
+		return "--:--:--";
+	}
+	return formatStr("%02lld:%02lld:%02lld", seconds / 3600, (seconds / 60) % 60, seconds % 60);
+}
+
+static std::string format_bytes(unsigned long long bytes)
+{
+	if (bytes >= 1000000000ULL) {
+		return formatStr("%.1f GB", bytes / 1e9);
+	}
+	return formatStr("%.1f MB", bytes / 1e6);
+}
+
+static int send_control(const std::string& socket_path, const std::string& request)
+{
+	std::string response;
+	if (ControlServer::request(socket_path, request, response) == -1) {
+		fprintf(stderr, "Cannot connect to %s: %s\n", socket_path.c_str(), strerror(errno));
+		return 1;
+	}
+	printf("%s", response.c_str());
+	return response.compare(0, 5, "error") == 0 ? 1 : 0;
+}
+
+// Submits a prefetch job to the running instance and follows it until it is done.
+static int prefetch(const std::string& socket_path, const std::string& source, int priority)
+{
+	std::string body;
+	if (!read_manifest(source, body)) {
+		fprintf(stderr, "Cannot read manifest: %s\n", source.c_str());
+		return 1;
+	}
+
+	std::string response;
+	int id = 0;
+	std::string request = formatStr("prefetch %d\n", priority) + body;
+	if (ControlServer::request(socket_path, request, response) == -1) {
+		fprintf(stderr, "Cannot connect to %s: %s\n", socket_path.c_str(), strerror(errno));
+		return 1;
+	}
+	if (sscanf(response.c_str(), "ok %d", &id) != 1) {
+		fprintf(stderr, "%s", response.c_str());
+		return 1;
+	}
+
+	signal(SIGINT, on_prefetch_interrupt);
+	signal(SIGTERM, on_prefetch_interrupt);
+
+	while (true) {
+		if (prefetch_interrupted) {
+			std::string ignored;
+			ControlServer::request(socket_path, formatStr("cancel %d\n", id), ignored);
+		}
+
+		response.clear();
+		if (ControlServer::request(socket_path, formatStr("status %d\n", id), response) == -1) {
+			fprintf(stderr, "\nLost connection to %s\n", socket_path.c_str());
+			return 1;
+		}
+
+		char state[32] = {};
+		int job_id, job_priority;
+		size_t files_done, files_total, files_failed;
+		unsigned long long bytes_done, bytes_total;
+		double rate;
+		long long eta;
+		int n = sscanf(response.c_str(), "job %d %31s priority %d files %zu/%zu failed %zu bytes %llu/%llu rate %lf eta %lld",
+			&job_id, state, &job_priority, &files_done, &files_total, &files_failed, &bytes_done, &bytes_total, &rate, &eta);
+		if (n != 10) {
+			fprintf(stderr, "\nUnknown job %d\n", id);
+			return 1;
+		}
+
+		printf("\r\033[Kjob %d %s: %zu/%zu files, %s of %s, %.1f MB/s, eta %s", job_id, state, files_done, files_total,
+			format_bytes(bytes_done).c_str(), format_bytes(bytes_total).c_str(), rate, format_duration(eta).c_str());
+		fflush(stdout);
+
+		if (strcmp(state, "done") == 0 || strcmp(state, "cancelled") == 0) {
+			printf("\n");
+			if (files_failed > 0) {
+				fprintf(stderr, "%zu files failed, see the log for details\n", files_failed);
+			}
+			return (strcmp(state, "done") == 0 && files_failed == 0) ? 0 : 1;
+		}
+
+		sleep(1);
+	}
+}
+
+// Writes the delta transfer signatures of every file below dir and removes
+// the ones whose file is gone. Meant to run on the host that serves the origin.
+static int make_signatures(const std::string& dir)
+{
+	std::error_code ec;
+	std::string root = std::filesystem::absolute(dir, ec).u8string();
+	while (root.size() > 1 && root.back() == '/')
+		root.pop_back();
+
+	size_t written = 0;
+	size_t current = 0;
+	size_t failed = 0;
+	auto options = std::filesystem::directory_options::skip_permission_denied;
+	for (auto it = std::filesystem::recursive_directory_iterator(root, options, ec);
+		it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+		if (ec)
+			break;
+
+		std::string file_path = it->path().u8string().substr(root.size());
+		if (Signature::isSigPath(file_path)) {
+			it.disable_recursion_pending();
+			continue;
+		}
+
+		struct stat sb;
+		std::string name = it->path().filename().u8string();
+		if (lstat(it->path().c_str(), &sb) == -1 || !S_ISREG(sb.st_mode) || SyncEngine::isTempFile(name))
+			continue;
+
+		Signature sig;
+		std::string sig_path = Signature::sigPath(root, file_path);
+		if (sig.load(sig_path) == 0 && sig.matches(sb)) {
+			current++;
+			continue;
+		}
+
+		int fd = open(it->path().c_str(), O_RDONLY);
+		if (fd < 0 || sig.compute(fd, Signature::DEFAULT_BLOCK_SIZE) == -1 || sig.save(sig_path) == -1) {
+			fprintf(stderr, "Cannot write signature of %s: %s\n", file_path.c_str(), strerror(errno));
+			failed++;
+		}
+		else {
+			written++;
+		}
+		if (fd >= 0)
+			close(fd);
+	}
+
+	size_t removed = 0;
+	std::string sig_dir = Signature::sigDir(root);
+	for (auto it = std::filesystem::recursive_directory_iterator(sig_dir, options, ec);
+		it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+		if (ec)
+			break;
+
+		std::string sig_path = it->path().u8string();
+		if (sig_path.size() < 4 || sig_path.compare(sig_path.size() - 4, 4, ".sig") != 0)
+			continue;
+
+		std::string file_path = root + sig_path.substr(sig_dir.size(), sig_path.size() - sig_dir.size() - 4);
+		if (access(file_path.c_str(), F_OK) == -1 && errno == ENOENT && unlink(sig_path.c_str()) == 0)
+			removed++;
+	}
+
+	printf("%zu signatures written, %zu up to date, %zu removed, %zu failed\n", written, current, removed, failed);
+	return failed > 0 ? 1 : 0;
+}
+
 static void assign_operations(fuse_operations &op) {
 	op.init     = fc_init;
-	op.getattr	= fc_getattr;
-	op.access	= fc_access;
-	op.readdir	= fc_readdir;
-	op.mkdir	= fc_mkdir;
-	op.unlink	= fc_unlink;
-	op.rmdir	= fc_rmdir;
-	op.rename	= fc_rename;
-	op.chmod	= fc_chmod;
-	op.chown	= fc_chown;
-	op.open		= fc_open;
-	op.create 	= fc_create;
-	op.read		= fc_read;
-	op.write	= fc_write;
-	op.statfs	= fc_statfs;
-	op.release	= fc_release;
-	op.lseek	= fc_lseek;
-	op.truncate = fc_truncate;
-	op.fsync	= fc_fsync;
+	op.getattr	= TimedOp<OP_GETATTR, fc_getattr>::call;
+	op.access	= TimedOp<OP_ACCESS, fc_access>::call;
+	op.readdir	= TimedOp<OP_READDIR, fc_readdir>::call;
+	op.mkdir	= TimedOp<OP_MKDIR, fc_mkdir>::call;
+	op.unlink	= TimedOp<OP_UNLINK, fc_unlink>::call;
+	op.rmdir	= TimedOp<OP_RMDIR, fc_rmdir>::call;
+	op.rename	= TimedOp<OP_RENAME, fc_rename>::call;
+	op.chmod	= TimedOp<OP_CHMOD, fc_chmod>::call;
+	op.chown	= TimedOp<OP_CHOWN, fc_chown>::call;
+	op.open		= TimedOp<OP_OPEN, fc_open>::call;
+	op.create 	= TimedOp<OP_CREATE, fc_create>::call;
+	op.read		= TimedOp<OP_READ, fc_read>::call;
+	op.write	= TimedOp<OP_WRITE, fc_write>::call;
+	op.read_buf	= TimedOp<OP_READ, fc_read_buf>::call;
+	op.write_buf	= TimedOp<OP_WRITE, fc_write_buf>::call;
+	op.statfs	= TimedOp<OP_STATFS, fc_statfs>::call;
+	op.release	= TimedOp<OP_RELEASE, fc_release>::call;
+	op.lseek	= TimedOp<OP_LSEEK, fc_lseek>::call;
+	op.truncate = TimedOp<OP_TRUNCATE, fc_truncate>::call;
+	op.fsync	= TimedOp<OP_FSYNC, fc_fsync>::call;
+	op.utimens	= TimedOp<OP_UTIMENS, fc_utimens>::call;
 }
 
 int main(int argc, char *argv[])
@@ -348,6 +789,14 @@ int main(int argc, char *argv[])
 
 	std::string name;
 	bool logToCommandline = false;
+	std::string prefetchSource;
+	int prefetchPriority = 0;
+	int prefetchCancelId = 0;
+	bool showPrefetchStatus = false;
+	bool showFillStatus = false;
+	bool showMetrics = false;
+	std::string limitRequest;
+	std::string signatureDir;
 	for (int i = 1; i < argc; ++i) {
 		if (strcmp(argv[i], "-name") == 0 && (i+1 < argc)) {
 			try
@@ -359,7 +808,7 @@ int main(int argc, char *argv[])
 				continue;
 			}
 		}
-		else if (strcmp(argv[i], "-log") == 0 && (i+1 < argc)) {
+		else if (strcmp(argv[i], "-log") == 0) {
 			try
 			{
 				logToCommandline = true;	
@@ -369,11 +818,78 @@ int main(int argc, char *argv[])
 				continue;
 			}
 		}
+		else if (strcmp(argv[i], "-prefetch") == 0 && (i+1 < argc)) {
+			prefetchSource = std::string(argv[i+1]);
+		}
+		else if (strcmp(argv[i], "-priority") == 0 && (i+1 < argc)) {
+			try
+			{
+				std::string valueString(argv[i+1]);
+				prefetchPriority = std::stoi(valueString);
+			}
+			catch (...)
+			{
+				continue;
+			}
+		}
+		else if (strcmp(argv[i], "-prefetchcancel") == 0 && (i+1 < argc)) {
+			try
+			{
+				std::string valueString(argv[i+1]);
+				prefetchCancelId = std::stoi(valueString);
+			}
+			catch (...)
+			{
+				continue;
+			}
+		}
+		else if (strcmp(argv[i], "-prefetchstatus") == 0) {
+			showPrefetchStatus = true;
+		}
+		else if (strcmp(argv[i], "-fillstatus") == 0) {
+			showFillStatus = true;
+		}
+		else if (strcmp(argv[i], "-metrics") == 0) {
+			showMetrics = true;
+		}
+		else if (strcmp(argv[i], "-limit") == 0 && (i+2 < argc)) {
+			limitRequest = formatStr("limit %s %s\n", argv[i+1], argv[i+2]);
+		}
+		else if (strcmp(argv[i], "-mksig") == 0 && (i+1 < argc)) {
+			signatureDir = std::string(argv[i+1]);
+		}
+	}
+
+	if (!signatureDir.empty()) {
+		return make_signatures(signatureDir);
 	}
 
 	char path[512];
 	getcwd(path, 512);
 
+	// control commands talk to the instance that is already running
+	if (!prefetchSource.empty() || prefetchCancelId > 0 || showPrefetchStatus || showFillStatus || showMetrics
+		|| !limitRequest.empty()) {
+		std::string prefix = name.empty() ? "" : "/" + name;
+		std::string socketPath = std::string(path) + prefix + "/cache/.fusecache.sock";
+		if (prefetchCancelId > 0) {
+			return send_control(socketPath, formatStr("cancel %d\n", prefetchCancelId));
+		}
+		if (showPrefetchStatus) {
+			return send_control(socketPath, "status\n");
+		}
+		if (showFillStatus) {
+			return send_control(socketPath, "fills\n");
+		}
+		if (showMetrics) {
+			return send_control(socketPath, "metrics\n");
+		}
+		if (!limitRequest.empty()) {
+			return send_control(socketPath, limitRequest);
+		}
+		return prefetch(socketPath, prefetchSource, prefetchPriority);
+	}
+
 	if (!name.empty()) {
 		name = "/" + name;
 		std::string subPath = std::string(path) + name;
@@ -400,10 +916,6 @@ int main(int argc, char *argv[])
 
 	g_log = new Log(writeCacheDir + "/fusecache.log", logToCommandline);
 	cache_manager = new CacheManager(g_log);
-	if (!cache_manager->checkDependencies()) {
-		delete cache_manager;
-		return -1;
-	}
 
 	for (int i = 1; i < argc; ++i) {
 		if (strcmp(argv[i], "-readcacheonly") == 0) {
@@ -416,6 +928,35 @@ int main(int argc, char *argv[])
 				continue;
 			}
 		}
+		else if (strcmp(argv[i], "-loglevel") == 0 && (i+1 < argc)) {
+			Log::Level level;
+			if (Log::parseLevel(argv[i+1], level))
+				g_log->setLevel(level);
+			else
+				std::cerr << "Unknown log level: " << argv[i+1] << std::endl;
+		}
+		else if (strcmp(argv[i], "-logsize") == 0 && (i+1 < argc)) {
+			try
+			{
+				std::string valueString(argv[i+1]);
+				g_log->setMaxSize((uint64_t)(std::stod(valueString) * 1024 * 1024));
+			}
+			catch (...)
+			{
+				continue;
+			}
+		}
+		else if (strcmp(argv[i], "-logfiles") == 0 && (i+1 < argc)) {
+			try
+			{
+				std::string valueString(argv[i+1]);
+				g_log->setMaxFiles(std::stoi(valueString));
+			}
+			catch (...)
+			{
+				continue;
+			}
+		}
 		else if (strcmp(argv[i], "-ulimit") == 0 && (i+1 < argc)) {
 			try
 			{
@@ -440,6 +981,237 @@ int main(int argc, char *argv[])
 				continue;
 			}
 		}
+		else if (strcmp(argv[i], "-burst") == 0 && (i+1 < argc)) {
+			try
+			{
+				std::string valueString(argv[i+1]);
+				cache_manager->setBurst(std::stof(valueString));
+			}
+			catch (...)
+			{
+				continue;
+			}
+		}
+		else if (strcmp(argv[i], "-iouring") == 0 && (i+1 < argc)) {
+			try
+			{
+				std::string valueString(argv[i+1]);
+				cache_manager->setIoUringDepth(std::stoul(valueString));
+			}
+			catch (...)
+			{
+				continue;
+			}
+		}
+		else if (strcmp(argv[i], "-chunked") == 0) {
+			cache_manager->setChunked(true);
+		}
+		else if (strcmp(argv[i], "-compress") == 0 && (i+1 < argc)) {
+			if (!cache_manager->setCompression(argv[i+1]))
+				std::cerr << "Unsupported compression: " << argv[i+1] << std::endl;
+		}
+		else if (strcmp(argv[i], "-compressskip") == 0 && (i+1 < argc)) {
+			cache_manager->setCompressSkip(argv[i+1]);
+		}
+		else if (strcmp(argv[i], "-origin") == 0 && (i+1 < argc)) {
+			if (!cache_manager->setOrigin(argv[i+1]))
+				std::cerr << "Unsupported origin: " << argv[i+1] << std::endl;
+		}
+		else if (strcmp(argv[i], "-blocksize") == 0 && (i+1 < argc)) {
+			try
+			{
+				std::string valueString(argv[i+1]);
+				size_t blockSizeInKB = std::stoul(valueString);
+				cache_manager->setBlockSize(blockSizeInKB * 1024);
+			}
+			catch (...)
+			{
+				continue;
+			}
+		}
+		else if (strcmp(argv[i], "-readahead") == 0 && (i+1 < argc)) {
+			try
+			{
+				std::string valueString(argv[i+1]);
+				cache_manager->setMaxReadAhead(std::stoul(valueString));
+			}
+			catch (...)
+			{
+				continue;
+			}
+		}
+		else if (strcmp(argv[i], "-readaheadthreads") == 0 && (i+1 < argc)) {
+			try
+			{
+				std::string valueString(argv[i+1]);
+				cache_manager->setReadAheadThreads(std::stoi(valueString));
+			}
+			catch (...)
+			{
+				continue;
+			}
+		}
+		else if (strcmp(argv[i], "-cachesize") == 0 && (i+1 < argc)) {
+			try
+			{
+				std::string valueString(argv[i+1]);
+				float sizeInGB = std::stof(valueString);
+				cache_manager->setMaxCacheSize((uint64_t)(sizeInGB * 1024.0 * 1024.0 * 1024.0));
+			}
+			catch (...)
+			{
+				continue;
+			}
+		}
+		else if (strcmp(argv[i], "-cachefiles") == 0 && (i+1 < argc)) {
+			try
+			{
+				std::string valueString(argv[i+1]);
+				cache_manager->setMaxCacheFiles(std::stoull(valueString));
+			}
+			catch (...)
+			{
+				continue;
+			}
+		}
+		else if (strcmp(argv[i], "-revalidate") == 0 && (i+1 < argc)) {
+			try
+			{
+				std::string valueString(argv[i+1]);
+				cache_manager->setRevalidateInterval(std::stoi(valueString));
+			}
+			catch (...)
+			{
+				continue;
+			}
+		}
+		else if (strcmp(argv[i], "-statttl") == 0 && (i+1 < argc)) {
+			try
+			{
+				std::string valueString(argv[i+1]);
+				cache_manager->statCache().setTtl(std::stod(valueString));
+			}
+			catch (...)
+			{
+				continue;
+			}
+		}
+		else if (strcmp(argv[i], "-negativettl") == 0 && (i+1 < argc)) {
+			try
+			{
+				std::string valueString(argv[i+1]);
+				cache_manager->statCache().setNegativeTtl(std::stod(valueString));
+			}
+			catch (...)
+			{
+				continue;
+			}
+		}
+		else if (strcmp(argv[i], "-entrytimeout") == 0 && (i+1 < argc)) {
+			try
+			{
+				std::string valueString(argv[i+1]);
+				entry_timeout = std::stod(valueString);
+			}
+			catch (...)
+			{
+				continue;
+			}
+		}
+		else if (strcmp(argv[i], "-attrtimeout") == 0 && (i+1 < argc)) {
+			try
+			{
+				std::string valueString(argv[i+1]);
+				attr_timeout = std::stod(valueString);
+			}
+			catch (...)
+			{
+				continue;
+			}
+		}
+		else if (strcmp(argv[i], "-negativetimeout") == 0 && (i+1 < argc)) {
+			try
+			{
+				std::string valueString(argv[i+1]);
+				negative_timeout = std::stod(valueString);
+			}
+			catch (...)
+			{
+				continue;
+			}
+		}
+		else if (strcmp(argv[i], "-maxdownloads") == 0 && (i+1 < argc)) {
+			try
+			{
+				std::string valueString(argv[i+1]);
+				cache_manager->setMaxDownloads(std::stoi(valueString));
+			}
+			catch (...)
+			{
+				continue;
+			}
+		}
+		else if (strcmp(argv[i], "-syncworkers") == 0 && (i+1 < argc)) {
+			try
+			{
+				std::string valueString(argv[i+1]);
+				cache_manager->setSyncWorkers(std::stoi(valueString));
+			}
+			catch (...)
+			{
+				continue;
+			}
+		}
+		else if (strcmp(argv[i], "-syncinterval") == 0 && (i+1 < argc)) {
+			try
+			{
+				std::string valueString(argv[i+1]);
+				cache_manager->setSyncInterval(std::stoi(valueString));
+			}
+			catch (...)
+			{
+				continue;
+			}
+		}
+		else if (strcmp(argv[i], "-delta") == 0) {
+			cache_manager->setDelta(true);
+		}
+		else if (strcmp(argv[i], "-dedup") == 0) {
+			cache_manager->setDedup(true);
+		}
+		else if (strcmp(argv[i], "-metricsinterval") == 0 && (i+1 < argc)) {
+			try
+			{
+				std::string valueString(argv[i+1]);
+				cache_manager->setMetricsInterval(std::stoi(valueString));
+			}
+			catch (...)
+			{
+				continue;
+			}
+		}
+		else if (strcmp(argv[i], "-prefetchthreads") == 0 && (i+1 < argc)) {
+			try
+			{
+				std::string valueString(argv[i+1]);
+				cache_manager->setPrefetchThreads(std::stoi(valueString));
+			}
+			catch (...)
+			{
+				continue;
+			}
+		}
+		else if (strcmp(argv[i], "-syncdelay") == 0 && (i+1 < argc)) {
+			try
+			{
+				std::string valueString(argv[i+1]);
+				cache_manager->setSyncDelay(std::stoi(valueString));
+			}
+			catch (...)
+			{
+				continue;
+			}
+		}
 	}
 
 	cache_manager->setRootPath(rootPath);
@@ -0,0 +1,104 @@
+#!/bin/bash
+
+# Runs bench/fcbench against a fresh fusecache instance over a local origin
+# directory and writes the results as JSON. Options after "--" are passed
+# to fcbench, options in FUSECACHE_OPTS to fusecache, e.g.
+#
+#   FUSECACHE_OPTS="-chunked -compress zstd" scripts/benchmark.sh -o chunked.json
+#   scripts/benchmark.sh -dlimit 20 -o slow.json -- -scenarios open,seqread -size 64
+#   scripts/benchmark.sh -origin sim:latency=20,bandwidth=10 -o wan.json
+#   scripts/benchmark.sh -compare baseline.json -o results.json
+
+usage() {
+  echo "Usage: $0 [-o results.json] [-dir workdir] [-dlimit MB/s] [-origin spec] [-compare baseline.json] [-tolerance percent] [-- fcbench options]"
+  exit 1
+}
+
+repo="$(cd "$(dirname "$0")/.." && pwd)"
+output="fcbench-results.json"
+workdir=""
+dlimit="0"
+origin="local"
+baseline=""
+tolerance="10"
+
+while [ $# -gt 0 ]; do
+  case "$1" in
+    -o) output="$2"; shift 2 ;;
+    -dir) workdir="$2"; shift 2 ;;
+    -dlimit) dlimit="$2"; shift 2 ;;
+    -origin) origin="$2"; shift 2 ;;
+    -compare) baseline="$2"; shift 2 ;;
+    -tolerance) tolerance="$2"; shift 2 ;;
+    --) shift; break ;;
+    *) usage ;;
+  esac
+done
+
+output="$(realpath -m "$output")"
+
+# Build both binaries unless they are given
+fusecache="${FUSECACHE:-}"
+fcbench="${FCBENCH:-}"
+build="$(mktemp -d)"
+if [ -z "$fusecache" ]; then
+  fusecache="$build/fusecache"
+  (cd "$repo" && g++ -O2 -Wall fusecache.c *.cpp `pkg-config fuse3 --cflags --libs` -lz -o "$fusecache") || exit 1
+fi
+if [ -z "$fcbench" ]; then
+  fcbench="$build/fcbench"
+  g++ -O2 -Wall "$repo/bench/fcbench.cpp" -lpthread -o "$fcbench" || exit 1
+fi
+fusecache="$(realpath "$fusecache")"
+
+# fusecache keeps orig, cache and mnt in its working directory
+if [ -z "$workdir" ]; then
+  workdir="$(mktemp -d)"
+  remove_workdir=true
+fi
+mkdir -p "$workdir"
+workdir="$(realpath "$workdir")"
+
+cleanup() {
+  if mountpoint -q "$workdir/mnt"; then
+    fusermount3 -u "$workdir/mnt" 2>/dev/null || fusermount -u "$workdir/mnt"
+  fi
+  if [ -n "$pid" ]; then
+    wait "$pid" 2>/dev/null
+  fi
+  rm -rf "$build"
+  if [ "$remove_workdir" = true ]; then
+    rm -rf "$workdir"
+  fi
+}
+trap cleanup EXIT
+
+# A simulated origin stands in for a slow share, the local one runs unshaped
+cd "$workdir" || exit 1
+"$fusecache" -dlimit "$dlimit" -ulimit 0 -origin "$origin" $FUSECACHE_OPTS > fusecache.out 2>&1 &
+pid=$!
+
+for i in $(seq 100); do
+  mountpoint -q "$workdir/mnt" && break
+  if ! kill -0 "$pid" 2>/dev/null; then
+    echo "Error: fusecache exited, see $workdir/fusecache.out"
+    cat fusecache.out
+    exit 1
+  fi
+  sleep 0.1
+done
+if ! mountpoint -q "$workdir/mnt"; then
+  echo "Error: $workdir/mnt was not mounted"
+  exit 1
+fi
+
+"$fcbench" -mnt "$workdir/mnt" -orig "$workdir/orig" "$@" > "$output" || exit 1
+echo "Results written to $output"
+
+# The instance's own counters and latency histograms of the same run
+"$fusecache" -metrics > "${output%.json}.prom" 2>/dev/null
+
+if [ -n "$baseline" ]; then
+  "$fcbench" -compare "$baseline" "$output" -tolerance "$tolerance"
+  exit $?
+fi
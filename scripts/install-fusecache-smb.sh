@@ -23,7 +23,7 @@ fi
 
 # Compile fusecache
 cd fusecache || exit
-g++ -Wall fusecache.c CacheManager.cpp `pkg-config fuse3 --cflags --libs` -o fusecache
+g++ -Wall fusecache.c *.cpp `pkg-config fuse3 --cflags --libs` -o fusecache
 cd ..
 
 # Enable 'user_allow_other' in /etc/fuse.conf if not already enabled
@@ -1,35 +1,23 @@
 #!/bin/bash
 
-if [ $# -ne 1 ]; then
-  echo "Usage: $0 <source_directory>"
+# Warms the cache of a running fusecache instance. The files are fetched
+# in parallel by the instance itself; see "fusecache -prefetch" in the README.
+
+if [ $# -lt 1 ] || [ $# -gt 2 ]; then
+  echo "Usage: $0 <source_directory|manifest|-> [name]"
   exit 1
 fi
 
-src_dir="$1"
+src="$1"
+fusecache="${FUSECACHE:-fusecache}"
 
-if [ ! -d "$src_dir" ]; then
-  echo "Error: Source directory does not exist: $src_dir"
+if [ "$src" != "-" ] && [ ! -e "$src" ]; then
+  echo "Error: Source does not exist: $src"
   exit 1
 fi
 
-# Get file list and stats first
-mapfile -t file_list < <(find "$src_dir" -type f -print0 | tr '\0' '\n')
-file_count=${#file_list[@]}
-total_size=$(du -sb "$src_dir" | awk '{print $1}')
-
-echo "Pre-caching $file_count files totaling ${total_size} bytes from $src_dir"
-echo "Starting file-by-file processing..."
-
-current_file=0
-for file in "${file_list[@]}"; do
-  current_file=$((current_file + 1))
-  filename=$(basename "$file")
-  
-  # Show current file before reading (clear line, update in place)
-  printf "\r\033[K[%d/%d] Now caching: %s" "$current_file" "$file_count" "$filename"
-  
-  # Read file to cache (non-blocking display)
-  cat "$file" > /dev/null 2>/dev/null
-done
+if [ $# -eq 2 ]; then
+  exec "$fusecache" -name "$2" -prefetch "$src"
+fi
 
-printf "\r\033[KPre-caching complete! All %d files processed successfully.\n" "$file_count"
+exec "$fusecache" -prefetch "$src"